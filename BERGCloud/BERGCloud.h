@@ -27,8 +27,10 @@ THE SOFTWARE.
 #ifndef BERGCLOUD_H
 #define BERGCLOUD_H
 
-#ifdef ARDUINO
+#if defined(ARDUINO)
 #include "BERGCloudArduino.h"
+#elif defined(__linux__)
+#include "BERGCloudLinux.h"
 #else
 #error Please #include "BERGCloudMbed.h" or "BERGCloudLinux.h" instead.
 #endif
@@ -62,6 +62,7 @@ uint16_t CBERGCloudArduino::SPITransaction(uint8_t *pDataOut, uint8_t *pDataIn,
 void CBERGCloudArduino::timerReset(void)
 {
   m_resetTime = millis();
+  m_resetTime_uS = micros();
 }
 
 uint32_t CBERGCloudArduino::timerRead_mS(void)
@@ -69,6 +70,11 @@ uint32_t CBERGCloudArduino::timerRead_mS(void)
   return millis() - m_resetTime;
 }
 
+uint32_t CBERGCloudArduino::timerRead_uS(void)
+{
+  return micros() - m_resetTime_uS;
+}
+
 void CBERGCloudArduino::begin(SPIClass *pSPI, uint8_t nSSELPin)
 {
   /* Call base class method */
@@ -116,7 +122,12 @@ void CBERGCloudArduino::logPrintf(const char *format, ...)
   va_list argList;
 
   va_start(argList, format);
+#ifdef __AVR__
+  /* Format strings are in flash */
+  vsnprintf_P(m_logText, sizeof(m_logText), format, argList);
+#else
   vsnprintf(m_logText, sizeof(m_logText), format, argList);
+#endif
   va_end(argList);
 
   Serial.print(m_logText);
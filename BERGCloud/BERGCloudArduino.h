@@ -41,9 +41,11 @@ private:
   uint16_t SPITransaction(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS);
   void timerReset(void);
   uint32_t timerRead_mS(void);
+  uint32_t timerRead_uS(void);
   uint8_t m_nSSELPin;
   SPIClass *m_pSPI;
   uint32_t m_resetTime;
+  uint32_t m_resetTime_uS;
 
 #ifdef _BC_LOG
 
@@ -28,533 +28,2812 @@ THE SOFTWARE.
 #define __STDC_LIMIT_MACROS /* Include C99 stdint defines in C++ code */
 #include <stdint.h>
 #include <stddef.h>
-#include <string.h> /* For memcpy() */
+#include <stdarg.h>
+#include <string.h> /* For memcpy(), memset() */
 
 #include "BERGCloudBase.h"
+#include "CRC16.h"
 
-#define SPI_PROTOCOL_HEADER_SIZE (5) // Data length, CRC16 and command/status
-#define MAX_DATA_SIZE (MAX_SERIAL_DATA + SPI_PROTOCOL_HEADER_SIZE)
-
-#define SPI_PROTOCOL_PAD    (0xff)
-#define SPI_PROTOCOL_RESET  (0xf5)
-
+/* Defaults, see setTimeouts() and setPollBackoff() */
+#ifndef POLL_TIMEOUT_MS
 #define POLL_TIMEOUT_MS (1000)
+#endif
+
+#ifndef SYNC_TIMEOUT_MS
 #define SYNC_TIMEOUT_MS (1000)
+#endif
+
+#ifndef POLL_INTERVAL_MAX_MS
+#define POLL_INTERVAL_MAX_MS (4)
+#endif
+
+/* Time allowed for a whole fragmented event or command when the */
+/* caller has not given a deadline */
+#ifndef FRAGMENT_TIMEOUT_MS
+#define FRAGMENT_TIMEOUT_MS (5000)
+#endif
+
+/* First wait before polling again for the next fragment of a command */
+/* that hasn't arrived, doubling up to the setPollBackoff() maximum */
+#define _BC_FRAG_HOLD_MIN_US (250)
+
+/* Attempts to send each fragment */
+#ifndef FRAGMENT_RETRIES
+#define FRAGMENT_RETRIES (2)
+#endif
+
+/* Default maximum age of batched events, see setBatchMaxAge() */
+#ifndef BATCH_MAX_AGE_MS
+#define BATCH_MAX_AGE_MS (1000)
+#endif
+
+/* Delay before retrying a queued event, doubling up to the maximum */
+#ifndef QUEUE_RETRY_MIN_MS
+#define QUEUE_RETRY_MIN_MS (100)
+#endif
+
+#ifndef QUEUE_RETRY_MAX_MS
+#define QUEUE_RETRY_MAX_MS (5000)
+#endif
+
+/* Retries of a queued event before it is dropped */
+#ifndef QUEUE_RETRY_LIMIT
+#define QUEUE_RETRY_LIMIT (8)
+#endif
+
+/* Default time network and claim state are cached, see setCacheTTL() */
+#ifndef CACHE_TTL_MS
+#define CACHE_TTL_MS (1000)
+#endif
+
+#ifdef BERGCLOUD_CACHE
+/* Cached values, bits of m_cacheValid */
+#define _BC_CACHE_EUI64(type)     (0x01 << (type))
+#define _BC_CACHE_CLAIMCODE       0x08
+#define _BC_CACHE_NETWORK_STATE   0x10
+#define _BC_CACHE_CLAIM_STATE     0x20
+
+/* Those that may change when the shield joins or resets */
+#define _BC_CACHE_LINK (_BC_CACHE_EUI64(BC_EUI64_PARENT) | _BC_CACHE_EUI64(BC_EUI64_COORDINATOR) | \
+                        _BC_CACHE_NETWORK_STATE | _BC_CACHE_CLAIM_STATE)
+#endif
+
+/* Log format strings are in flash on AVR */
+#ifdef __AVR__
+#define _BC_LOG_READ(p) ((char)pgm_read_byte(p))
+#else
+#define _BC_LOG_READ(p) (*(p))
+#endif
+
+/* Statistics, see getStats() */
+#ifdef BERGCLOUD_STATS
+#define _BC_STAT(x)       m_stats.x++;
+#define _BC_STAT_BYTES(n) m_trBytes += (n);
+#else
+#define _BC_STAT(x)
+#define _BC_STAT_BYTES(n)
+#endif
+
+/* Transaction states */
+#define _BC_TR_IDLE         (0)
+#define _BC_TR_SYNC         (1)
+#define _BC_TR_SEND_HEADER  (2)
+#define _BC_TR_SEND_DATA    (3)
+#define _BC_TR_POLL         (4)
+#define _BC_TR_READ_HEADER  (5)
+#define _BC_TR_READ_DATA    (6)
+#define _BC_TR_HOLD         (7) /* Waiting to start, see fragmentNext() */
+
+/* Receive buffer size used when clocking out data or discarding input */
+#ifndef SPI_BURST_SIZE
+#define SPI_BURST_SIZE (16)
+#endif
+
+/* Synchronisation is clocked in bursts of SPI_BURST_SIZE pad bytes. */
+/* With BERGCLOUD_SYNC_REQUEST, after the first each starts with a */
+/* frame header too small to be valid, which is expected to make the */
+/* shield reset (see BERGCloudConfig.h). */
+#ifdef BERGCLOUD_SYNC_REQUEST
+#define _BC_SYNC_REQUEST_SIZE (2)
+#endif
 
 uint8_t CBERGCloudBase::nullProductID[16] = {0};
 
-uint16_t CBERGCloudBase::Crc16(uint8_t data, uint16_t crc)
-{
-  /* From Ember's code */
-  crc = (crc >> 8) | (crc << 8);
-  crc ^= data;
-  crc ^= (crc & 0xff) >> 4;
-  crc ^= (crc << 8) << 4;
-
-  crc ^= ( (uint8_t) ( (uint8_t) ( (uint8_t) (crc & 0xff) ) << 5)) |
-    ((uint16_t) ( (uint8_t) ( (uint8_t) (crc & 0xff)) >> 3) << 8);
-
-  return crc;
-}
-
-bool CBERGCloudBase::transaction(_BC_TRANSACTION *pTr)
+bool CBERGCloudBase::transactionStart(_BC_TRANSACTION *pTr)
 {
-  uint16_t i;
-  uint8_t rxByte;
-  bool timeout;
-  uint16_t dataSize;
-  uint16_t dataCRC;
-  uint16_t calcCRC;
-  uint8_t header[SPI_PROTOCOL_HEADER_SIZE];
   uint16_t commandSize;
-  uint8_t response;
+  uint16_t txSize = 0;
+  uint16_t calcCRC;
+  uint8_t i;
+
+  if (m_trState != _BC_TR_IDLE)
+  {
+    _LOG_ERROR("Busy (CBERGCloudBase::transactionStart)\r\n");
+    return false;
+  }
 
   /* Validate parameters */
-  if (  ((pTr->pTx == NULL) && (pTr->txSize != 0)) ||
-        (pTr->txSize > MAX_SERIAL_DATA) )
+  if (pTr->txSegments > _BC_TX_SEGMENTS)
   {
-    _LOG_ERROR("Invalid parameter (CBERGCloudBase::transaction)\r\n");
+    _LOG_ERROR("Invalid parameter (CBERGCloudBase::transactionStart)\r\n");
     return false;
   }
 
-  /* Check synchronisation */
-  if (!m_synced)
+  for (i = 0; i < pTr->txSegments; i++)
   {
-    timerReset();
-    timeout = false;
+    if (  ((pTr->tx[i].pData == NULL) && (pTr->tx[i].size != 0)) ||
+          (pTr->tx[i].size > (MAX_SERIAL_DATA - txSize)) )
+    {
+      _LOG_ERROR("Invalid parameter (CBERGCloudBase::transactionStart)\r\n");
+      return false;
+    }
 
-    do {
-      rxByte = SPITransaction(SPI_PROTOCOL_PAD, true);
-      timeout = timerRead_mS() > SYNC_TIMEOUT_MS;
+    txSize += pTr->tx[i].size;
+  }
 
-    } while ((rxByte != SPI_PROTOCOL_RESET) && !timeout);
+  if (pTr->rxSegments > _BC_RX_SEGMENTS)
+  {
+    _LOG_ERROR("Invalid parameter (CBERGCloudBase::transactionStart)\r\n");
+    return false;
+  }
 
-    if (timeout)
+  for (i = 0; i < pTr->rxSegments; i++)
+  {
+    if ((pTr->rx[i].pData == NULL) && (pTr->rx[i].size != 0))
     {
-      _LOG_ERROR("Timeout, sync (CBERGCloudBase::transaction)\r\n");
+      _LOG_ERROR("Invalid parameter (CBERGCloudBase::transactionStart)\r\n");
       return false;
     }
-
-    /* Resynchronisation successful */
-    m_synced = true;
   }
 
+  m_tr = *pTr;
+  m_trStart_mS = timerRead_mS();
+
+#ifdef BERGCLOUD_STATS
+  m_trStart_uS = timerRead_uS();
+  m_trBytes = 0;
+#endif
+
   /* Command size is header plus data */
-  commandSize = SPI_PROTOCOL_HEADER_SIZE + pTr->txSize;
+  commandSize = SPI_PROTOCOL_HEADER_SIZE + txSize;
 
   /* Set command size in header */
-  header[0] = commandSize >> 8;    /* MSByte */
-  header[1] = commandSize & 0xff;  /* LSByte */
+  m_header[0] = commandSize >> 8;    /* MSByte */
+  m_header[1] = commandSize & 0xff;  /* LSByte */
 
   /* Zero CRC in header */
-  header[2] = 0;
-  header[3] = 0;
+  m_header[2] = 0;
+  m_header[3] = 0;
 
   /* Set command */
-  header[4] = pTr->command;
+  m_header[4] = m_tr.command;
+
+  /* Calculate CRC (header and data), the data is sent directly from */
+  /* each segment so is never copied into one buffer */
+  calcCRC = crc16(m_header, SPI_PROTOCOL_HEADER_SIZE, CRC16_INIT);
 
-  /* Calculate CRC (header and data) */
-  calcCRC = 0xffff;
-  
-  for (i=0; i<SPI_PROTOCOL_HEADER_SIZE; i++)
+  for (i = 0; i < m_tr.txSegments; i++)
   {
-    calcCRC = Crc16(header[i], calcCRC);
+    calcCRC = crc16(m_tr.tx[i].pData, m_tr.tx[i].size, calcCRC);
   }
 
-  for (i=0; i<pTr->txSize; i++)
+  /* Set CRC in header */
+  m_header[2] = calcCRC >> 8;    /* MSByte */
+  m_header[3] = calcCRC & 0xff;  /* LSByte */
+
+#ifdef BERGCLOUD_TRACE
+  traceRequest();
+#endif
+
+  /* Check synchronisation first if necessary */
+  transactionPhase(m_synced ? _BC_TR_SEND_HEADER : _BC_TR_SYNC);
+  m_trSegment = 0;
+
+#ifdef BERGCLOUD_STATS
+  m_syncStart_uS = timerRead_uS();
+#endif
+
+  if (!m_trInternal)
   {
-    calcCRC = Crc16(pTr->pTx[i], calcCRC);
+    m_asyncStatus = BC_ASYNC_BUSY;
   }
 
-  /* Set CRC in header */
-  header[2] = calcCRC >> 8;    /* MSByte */
-  header[3] = calcCRC & 0xff;  /* LSByte */
+  return true;
+}
+
+void CBERGCloudBase::transactionPhase(uint8_t state)
+{
+  m_trState = state;
+  m_trOffset = 0;
+  m_trPhaseStart_mS = timerRead_mS();
+}
+
+bool CBERGCloudBase::transactionTimeout(uint32_t timeout_mS)
+{
+  /* Phase timeout, or the caller's deadline for the whole request */
+  uint32_t now_mS = timerRead_mS();
 
-  /* Send header */
-  for (i=0; i<SPI_PROTOCOL_HEADER_SIZE; i++)
+  if ((m_tr.deadline_mS != BC_DEADLINE_NONE) && ((now_mS - m_trStart_mS) > m_tr.deadline_mS))
   {
-    rxByte = SPITransaction(header[i], false);
+    return true;
+  }
 
-    if (rxByte == SPI_PROTOCOL_RESET)
-    {
-      _LOG_ERROR("Reset, send header (CBERGCloudBase::transaction)\r\n");
-      return false;
-    }
+  return (now_mS - m_trPhaseStart_mS) > timeout_mS;
+}
 
-    if (rxByte != SPI_PROTOCOL_PAD)
+uint8_t CBERGCloudBase::pollEstimateSlot(uint8_t command)
+{
+  /* Response times are learnt per SPI command, so a quick status query */
+  /* isn't held off for as long as an event sent over the radio. A */
+  /* command not seen recently takes the next slot and starts at zero. */
+  uint8_t i;
+
+  for (i = 0; i < POLL_ESTIMATE_COMMANDS; i++)
+  {
+    if (m_pollCommand[i] == command)
     {
-      _LOG_ERROR("SyncErr, send header (CBERGCloudBase::transaction)\r\n");
-      m_synced = false;
-      return false;
+      return i;
     }
   }
 
-  /* Send data */
-  for (i=0; i<pTr->txSize; i++)
+  i = m_pollSlotNext;
+  m_pollSlotNext = (m_pollSlotNext + 1) % POLL_ESTIMATE_COMMANDS;
+  m_pollCommand[i] = command;
+  m_pollEstimate_uS[i] = 0;
+  return i;
+}
+
+void CBERGCloudBase::pollSchedule(void)
+{
+  /* Hold off the first poll until most of the typical response time */
+  /* has passed, poll a few times around the expected time, then widen */
+  /* the interval the longer the response is overdue */
+  uint32_t estimate_uS;
+  uint32_t elapsed_uS;
+  uint32_t interval_uS;
+
+  if (m_trOffset == 0)
   {
-    rxByte = SPITransaction(pTr->pTx[i], false);
+    m_pollStart_uS = timerRead_uS();
+    m_pollSlot = pollEstimateSlot(m_tr.command);
+  }
 
-    if (rxByte == SPI_PROTOCOL_RESET)
-    {
-      _LOG_ERROR("Reset, send data (CBERGCloudBase::transaction)\r\n");
-      return false;
-    }
+  if (m_pollIntervalMax_uS == 0)
+  {
+    /* Back off disabled */
+    m_pollNext_uS = 0;
+    return;
+  }
 
-    if (rxByte != SPI_PROTOCOL_PAD)
-    {
-      _LOG_ERROR("SyncErr, send data (CBERGCloudBase::transaction)\r\n");
-      m_synced = false;
-      return false;
-    }
+  estimate_uS = m_pollEstimate_uS[m_pollSlot];
+
+  if (m_trOffset == 0)
+  {
+    m_pollNext_uS = (estimate_uS / 4) * 3;
+    return;
   }
 
-  /* Poll for response */
-  timerReset();
-  timeout = false;
+  elapsed_uS = m_pollLast_uS;
+  interval_uS = estimate_uS / 16;
+
+  if (elapsed_uS > estimate_uS)
+  {
+    interval_uS += (elapsed_uS - estimate_uS) / 4;
+  }
+
+  if (interval_uS > m_pollIntervalMax_uS)
+  {
+    interval_uS = m_pollIntervalMax_uS;
+  }
+
+  m_pollNext_uS = elapsed_uS + interval_uS;
+}
+
+void CBERGCloudBase::pollLearn(void)
+{
+  /* Moving average of the time to the first response byte. The */
+  /* response became ready somewhere between the last two polls. */
+  uint32_t observed_uS = timerRead_uS() - m_pollStart_uS;
+  uint32_t *pEstimate_uS = &m_pollEstimate_uS[m_pollSlot];
+
+  if (m_trOffset > 0)
+  {
+    observed_uS = m_pollLast_uS + ((observed_uS - m_pollLast_uS) / 2);
+  }
+
+  if (observed_uS > *pEstimate_uS)
+  {
+    *pEstimate_uS += (observed_uS - *pEstimate_uS) / 4;
+  }
+  else
+  {
+    *pEstimate_uS -= (*pEstimate_uS - observed_uS) / 4;
+  }
+}
+
+void CBERGCloudBase::transactionEnd(bool success)
+{
+  bool transferred = success;
+
+#ifdef BERGCLOUD_TRACE
+  traceEnd(transferred);
+#endif
 
-  do {
-    rxByte = SPITransaction(SPI_PROTOCOL_PAD, false);
+  m_trState = _BC_TR_IDLE;
 
-    if (rxByte == SPI_PROTOCOL_RESET)
+#ifdef BERGCLOUD_STATS
+  statsRecord(transferred);
+#endif
+
+  if (success)
+  {
+    if (m_tr.command == SPI_CMD_POLL_FOR_COMMAND)
     {
-      _LOG_ERROR("Reset, poll (CBERGCloudBase::transaction)\r\n");
-      return false;
+      success = commandReceived();
+    }
+    else
+    {
+      success = (m_lastResponse == SPI_RSP_SUCCESS);
     }
+  }
 
-    // PW TODO: Check if != PAD -> synched=FALSE
-    timeout = timerRead_mS() > POLL_TIMEOUT_MS;
-    
-  } while ((rxByte == SPI_PROTOCOL_PAD) && !timeout);
+#ifdef BERGCLOUD_CACHE
+  if (success)
+  {
+    cacheStore();
+  }
+#endif
 
-  if (timeout)
+#ifdef BERGCLOUD_FRAGMENTATION
+  if (m_fragActive && fragmentNext(transferred, &success))
   {
-    _LOG_ERROR("Timeout, poll (CBERGCloudBase::transaction)\r\n");
-    m_synced = false;
-    return false;
+    /* Next fragment started */
+    return;
+  }
+#endif
+
+#ifdef BERGCLOUD_BATCHING
+  if (m_batchSending)
+  {
+    batchSent(success);
+  }
+#endif
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+  if (m_queueSending)
+  {
+    queueSent(transferred, success);
   }
+#endif
 
-  // PW TODO: Should we 'escape' 0xf5?
+#if !defined(BERGCLOUD_FRAGMENTATION) && !defined(BERGCLOUD_EVENT_QUEUE)
+  (void)transferred;
+#endif
+
+  if (m_trInternal)
+  {
+    /* Leave the status of the caller's last request */
+    m_trInternal = false;
+    return;
+  }
 
-  /* Read header, we already have the first byte */
-  header[0] = rxByte;
+  m_asyncStatus = success ? BC_ASYNC_SUCCESS : BC_ASYNC_FAILED;
 
-  for (i=1; i < SPI_PROTOCOL_HEADER_SIZE; i++)
+  /* The callback may start another request */
+  if (m_completionFn != NULL)
   {
-    header[i] = SPITransaction(SPI_PROTOCOL_PAD, false);
+    m_completionFn(m_completionContext, m_tr.command, m_asyncStatus);
   }
+}
+
+void CBERGCloudBase::transactionHeaderReceived(void)
+{
+  uint16_t commandSize;
+
+#ifdef BERGCLOUD_TRACE
+  traceStart(BC_TRACE_RESPONSE, SPI_PROTOCOL_HEADER_SIZE);
+  traceAdd(m_header, SPI_PROTOCOL_HEADER_SIZE);
+#endif
 
   /* Read command size (header plus data) */
-  commandSize = header[0]; /* MSByte */
+  commandSize = m_header[0]; /* MSByte */
   commandSize <<= 8;
-  commandSize |= header[1]; /* LSByte */
+  commandSize |= m_header[1]; /* LSByte */
 
   /* Validate command size */
   if (commandSize > MAX_DATA_SIZE)
   {
     /* Too big */
-    _LOG_ERROR("SizeErr, read header (CBERGCloudBase::transaction)\r\n");
+    _LOG_ERROR("SizeErr, read header (CBERGCloudBase::service)\r\n");
+    _BC_STAT(sizeErrors)
     m_synced = false;
-    return false;
+    transactionEnd(false);
+    return;
   }
 
   if (commandSize < SPI_PROTOCOL_HEADER_SIZE)
   {
     /* Too small */
-    _LOG_ERROR("SizeErr, read header (CBERGCloudBase::transaction)\r\n");
+    _LOG_ERROR("SizeErr, read header (CBERGCloudBase::service)\r\n");
+    _BC_STAT(sizeErrors)
     m_synced = false;
-    return false;
+    transactionEnd(false);
+    return;
   }
 
   /* Calculate data size */
-  dataSize = commandSize - SPI_PROTOCOL_HEADER_SIZE;
-
-  /* Read the remaining data */
-  for (i = 0; i < dataSize; i++)
-  {
-    rxByte = SPITransaction(SPI_PROTOCOL_PAD, i < dataSize ? false : true);
-    
-    if (pTr->pRx != NULL)
-    {
-      pTr->pRx[i] = rxByte;
-    }
-  }
+  m_rxDataSize = commandSize - SPI_PROTOCOL_HEADER_SIZE;
 
   /* Read CRC */
-  dataCRC = header[2]; /* MSByte */
-  dataCRC <<= 8;
-  dataCRC |= header[3]; /* LSByte */
+  m_rxCRC = m_header[2]; /* MSByte */
+  m_rxCRC <<= 8;
+  m_rxCRC |= m_header[3]; /* LSByte */
 
   /* Clear CRC bytes */
-  header[2] = 0;
-  header[3] = 0;
+  m_header[2] = 0;
+  m_header[3] = 0;
+
+  /* Calculate CRC (header and data) while reading the data; */
+  /* anything beyond the caller's buffers is read and discarded */
+  m_trCRC = crc16(m_header, SPI_PROTOCOL_HEADER_SIZE, CRC16_INIT);
+  transactionRxLimit();
 
-  /* Calculate CRC (header and data) */
-  calcCRC = 0xffff;
+  transactionPhase(_BC_TR_READ_DATA);
+  m_trSegment = 0;
+  m_rxSegmentOffset = 0;
 
-  for (i=0; i<SPI_PROTOCOL_HEADER_SIZE; i++)
+  if (m_rxDataSize == 0)
   {
-    calcCRC = Crc16(header[i], calcCRC);
+    transactionDataReceived();
   }
+}
+
+void CBERGCloudBase::transactionRxLimit(void)
+{
+  /* Work out how much of the response data fits the receive buffers */
+  uint16_t rxSize = 0;
+  uint8_t i;
 
-  for (i=0; i<dataSize; i++)
+  for (i = 0; i < m_tr.rxSegments; i++)
   {
-    calcCRC = Crc16(pTr->pRx[i], calcCRC);
+    rxSize += m_tr.rx[i].size;
   }
 
-  if (calcCRC != dataCRC)
+  m_rxTruncated = (m_rxDataSize > rxSize);
+  m_rxStored = m_rxTruncated ? rxSize : m_rxDataSize;
+}
+
+void CBERGCloudBase::transactionDataReceived(void)
+{
+#ifdef BERGCLOUD_TRACE
+  traceResponseData();
+#endif
+
+  if (m_trCRC != m_rxCRC)
   {
     /* Invalid CRC */
-    _LOG_ERROR("CRCErr, read data (CBERGCloudBase::transaction)\r\n");
+    _LOG_ERROR("CRCErr, read data (CBERGCloudBase::service)\r\n");
+    _BC_STAT(crcErrors)
     m_synced = false;
-    return false;
+    transactionEnd(false);
+    return;
   }
 
   /* Check response */
-  response = header[4];
-
-  if (pTr->pResponse != NULL)
+  if (m_tr.pResponse != NULL)
   {
-    *pTr->pResponse = response;
+    *m_tr.pResponse = m_header[4];
   }
 
-  if (pTr->pRxSize != NULL)
+  if (m_tr.pRxSize != NULL)
   {
-    *pTr->pRxSize = dataSize;
+    *m_tr.pRxSize = m_rxDataSize;
   }
 
-  return true;
+  transactionEnd(true);
 }
 
-bool CBERGCloudBase::pollForCommand(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint16_t *pCommandSize, uint8_t *pCommandID)
+uint8_t CBERGCloudBase::service(uint16_t maxBytes)
 {
-  /* Returns TRUE if a command has been received */
-
-  _BC_TRANSACTION tr;
-  uint16_t commandSize;
-  uint8_t rxDataBuffer[MAX_SERIAL_DATA+2];
-  int i;
-
-  tr.command = SPI_CMD_POLL_FOR_COMMAND;
-  tr.pTx = NULL;
-  tr.txSize = 0;
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = rxDataBuffer;
-  tr.rxMaxSize = sizeof(rxDataBuffer);
-  tr.pRxSize = &commandSize;
+  /* Advance the current request, clocking at most maxBytes */
+  uint8_t burst[SPI_BURST_SIZE];
+  uint16_t i;
+  uint8_t rxByte;
+  uint16_t size;
 
-  if (!transaction(&tr))
+#ifdef BERGCLOUD_BATCHING
+  if ((m_trState == _BC_TR_IDLE) && batchDue())
   {
-    return false;
+    /* Send batched events that have waited long enough */
+    m_trInternal = true;
+    m_trInternal = flushEventsAsync(BC_DEADLINE_NONE);
   }
+#endif
 
-  if (m_lastResponse != SPI_RSP_SUCCESS)
+#ifdef BERGCLOUD_EVENT_QUEUE
+  if (m_trState == _BC_TR_IDLE)
   {
-    return false;
+    queueSend();
   }
+#endif
 
-  if (commandSize < 2)
+  while ((m_trState != _BC_TR_IDLE) && (maxBytes > 0))
   {
-    return false;
+    switch (m_trState)
+    {
+#ifdef BERGCLOUD_FRAGMENTATION
+    case _BC_TR_HOLD:
+      if ((timerRead_uS() - m_pollStart_uS) < m_pollNext_uS)
+      {
+        if (transactionTimeout(m_pollTimeout_mS))
+        {
+          _LOG_ERROR("Timeout, hold (CBERGCloudBase::service)\r\n");
+          transactionEnd(false);
+          break;
+        }
+
+        /* Backing off, nothing to clock yet */
+        return m_asyncStatus;
+      }
+
+      transactionPhase(m_synced ? _BC_TR_SEND_HEADER : _BC_TR_SYNC);
+      break;
+#endif
+
+    case _BC_TR_SYNC:
+#ifdef BERGCLOUD_SYNC_REQUEST
+      /* m_trOffset is the offset into the burst, m_trSegment is set */
+      /* after the first. The first is a single pad byte in case the */
+      /* shield is already waiting to send a reset byte. */
+      size = ((m_trSegment > 0) ? sizeof(burst) : 1) - m_trOffset;
+#else
+      size = sizeof(burst);
+#endif
+      size = (size < maxBytes) ? size : maxBytes;
+
+      for (i = 0; i < size; i++)
+      {
+#ifdef BERGCLOUD_SYNC_REQUEST
+        burst[i] = ((m_trSegment > 0) && ((m_trOffset + i) < _BC_SYNC_REQUEST_SIZE)) ? 0x00 : SPI_PROTOCOL_PAD;
+#else
+        burst[i] = SPI_PROTOCOL_PAD;
+#endif
+      }
+
+      SPITransaction(burst, burst, size, true);
+      _BC_STAT_BYTES(size)
+      maxBytes -= size;
+      rxByte = SPI_PROTOCOL_PAD;
+
+      for (i = 0; i < size; i++)
+      {
+        /* Only a reset byte that follows a pad counts, one left in */
+        /* the data of an abandoned response doesn't */
+        if ((burst[i] == SPI_PROTOCOL_RESET) && m_syncPad
+#ifdef BERGCLOUD_SYNC_REQUEST
+          /* A reset byte before the request has been sent would be */
+          /* followed by the shield receiving the rest of it */
+          && ((m_trSegment == 0) || ((m_trOffset + i) >= _BC_SYNC_REQUEST_SIZE))
+#endif
+          )
+        {
+          rxByte = SPI_PROTOCOL_RESET;
+          break;
+        }
+
+        m_syncPad = (burst[i] == SPI_PROTOCOL_PAD);
+      }
+
+#ifdef BERGCLOUD_STATS
+      m_stats.resyncBytes += size;
+#endif
+#ifdef BERGCLOUD_SYNC_REQUEST
+      m_trOffset += size;
+
+      if ((m_trSegment == 0) || (m_trOffset == sizeof(burst)))
+      {
+        m_trOffset = 0;
+        m_trSegment = 1;
+      }
+#endif
+
+      if (rxByte == SPI_PROTOCOL_RESET)
+      {
+        /* Resynchronisation successful */
+        _BC_STAT(resyncs)
+#ifdef BERGCLOUD_STATS
+        statsResync();
+#endif
+#ifdef BERGCLOUD_CACHE
+        m_cacheValid &= ~_BC_CACHE_LINK;
+#endif
+#ifdef BERGCLOUD_TRACE
+        traceStart(BC_TRACE_SYNC, 0);
+#endif
+        m_synced = true;
+        m_syncPad = false;
+        transactionPhase(_BC_TR_SEND_HEADER);
+      }
+      else if (transactionTimeout(m_syncTimeout_mS))
+      {
+        _LOG_ERROR("Timeout, sync (CBERGCloudBase::service)\r\n");
+        _BC_STAT(syncTimeouts)
+        transactionEnd(false);
+      }
+      break;
+
+    case _BC_TR_SEND_HEADER:
+      size = SPI_PROTOCOL_HEADER_SIZE - m_trOffset;
+      size = (size < maxBytes) ? size : maxBytes;
+      rxByte = SPISendBlock(&m_header[m_trOffset], size);
+      m_trOffset += size;
+      maxBytes -= size;
+
+      if (rxByte == SPI_PROTOCOL_RESET)
+      {
+        _LOG_ERROR("Reset, send header (CBERGCloudBase::service)\r\n");
+        _BC_STAT(resets)
+        /* The rest of the block reached the shield after it reset */
+        m_synced = false;
+        transactionEnd(false);
+      }
+      else if (rxByte != SPI_PROTOCOL_PAD)
+      {
+        _LOG_ERROR("SyncErr, send header (CBERGCloudBase::service)\r\n");
+        _BC_STAT(syncErrors)
+        m_synced = false;
+        transactionEnd(false);
+      }
+      else if (m_trOffset == SPI_PROTOCOL_HEADER_SIZE)
+      {
+        /* m_trOffset is the offset into segment m_trSegment */
+        transactionPhase(_BC_TR_SEND_DATA);
+        m_trSegment = 0;
+      }
+      break;
+
+    case _BC_TR_SEND_DATA:
+      if (m_trSegment == m_tr.txSegments)
+      {
+        /* Poll for response, m_trOffset counts the pad bytes */
+        transactionPhase(_BC_TR_POLL);
+        pollSchedule();
+        break;
+      }
+
+      size = m_tr.tx[m_trSegment].size - m_trOffset;
+      size = (size < maxBytes) ? size : maxBytes;
+      rxByte = SPISendBlock(&m_tr.tx[m_trSegment].pData[m_trOffset], size);
+      m_trOffset += size;
+      maxBytes -= size;
+
+      if (rxByte == SPI_PROTOCOL_RESET)
+      {
+        _LOG_ERROR("Reset, send data (CBERGCloudBase::service)\r\n");
+        _BC_STAT(resets)
+        /* The rest of the block reached the shield after it reset */
+        m_synced = false;
+        transactionEnd(false);
+      }
+      else if (rxByte != SPI_PROTOCOL_PAD)
+      {
+        _LOG_ERROR("SyncErr, send data (CBERGCloudBase::service)\r\n");
+        _BC_STAT(syncErrors)
+        m_synced = false;
+        transactionEnd(false);
+      }
+      else if (m_trOffset == m_tr.tx[m_trSegment].size)
+      {
+        /* Next segment */
+        m_trSegment++;
+        m_trOffset = 0;
+      }
+      break;
+
+    case _BC_TR_POLL:
+      if ((timerRead_uS() - m_pollStart_uS) < m_pollNext_uS)
+      {
+        if (transactionTimeout(m_pollTimeout_mS))
+        {
+          _LOG_ERROR("Timeout, poll (CBERGCloudBase::service)\r\n");
+          _BC_STAT(pollTimeouts)
+          m_synced = false;
+          transactionEnd(false);
+          break;
+        }
+
+        /* Backing off, nothing to clock yet */
+        return m_asyncStatus;
+      }
+
+      rxByte = SPITransaction(SPI_PROTOCOL_PAD, false);
+      maxBytes--;
+
+      if (rxByte == SPI_PROTOCOL_RESET)
+      {
+        _LOG_ERROR("Reset, poll (CBERGCloudBase::service)\r\n");
+        _BC_STAT(resets)
+        transactionEnd(false);
+      }
+      else if (rxByte != SPI_PROTOCOL_PAD)
+      {
+        // PW TODO: Should we 'escape' 0xf5?
+
+        pollLearn();
+
+        /* Read header, we already have the first byte */
+        transactionPhase(_BC_TR_READ_HEADER);
+        m_header[0] = rxByte;
+        m_trOffset = 1;
+      }
+      else if (transactionTimeout(m_pollTimeout_mS))
+      {
+        _LOG_ERROR("Timeout, poll (CBERGCloudBase::service)\r\n");
+        _BC_STAT(pollTimeouts)
+        m_synced = false;
+        transactionEnd(false);
+      }
+      else
+      {
+        _BC_STAT(padBytes)
+        m_pollLast_uS = timerRead_uS() - m_pollStart_uS;
+
+        if (m_trOffset < UINT16_MAX)
+        {
+          m_trOffset++;
+        }
+
+        pollSchedule();
+      }
+      break;
+
+    case _BC_TR_READ_HEADER:
+      size = SPI_PROTOCOL_HEADER_SIZE - m_trOffset;
+      size = (size < maxBytes) ? size : maxBytes;
+      memset(&m_header[m_trOffset], SPI_PROTOCOL_PAD, size);
+      SPITransaction(&m_header[m_trOffset], &m_header[m_trOffset], size, false);
+      _BC_STAT_BYTES(size)
+      m_trOffset += size;
+      maxBytes -= size;
+
+      if (m_trOffset == SPI_PROTOCOL_HEADER_SIZE)
+      {
+        transactionHeaderReceived();
+      }
+      break;
+
+    case _BC_TR_READ_DATA:
+      if (m_trOffset < m_rxStored)
+      {
+        /* Into the caller's buffers, m_trSegment is the current one */
+        size = m_tr.rx[m_trSegment].size - m_rxSegmentOffset;
+        size = (size < (m_rxStored - m_trOffset)) ? size : (m_rxStored - m_trOffset);
+        size = (size < maxBytes) ? size : maxBytes;
+        m_trCRC = SPIReceiveBlock(&m_tr.rx[m_trSegment].pData[m_rxSegmentOffset], size, m_trCRC);
+        m_rxSegmentOffset += size;
+
+        if (m_rxSegmentOffset == m_tr.rx[m_trSegment].size)
+        {
+          /* Next segment */
+          m_trSegment++;
+          m_rxSegmentOffset = 0;
+
+#ifdef BERGCLOUD_FRAGMENTATION
+          if ((m_tr.command == SPI_CMD_POLL_FOR_COMMAND) && (m_trSegment == 1))
+          {
+            commandFormatReceived();
+          }
+#endif
+        }
+      }
+      else
+      {
+        /* Discard */
+        size = m_rxDataSize - m_trOffset;
+        size = (size < maxBytes) ? size : maxBytes;
+        m_trCRC = SPIReceiveBlock(NULL, size, m_trCRC);
+      }
+
+      m_trOffset += size;
+      maxBytes -= size;
+
+      if (m_trOffset == m_rxDataSize)
+      {
+        transactionDataReceived();
+      }
+      break;
+    }
   }
 
-  if (pCommandSize != NULL)
+  return m_asyncStatus;
+}
+
+bool CBERGCloudBase::wait(void)
+{
+  /* Run the current request to completion; one completed from the */
+  /* cache leaves nothing to run */
+  while (m_trState != _BC_TR_IDLE)
   {
-    *pCommandSize = commandSize -2;
+    service(UINT16_MAX);
   }
 
-  if (pCommandID != NULL)
+  return (m_asyncStatus == BC_ASYNC_SUCCESS);
+}
+
+void CBERGCloudBase::finishBackground(void)
+{
+  /* Run any request started by service() itself to completion, so a */
+  /* blocking call isn't refused because the library is busy */
+#ifdef BERGCLOUD_BATCHING
+  if (m_batchSending)
   {
-    *pCommandID = rxDataBuffer[1];
+    wait();
   }
+#endif
 
-  if (m_lastResponse == SPI_RSP_SUCCESS)
+#ifdef BERGCLOUD_EVENT_QUEUE
+  if (m_queueSending)
   {
-    if (pCommandBuffer != NULL)
-    {
-      memcpy(pCommandBuffer, &rxDataBuffer[2], commandSize -2);
-    }
+    wait();
   }
+#endif
+}
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
+uint8_t CBERGCloudBase::getAsyncStatus(void)
+{
+  return m_asyncStatus;
 }
 
-bool CBERGCloudBase::sendEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize)
+void CBERGCloudBase::setCompletionCallback(_BC_COMPLETION_FN fn, void *pContext)
 {
-  /* Returns TRUE if the event is sent successfully */
-  uint8_t txDataBuffer[MAX_SERIAL_DATA];
-  uint16_t rxDataSize;
+  m_completionFn = fn;
+  m_completionContext = pContext;
+}
 
-  _BC_TRANSACTION tr;
+void CBERGCloudBase::setTimeouts(uint32_t pollTimeout_mS, uint32_t syncTimeout_mS)
+{
+  m_pollTimeout_mS = pollTimeout_mS;
+  m_syncTimeout_mS = syncTimeout_mS;
+}
+
+void CBERGCloudBase::setPollBackoff(uint16_t maxInterval_mS)
+{
+  /* Zero polls back to back without waiting, as in earlier versions */
+  m_pollIntervalMax_uS = (uint32_t)maxInterval_mS * 1000;
+}
+
+uint32_t CBERGCloudBase::getResponseEstimate_uS(uint8_t command)
+{
+  uint8_t i;
 
-  if ((eventSize + 2) > sizeof(txDataBuffer))
+  for (i = 0; i < POLL_ESTIMATE_COMMANDS; i++)
   {
-    return false;
+    if (m_pollCommand[i] == command)
+    {
+      return m_pollEstimate_uS[i];
+    }
   }
 
-  txDataBuffer[0] = BC_EVENT_START_BINARY >> 8;
-  txDataBuffer[1] = eventCode;
-  memcpy(&txDataBuffer[2], pEventBuffer, eventSize);
+  return 0;
+}
 
-  tr.command = SPI_CMD_SEND_EVENT;
-  tr.pTx = txDataBuffer;
-  tr.txSize = eventSize + 2;
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = NULL;
-  tr.rxMaxSize = 0;
-  tr.pRxSize = &rxDataSize;
+uint32_t CBERGCloudBase::timerRead_uS(void)
+{
+  /* Ports with a finer timer should override this */
+  return timerRead_mS() * 1000;
+}
 
-  if (!transaction(&tr))
+bool CBERGCloudBase::transactionBusy(void)
+{
+  if (m_trState != _BC_TR_IDLE)
   {
-    return false;
+    _LOG_ERROR("Busy (CBERGCloudBase::transactionBusy)\r\n");
+    return true;
   }
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
+  return false;
 }
 
-bool CBERGCloudBase::getNetworkState(uint8_t *pState)
+bool CBERGCloudBase::pollForCommandStart(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint32_t deadline_mS)
 {
-  uint16_t rxDataSize;
   _BC_TRANSACTION tr;
 
-  tr.command = SPI_CMD_GET_NETWORK_STATE;
-  tr.pTx = NULL;
-  tr.txSize = 0;
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = pState;
-  tr.rxMaxSize = sizeof(uint8_t);
-  tr.pRxSize = &rxDataSize;
-
-  if (!transaction(&tr))
+  /* Before any state is changed, a fragmented event may be in progress */
+  if (transactionBusy())
   {
     return false;
   }
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
+  /* The two byte command header is received into m_fields and the */
+  /* command data directly into the caller's buffer */
+  tr.command = SPI_CMD_POLL_FOR_COMMAND;
+  tr.txSegments = 0;
+  tr.pResponse = &m_lastResponse;
+  tr.rx[0].pData = m_fields;
+  tr.rx[0].size = 2;
+  tr.rx[1].pData = pCommandBuffer;
+  tr.rx[1].size = (pCommandBuffer != NULL) ? commandBufferSize : 0;
+  tr.rxSegments = 2;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+  m_commandBufferSize = tr.rx[1].size;
+  m_commandTruncated = false;
+
+#ifdef BERGCLOUD_FRAGMENTATION
+  /* Fragments are reassembled in the caller's buffer */
+  m_pFragData = pCommandBuffer;
+  m_fragSize = tr.rx[1].size;
+
+  if (!m_fragActive)
+  {
+    m_fragOffset = 0;
+  }
+#endif
+
+  return transactionStart(&tr);
 }
 
-bool CBERGCloudBase::joinNetwork(const uint8_t productID[16], uint32_t version)
+bool CBERGCloudBase::pollForCommandAsync(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint16_t *pCommandSize, uint8_t *pCommandID, uint32_t deadline_mS)
 {
-  uint8_t tmp[16 + sizeof(version)];
-  int i;
-
-  memcpy(&tmp[0], &productID[0], 16);
-  tmp[16] = version >> 24;
-  tmp[17] = version >> 16;
-  tmp[18] = version >> 8;
-  tmp[19] = version;
-
-  uint16_t rxDataSize;
-  _BC_TRANSACTION tr;
-
-  tr.command = SPI_CMD_SEND_PRODUCT_ANNOUNCE;
-  tr.pTx = tmp;
-  tr.txSize = 16 + sizeof(version);
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = NULL;
-  tr.rxMaxSize = 0;
-  tr.pRxSize = &rxDataSize;
-
-  if (!transaction(&tr))
+  if (!pollForCommandStart(pCommandBuffer, commandBufferSize, deadline_mS))
   {
     return false;
   }
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
+  /* Results are set by commandReceived() */
+  m_pCommandSize = pCommandSize;
+  m_pCommandID = pCommandID;
+  m_pCommandMessage = NULL;
+  return true;
 }
 
-bool CBERGCloudBase::getClaimingState(uint8_t *pState)
+bool CBERGCloudBase::pollForCommandAsync(CMessage& buffer, uint8_t *pCommandID, uint32_t deadline_mS)
 {
-  uint16_t rxDataSize;
-  _BC_TRANSACTION tr;
+  if (transactionBusy())
+  {
+    return false;
+  }
 
-  tr.command = SPI_CMD_GET_CLAIM_STATE;
-  tr.pTx = NULL;
-  tr.txSize = 0;
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = pState;
-  tr.rxMaxSize = sizeof(uint8_t);
-  tr.pRxSize = &rxDataSize;
+  buffer.clearBuffer();
 
-  if (!transaction(&tr))
+  if (!pollForCommandStart(buffer.m_data, sizeof(buffer.m_data), deadline_mS))
   {
     return false;
   }
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
+  /* Results are set by commandReceived() */
+  m_pCommandSize = NULL;
+  m_pCommandID = pCommandID;
+  m_pCommandMessage = &buffer;
+  return true;
 }
 
-bool CBERGCloudBase::getClaimcode(char *pBuffer, uint32_t bufferSize)
+bool CBERGCloudBase::commandReceived(void)
 {
-  uint16_t rxDataSize;
-  _BC_TRANSACTION tr;
+  /* Returns TRUE if a command, or the next fragment of one, has */
+  /* been received */
+  uint8_t format;
+  uint16_t commandSize;
 
-  tr.command = SPI_CMD_GET_CLAIMCODE;
-  tr.pTx = NULL;
-  tr.txSize = 0;
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = (uint8_t *)pBuffer;
-  tr.rxMaxSize = bufferSize;
-  tr.pRxSize = &rxDataSize;
+  if (m_lastResponse != SPI_RSP_SUCCESS)
+  {
+    return false;
+  }
 
-  if (!transaction(&tr))
+  if (m_rxDataSize < 2)
   {
     return false;
   }
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
-}
+  format = m_fields[0];
+  commandSize = m_rxDataSize - 2;
 
-bool CBERGCloudBase::getEUI64(uint8_t type, uint8_t *pBuffer, uint32_t bufferSize)
-{
-  uint16_t rxDataSize;
-  _BC_TRANSACTION tr;
+#ifdef BERGCLOUD_FRAGMENTATION
+  if (format == (BC_COMMAND_START_FRAGMENT >> 8))
+  {
+    if (!fragmentReceived())
+    {
+      return false;
+    }
 
-  tr.command = SPI_CMD_GET_EUI64;
-  tr.pTx = &type;
-  tr.txSize = sizeof(uint8_t);
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = pBuffer;
-  tr.rxMaxSize = bufferSize;
-  tr.pRxSize = &rxDataSize;
+    if ((m_fields[3] & BC_FRAGMENT_LAST) == 0)
+    {
+      /* More to come, see fragmentNext() */
+      return true;
+    }
 
-  if (!transaction(&tr))
+    format = m_fields[4];
+    commandSize = m_fragOffset;
+  }
+  else if (m_fragActive)
   {
+    _LOG_ERROR("FragErr, command (CBERGCloudBase::pollForCommand)\r\n");
     return false;
   }
+#endif
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
-}
-
-bool CBERGCloudBase::setDisplayStyle(uint8_t style)
-{
-  uint16_t rxDataSize;
-  _BC_TRANSACTION tr;
+  if (m_pCommandID != NULL)
+  {
+    *m_pCommandID = m_fields[1];
+  }
 
-  tr.command = SPI_CMD_SET_DISPLAY_STYLE;
-  tr.pTx = &style;
-  tr.txSize = sizeof(uint8_t);
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = NULL;
-  tr.rxMaxSize = 0;
-  tr.pRxSize = &rxDataSize;
+  if (m_pCommandSize != NULL)
+  {
+    *m_pCommandSize = commandSize;
+  }
 
-  if (!transaction(&tr))
+  if ((m_commandBufferSize > 0) && (commandSize > m_commandBufferSize))
   {
+    /* Only the start of the command fitted the caller's buffer */
+    _LOG_ERROR("SizeErr, command (CBERGCloudBase::pollForCommand)\r\n");
+    m_commandTruncated = true;
     return false;
   }
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
+  if (m_pCommandMessage != NULL)
+  {
+    if (format != (BC_COMMAND_START_PACKED >> 8))
+    {
+      _LOG_ERROR("Not packed, command (CBERGCloudBase::pollForCommand)\r\n");
+      return false;
+    }
+
+    m_pCommandMessage->m_written = commandSize;
+  }
+
+  return true;
 }
 
-bool CBERGCloudBase::print(const char *pString)
+bool CBERGCloudBase::getCommandTruncated(void)
 {
-  uint8_t strLen = 0;
-  const char *pTmp = pString;
+  return m_commandTruncated;
+}
 
-  /* Get string length excluding terminator */
-  while ((*pTmp++ != '\0') && (strLen < UINT8_MAX))
+bool CBERGCloudBase::pollForCommand(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint16_t *pCommandSize, uint8_t *pCommandID, uint32_t deadline_mS)
+{
+  /* Returns TRUE if a command has been received */
+  finishBackground();
+
+  if (!pollForCommandAsync(pCommandBuffer, commandBufferSize, pCommandSize, pCommandID, deadline_mS))
   {
-    strLen++;
+    return false;
   }
 
-  uint16_t rxDataSize;
-  _BC_TRANSACTION tr;
+  return wait();
+}
 
-  tr.command = SPI_CMD_DISPLAY_PRINT;
-  tr.pTx = (uint8_t *)pString;
-  tr.txSize = strLen;
-  tr.pResponse = &m_lastResponse;
-  tr.pRx = NULL;
-  tr.rxMaxSize = 0;
-  tr.pRxSize = &rxDataSize;
+bool CBERGCloudBase::pollForCommand(CMessage& buffer, uint8_t *pCommandID, uint32_t deadline_mS)
+{
+  /* Returns TRUE if a packed command has been received */
+  finishBackground();
 
-  if (!transaction(&tr))
+  if (!pollForCommandAsync(buffer, pCommandID, deadline_mS))
   {
     return false;
   }
 
-  return (m_lastResponse == SPI_RSP_SUCCESS);
+  return wait();
 }
 
+bool CBERGCloudBase::sendEventStart(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+  if (transactionBusy())
+  {
+    return false;
+  }
+
+#ifdef BERGCLOUD_FRAGMENTATION
+  if (eventSize > (MAX_SERIAL_DATA - 2))
+  {
+    return fragmentSendStart(format, eventCode, pEventBuffer, eventSize, deadline_mS);
+  }
+#endif
+
+  /* Two byte event header then the caller's data */
+  m_fields[0] = format >> 8;
+  m_fields[1] = eventCode;
+
+  tr.command = SPI_CMD_SEND_EVENT;
+  tr.tx[0].pData = m_fields;
+  tr.tx[0].size = 2;
+  tr.tx[1].pData = pEventBuffer;
+  tr.tx[1].size = eventSize;
+  tr.txSegments = 2;
+  tr.pResponse = &m_lastResponse;
+  tr.rxSegments = 0;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::sendEventAsync(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS)
+{
+  return sendEventStart(BC_EVENT_START_BINARY, eventCode, pEventBuffer, eventSize, deadline_mS);
+}
+
+bool CBERGCloudBase::sendEventAsync(uint8_t eventCode, CMessage& buffer, uint32_t deadline_mS)
+{
+  return sendEventStart(BC_EVENT_START_PACKED, eventCode, buffer.m_data, buffer.m_written, deadline_mS);
+}
+
+bool CBERGCloudBase::sendEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS)
+{
+  /* Returns TRUE if the event is sent successfully */
+  finishBackground();
+
+  if (!sendEventAsync(eventCode, pEventBuffer, eventSize, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::sendEvent(uint8_t eventCode, CMessage& buffer, uint32_t deadline_mS)
+{
+  /* Returns TRUE if the event is sent successfully */
+  finishBackground();
+
+  if (!sendEventAsync(eventCode, buffer, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::getNetworkStateAsync(uint8_t *pState, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+#ifdef BERGCLOUD_CACHE
+  if (cacheRead(SPI_CMD_GET_NETWORK_STATE, 0, pState, sizeof(uint8_t)))
+  {
+    return true;
+  }
+#endif
+
+  tr.command = SPI_CMD_GET_NETWORK_STATE;
+  tr.txSegments = 0;
+  tr.pResponse = &m_lastResponse;
+  tr.rx[0].pData = pState;
+  tr.rx[0].size = sizeof(uint8_t);
+  tr.rxSegments = 1;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::getNetworkState(uint8_t *pState, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!getNetworkStateAsync(pState, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::joinNetworkAsync(const uint8_t productID[16], uint32_t version, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+  if (transactionBusy())
+  {
+    return false;
+  }
+
+#ifdef BERGCLOUD_CACHE
+  m_cacheValid &= ~_BC_CACHE_LINK;
+#endif
+
+  m_fields[0] = version >> 24;
+  m_fields[1] = version >> 16;
+  m_fields[2] = version >> 8;
+  m_fields[3] = version;
+
+  tr.command = SPI_CMD_SEND_PRODUCT_ANNOUNCE;
+  tr.tx[0].pData = (uint8_t *)productID;
+  tr.tx[0].size = 16;
+  tr.tx[1].pData = m_fields;
+  tr.tx[1].size = sizeof(version);
+  tr.txSegments = 2;
+  tr.pResponse = &m_lastResponse;
+  tr.rxSegments = 0;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::joinNetwork(const uint8_t productID[16], uint32_t version, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!joinNetworkAsync(productID, version, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::getClaimingStateAsync(uint8_t *pState, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+#ifdef BERGCLOUD_CACHE
+  if (cacheRead(SPI_CMD_GET_CLAIM_STATE, 0, pState, sizeof(uint8_t)))
+  {
+    return true;
+  }
+#endif
+
+  tr.command = SPI_CMD_GET_CLAIM_STATE;
+  tr.txSegments = 0;
+  tr.pResponse = &m_lastResponse;
+  tr.rx[0].pData = pState;
+  tr.rx[0].size = sizeof(uint8_t);
+  tr.rxSegments = 1;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::getClaimingState(uint8_t *pState, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!getClaimingStateAsync(pState, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::getClaimcodeAsync(char *pBuffer, uint32_t bufferSize, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+#ifdef BERGCLOUD_CACHE
+  if (cacheRead(SPI_CMD_GET_CLAIMCODE, 0, (uint8_t *)pBuffer, bufferSize))
+  {
+    return true;
+  }
+#endif
+
+  tr.command = SPI_CMD_GET_CLAIMCODE;
+  tr.txSegments = 0;
+  tr.pResponse = &m_lastResponse;
+  tr.rx[0].pData = (uint8_t *)pBuffer;
+  tr.rx[0].size = bufferSize;
+  tr.rxSegments = 1;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::getClaimcode(char *pBuffer, uint32_t bufferSize, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!getClaimcodeAsync(pBuffer, bufferSize, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::getEUI64Async(uint8_t type, uint8_t *pBuffer, uint32_t bufferSize, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+  if (transactionBusy())
+  {
+    return false;
+  }
+
+#ifdef BERGCLOUD_CACHE
+  if (cacheRead(SPI_CMD_GET_EUI64, type, pBuffer, bufferSize))
+  {
+    return true;
+  }
+#endif
+
+  m_fields[0] = type;
+
+  tr.command = SPI_CMD_GET_EUI64;
+  tr.tx[0].pData = m_fields;
+  tr.tx[0].size = sizeof(uint8_t);
+  tr.txSegments = 1;
+  tr.pResponse = &m_lastResponse;
+  tr.rx[0].pData = pBuffer;
+  tr.rx[0].size = bufferSize;
+  tr.rxSegments = 1;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::getEUI64(uint8_t type, uint8_t *pBuffer, uint32_t bufferSize, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!getEUI64Async(type, pBuffer, bufferSize, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::getSignalQualityAsync(int8_t *pRSSI, uint8_t *pLQI, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+  tr.command = SPI_CMD_GET_SIGNAL_QUALITY;
+  tr.txSegments = 0;
+  tr.pResponse = &m_lastResponse;
+  tr.rx[0].pData = (uint8_t *)pRSSI;
+  tr.rx[0].size = sizeof(int8_t);
+  tr.rx[1].pData = pLQI;
+  tr.rx[1].size = sizeof(uint8_t);
+  tr.rxSegments = 2;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::getSignalQuality(int8_t *pRSSI, uint8_t *pLQI, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!getSignalQualityAsync(pRSSI, pLQI, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::setDisplayStyleAsync(uint8_t style, uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+
+  if (transactionBusy())
+  {
+    return false;
+  }
+
+  m_fields[0] = style;
+
+  tr.command = SPI_CMD_SET_DISPLAY_STYLE;
+  tr.tx[0].pData = m_fields;
+  tr.tx[0].size = sizeof(uint8_t);
+  tr.txSegments = 1;
+  tr.pResponse = &m_lastResponse;
+  tr.rxSegments = 0;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::setDisplayStyle(uint8_t style, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!setDisplayStyleAsync(style, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+bool CBERGCloudBase::printAsync(const char *pString, uint32_t deadline_mS)
+{
+  uint8_t strLen = 0;
+  const char *pTmp = pString;
+  _BC_TRANSACTION tr;
+
+  /* Get string length excluding terminator */
+  while ((*pTmp++ != '\0') && (strLen < UINT8_MAX))
+  {
+    strLen++;
+  }
+
+  tr.command = SPI_CMD_DISPLAY_PRINT;
+  tr.tx[0].pData = (uint8_t *)pString;
+  tr.tx[0].size = strLen;
+  tr.txSegments = 1;
+  tr.pResponse = &m_lastResponse;
+  tr.rxSegments = 0;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = deadline_mS;
+
+  return transactionStart(&tr);
+}
+
+bool CBERGCloudBase::print(const char *pString, uint32_t deadline_mS)
+{
+  finishBackground();
+
+  if (!printAsync(pString, deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+#ifdef BERGCLOUD_FRAGMENTATION
+
+uint32_t CBERGCloudBase::fragmentRemaining_mS(void)
+{
+  /* Time left for the whole fragmented event or command, zero if none */
+  uint32_t elapsed_mS = timerRead_mS() - m_fragStart_mS;
+
+  if (elapsed_mS >= m_fragDeadline_mS)
+  {
+    return 0;
+  }
+
+  return m_fragDeadline_mS - elapsed_mS;
+}
+
+bool CBERGCloudBase::fragmentSendStart(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS)
+{
+  if ((pEventBuffer == NULL) || (eventSize > BC_FRAGMENT_MAX_SIZE))
+  {
+    _LOG_ERROR("Invalid parameter (CBERGCloudBase::sendEvent)\r\n");
+    return false;
+  }
+
+  /* Fragment header, the index is set by fragmentSend() */
+  m_fields[0] = BC_EVENT_START_FRAGMENT >> 8;
+  m_fields[1] = eventCode;
+  m_fields[2] = ++m_fragSeq;
+  m_fields[4] = format >> 8;
+
+  m_pFragData = pEventBuffer;
+  m_fragSize = eventSize;
+  m_fragOffset = 0;
+  m_fragIndex = 0;
+  m_fragRetries = 0;
+  m_fragStart_mS = timerRead_mS();
+  m_fragDeadline_mS = (deadline_mS != BC_DEADLINE_NONE) ? deadline_mS : FRAGMENT_TIMEOUT_MS;
+
+  if (!fragmentSend())
+  {
+    return false;
+  }
+
+  m_fragActive = true;
+  return true;
+}
+
+bool CBERGCloudBase::fragmentSend(void)
+{
+  /* Send the fragment at m_fragOffset */
+  _BC_TRANSACTION tr;
+  uint32_t remaining_mS = fragmentRemaining_mS();
+
+  if (remaining_mS == 0)
+  {
+    _LOG_ERROR("Timeout, fragment (CBERGCloudBase::sendEvent)\r\n");
+    return false;
+  }
+
+  m_fragLength = m_fragSize - m_fragOffset;
+  m_fields[3] = m_fragIndex;
+
+  if (m_fragLength > BC_FRAGMENT_DATA_SIZE)
+  {
+    m_fragLength = BC_FRAGMENT_DATA_SIZE;
+  }
+  else
+  {
+    m_fields[3] |= BC_FRAGMENT_LAST;
+  }
+
+  tr.command = SPI_CMD_SEND_EVENT;
+  tr.tx[0].pData = m_fields;
+  tr.tx[0].size = 2 + BC_FRAGMENT_HEADER_SIZE;
+  tr.tx[1].pData = &m_pFragData[m_fragOffset];
+  tr.tx[1].size = m_fragLength;
+  tr.txSegments = 2;
+  tr.pResponse = &m_lastResponse;
+  tr.rxSegments = 0;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = remaining_mS;
+
+  return transactionStart(&tr);
+}
+
+void CBERGCloudBase::commandFormatReceived(void)
+{
+  /* Called once the command format byte has been received. A fragment */
+  /* has a further header, then its data follows what has already */
+  /* been reassembled in the caller's buffer. */
+  if (m_fields[0] != (BC_COMMAND_START_FRAGMENT >> 8))
+  {
+    return;
+  }
+
+  m_tr.rx[1].pData = &m_fields[2];
+  m_tr.rx[1].size = BC_FRAGMENT_HEADER_SIZE;
+  if (m_fragOffset < m_fragSize)
+  {
+    m_tr.rx[2].pData = &m_pFragData[m_fragOffset];
+    m_tr.rx[2].size = m_fragSize - m_fragOffset;
+  }
+  else
+  {
+    /* Buffer full or none given, the rest is discarded */
+    m_tr.rx[2].pData = NULL;
+    m_tr.rx[2].size = 0;
+  }
+
+  m_tr.rxSegments = 3;
+  transactionRxLimit();
+}
+
+bool CBERGCloudBase::fragmentReceived(void)
+{
+  /* Check the fragment follows the previous one */
+  uint8_t index = m_fields[3] & BC_FRAGMENT_INDEX_MASK;
+
+  if (m_rxDataSize < (2 + BC_FRAGMENT_HEADER_SIZE))
+  {
+    _LOG_ERROR("SizeErr, fragment (CBERGCloudBase::pollForCommand)\r\n");
+    return false;
+  }
+
+  if (!m_fragActive)
+  {
+    if (index != 0)
+    {
+      /* Start of this command was lost */
+      _LOG_ERROR("FragErr, fragment (CBERGCloudBase::pollForCommand)\r\n");
+      return false;
+    }
+
+    m_fragActive = true;
+    m_fragSeq = m_fields[2];
+    m_fragID = m_fields[1];
+    m_fragIndex = 0;
+    m_fragHold_uS = 0;
+    m_fragStart_mS = m_trStart_mS;
+    m_fragDeadline_mS = (m_tr.deadline_mS != BC_DEADLINE_NONE) ? m_tr.deadline_mS : FRAGMENT_TIMEOUT_MS;
+  }
+  else if ((m_fields[2] != m_fragSeq) || (m_fields[1] != m_fragID) || (index != m_fragIndex))
+  {
+    /* A fragment was lost */
+    _LOG_ERROR("FragErr, fragment (CBERGCloudBase::pollForCommand)\r\n");
+    return false;
+  }
+
+  m_fragOffset += m_rxDataSize - (2 + BC_FRAGMENT_HEADER_SIZE);
+  m_fragIndex++;
+  return true;
+}
+
+void CBERGCloudBase::fragmentHold(void)
+{
+  /* The next fragment hadn't arrived, so hold the poll just started */
+  /* back instead of clocking it straight away. Zero maximum polls */
+  /* back to back, see setPollBackoff(). */
+  m_fragHold_uS = (m_fragHold_uS == 0) ? _BC_FRAG_HOLD_MIN_US : (m_fragHold_uS * 2);
+
+  if (m_fragHold_uS > m_pollIntervalMax_uS)
+  {
+    m_fragHold_uS = m_pollIntervalMax_uS;
+  }
+
+  if (m_fragHold_uS > 0)
+  {
+    transactionPhase(_BC_TR_HOLD);
+    m_pollStart_uS = timerRead_uS();
+    m_pollNext_uS = m_fragHold_uS;
+  }
+}
+
+bool CBERGCloudBase::fragmentNext(bool transferred, bool *pSuccess)
+{
+  /* Returns TRUE if a transaction for the next fragment was started, */
+  /* otherwise the fragmented event or command is complete or failed */
+  bool started = false;
+  uint32_t remaining_mS;
+
+  if (m_tr.command == SPI_CMD_SEND_EVENT)
+  {
+    if (*pSuccess)
+    {
+      m_fragOffset += m_fragLength;
+      m_fragIndex++;
+      m_fragRetries = 0;
+
+      if (m_fragOffset < m_fragSize)
+      {
+        started = fragmentSend();
+        *pSuccess = started;
+      }
+    }
+    else if (m_fragRetries < (FRAGMENT_RETRIES - 1))
+    {
+      /* Send the same fragment again */
+      m_fragRetries++;
+      started = fragmentSend();
+    }
+  }
+  else if (*pSuccess || (transferred && (m_lastResponse == SPI_RSP_NO_DATA)))
+  {
+    /* Poll for the next fragment unless that was the last one. NO_DATA */
+    /* means it hasn't arrived yet, so poll again until the deadline. */
+    if (!*pSuccess || ((m_fields[3] & BC_FRAGMENT_LAST) == 0))
+    {
+      remaining_mS = fragmentRemaining_mS();
+
+      if (remaining_mS > 0)
+      {
+        started = pollForCommandStart(m_pFragData, m_fragSize, remaining_mS);
+
+        if (started && !*pSuccess)
+        {
+          fragmentHold();
+        }
+        else
+        {
+          m_fragHold_uS = 0;
+        }
+      }
+      else
+      {
+        _LOG_ERROR("Timeout, fragment (CBERGCloudBase::pollForCommand)\r\n");
+      }
+
+      *pSuccess = started;
+    }
+  }
+
+  if (!started)
+  {
+    m_fragActive = false;
+  }
+
+  return started;
+}
+
+#endif // #ifdef BERGCLOUD_FRAGMENTATION
+
+#ifdef BERGCLOUD_BATCHING
+
+bool CBERGCloudBase::batchDue(void)
+{
+  /* TRUE if there are batched events older than the maximum age */
+  if (m_batch[1] == 0)
+  {
+    return false;
+  }
+
+  return (timerRead_mS() - m_batchStart_mS) >= m_batchMaxAge_mS;
+}
+
+bool CBERGCloudBase::batchAdd(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize)
+{
+  /* Add an event to the batch, flushing the batch first if the event */
+  /* won't fit or the batch is too old. Events too large to batch are */
+  /* sent on their own. */
+  uint16_t entrySize = eventSize + BC_BATCH_ENTRY_HEADER_SIZE;
+
+  if ((pEventBuffer == NULL) && (eventSize != 0))
+  {
+    _LOG_ERROR("Invalid parameter (CBERGCloudBase::queueEvent)\r\n");
+    return false;
+  }
+
+  if (m_batchSending)
+  {
+    _LOG_ERROR("Busy (CBERGCloudBase::queueEvent)\r\n");
+    return false;
+  }
+
+  if ((m_batch[1] > 0) && ((entrySize > (sizeof(m_batch) - m_batchSize)) || batchDue()))
+  {
+    /* Make room, the caller didn't ask for this flush. A background */
+    /* send is finished first, but a request the caller started is */
+    /* left alone as wait() would run it to completion. */
+    finishBackground();
+
+    if (m_trState == _BC_TR_IDLE)
+    {
+      m_trInternal = true;
+      m_trInternal = flushEventsAsync(BC_DEADLINE_NONE);
+      wait();
+    }
+  }
+
+  if (entrySize > (sizeof(m_batch) - 2))
+  {
+    /* Too large for any batch, keep events in order */
+    finishBackground();
+
+    if (m_trState != _BC_TR_IDLE)
+    {
+      _LOG_ERROR("Busy (CBERGCloudBase::queueEvent)\r\n");
+      return false;
+    }
+
+    if ((m_batch[1] > 0) || !sendEventStart(format, eventCode, pEventBuffer, eventSize, BC_DEADLINE_NONE))
+    {
+      return false;
+    }
+
+    return wait();
+  }
+
+  if (entrySize > (sizeof(m_batch) - m_batchSize))
+  {
+    /* Batch could not be flushed */
+    if (m_trState != _BC_TR_IDLE)
+    {
+      _LOG_ERROR("Busy (CBERGCloudBase::queueEvent)\r\n");
+    }
+
+    return false;
+  }
+
+  if (m_batch[1] == 0)
+  {
+    m_batchStart_mS = timerRead_mS();
+  }
+
+  m_batch[m_batchSize++] = eventCode;
+  m_batch[m_batchSize++] = eventSize | ((format == BC_EVENT_START_PACKED) ? BC_BATCH_PACKED : 0);
+  memcpy(&m_batch[m_batchSize], pEventBuffer, eventSize);
+  m_batchSize += eventSize;
+  m_batch[1]++;
+
+  m_batchStats.eventsQueued++;
+  return true;
+}
+
+bool CBERGCloudBase::queueEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize)
+{
+  return batchAdd(BC_EVENT_START_BINARY, eventCode, pEventBuffer, eventSize);
+}
+
+bool CBERGCloudBase::queueEvent(uint8_t eventCode, CMessage& buffer)
+{
+  return batchAdd(BC_EVENT_START_PACKED, eventCode, buffer.m_data, buffer.m_written);
+}
+
+bool CBERGCloudBase::flushEventsAsync(uint32_t deadline_mS)
+{
+  _BC_TRANSACTION tr;
+  bool started;
+
+  /* Returns FALSE if there is nothing to send or a request is */
+  /* already in progress */
+  if ((m_batch[1] == 0) || transactionBusy())
+  {
+    return false;
+  }
+
+  if (m_batch[1] == 1)
+  {
+    /* A batch of one is sent as a normal event */
+    started = sendEventStart((m_batch[3] & BC_BATCH_PACKED) ? BC_EVENT_START_PACKED : BC_EVENT_START_BINARY,
+      m_batch[2], &m_batch[2 + BC_BATCH_ENTRY_HEADER_SIZE], m_batch[3] & BC_BATCH_SIZE_MASK, deadline_mS);
+  }
+  else
+  {
+    tr.command = SPI_CMD_SEND_EVENT;
+    tr.tx[0].pData = m_batch;
+    tr.tx[0].size = m_batchSize;
+    tr.txSegments = 1;
+    tr.pResponse = &m_lastResponse;
+    tr.rxSegments = 0;
+    tr.pRxSize = NULL;
+    tr.deadline_mS = deadline_mS;
+
+    started = transactionStart(&tr);
+  }
+
+  m_batchSending = started;
+  return started;
+}
+
+bool CBERGCloudBase::flushEvents(uint32_t deadline_mS)
+{
+  /* Returns TRUE if the batch was sent or was empty */
+  finishBackground();
+
+  if (m_batch[1] == 0)
+  {
+    return true;
+  }
+
+  if (!flushEventsAsync(deadline_mS))
+  {
+    return false;
+  }
+
+  return wait();
+}
+
+void CBERGCloudBase::batchSent(bool success)
+{
+  uint8_t count = m_batch[1];
+
+  m_batchSending = false;
+
+  if (!success)
+  {
+    /* Keep the batch and try again when it is next due */
+    m_batchStats.batchesFailed++;
+    m_batchStart_mS = timerRead_mS();
+    return;
+  }
+
+  m_batchStats.eventsSent += count;
+  m_batchStats.batchesSent++;
+
+  if (count > 1)
+  {
+    /* An estimate: each event sent on its own would have had a request */
+    /* and response header and an event header, each batched one has an */
+    /* entry header. Pads and polls, which vary, aren't counted. */
+    m_batchStats.bytesSavedEstimate += ((count - 1) * ((SPI_PROTOCOL_HEADER_SIZE * 2) + 2)) - (count * BC_BATCH_ENTRY_HEADER_SIZE);
+  }
+
+  m_batchSize = 2;
+  m_batch[1] = 0;
+}
+
+void CBERGCloudBase::setBatchMaxAge(uint32_t maxAge_mS)
+{
+  m_batchMaxAge_mS = maxAge_mS;
+}
+
+const _BC_BATCH_STATS *CBERGCloudBase::getBatchStats(void)
+{
+  return &m_batchStats;
+}
+
+void CBERGCloudBase::clearBatchStats(void)
+{
+  memset(&m_batchStats, 0, sizeof(m_batchStats));
+}
+
+#endif // #ifdef BERGCLOUD_BATCHING
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+
+void CBERGCloudBase::queueCopy(uint16_t offset, const uint8_t *pData, uint16_t size)
+{
+  /* Copy into the ring starting offset bytes after the head */
+  offset = (m_queueHead + offset) % sizeof(m_queue);
+
+  while (size-- > 0)
+  {
+    m_queue[offset] = *pData++;
+    offset = (offset + 1) % sizeof(m_queue);
+  }
+}
+
+void CBERGCloudBase::queueRemove(void)
+{
+  /* Remove the entry at the head */
+  uint16_t entrySize = m_queue[m_queueHead] + 3;
+
+  m_queueHead = (m_queueHead + entrySize) % sizeof(m_queue);
+  m_queueUsed -= entrySize;
+  m_queueStats.depth--;
+
+  /* The next entry starts with no backoff */
+  m_queueRetries = 0;
+  m_queueBackoff_mS = 0;
+}
+
+bool CBERGCloudBase::queuePost(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize)
+{
+  /* Each entry is its size then the event exactly as it is sent: */
+  /* format, event code and data */
+  uint16_t entrySize = eventSize + 3;
+  uint8_t header[3];
+
+  if (  ((pEventBuffer == NULL) && (eventSize != 0)) ||
+        (eventSize > (MAX_SERIAL_DATA - 2)) ||
+        (entrySize > sizeof(m_queue)) )
+  {
+    _LOG_ERROR("Invalid parameter (CBERGCloudBase::postEvent)\r\n");
+    return false;
+  }
+
+  m_queueStats.posted++;
+
+  while (entrySize > (sizeof(m_queue) - m_queueUsed))
+  {
+    /* Full. The oldest event can't be dropped while it is being sent, */
+    /* so the new one is dropped instead. */
+    if ((m_queueDrop == BC_QUEUE_DROP_NEWEST) || m_queueSending || (m_queueStats.depth == 0))
+    {
+      m_queueStats.dropped++;
+      return false;
+    }
+
+    queueRemove();
+    m_queueStats.dropped++;
+  }
+
+  header[0] = eventSize;
+  header[1] = format >> 8;
+  header[2] = eventCode;
+  queueCopy(m_queueUsed, header, sizeof(header));
+  queueCopy(m_queueUsed + sizeof(header), pEventBuffer, eventSize);
+  m_queueUsed += entrySize;
+
+  if (++m_queueStats.depth > m_queueStats.maxDepth)
+  {
+    m_queueStats.maxDepth = m_queueStats.depth;
+  }
+
+  return true;
+}
+
+bool CBERGCloudBase::postEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize)
+{
+  return queuePost(BC_EVENT_START_BINARY, eventCode, pEventBuffer, eventSize);
+}
+
+bool CBERGCloudBase::postEvent(uint8_t eventCode, CMessage& buffer)
+{
+  return queuePost(BC_EVENT_START_PACKED, eventCode, buffer.m_data, buffer.m_written);
+}
+
+void CBERGCloudBase::queueSend(void)
+{
+  /* Start sending the entry at the head when it is due */
+  _BC_TRANSACTION tr;
+  uint16_t start;
+  uint16_t size;
+
+  if (  (m_queueStats.depth == 0) ||
+        ((timerRead_mS() - m_queueRetryStart_mS) < m_queueBackoff_mS) )
+  {
+    return;
+  }
+
+  /* Sent directly from the ring, in two parts if it wraps */
+  start = (m_queueHead + 1) % sizeof(m_queue);
+  size = m_queue[m_queueHead] + 2;
+
+  tr.command = SPI_CMD_SEND_EVENT;
+  tr.tx[0].pData = &m_queue[start];
+  tr.tx[0].size = size;
+  tr.txSegments = 1;
+
+  if ((start + size) > sizeof(m_queue))
+  {
+    tr.tx[0].size = sizeof(m_queue) - start;
+    tr.tx[1].pData = m_queue;
+    tr.tx[1].size = size - tr.tx[0].size;
+    tr.txSegments = 2;
+  }
+
+  tr.pResponse = &m_lastResponse;
+  tr.rxSegments = 0;
+  tr.pRxSize = NULL;
+  tr.deadline_mS = BC_DEADLINE_NONE;
+
+  m_trInternal = true;
+  m_queueSending = transactionStart(&tr);
+  m_trInternal = m_queueSending;
+}
+
+void CBERGCloudBase::queueSent(bool transferred, bool success)
+{
+  m_queueSending = false;
+
+  if (  !success && (m_queueRetries < QUEUE_RETRY_LIMIT) &&
+        (!transferred || (m_lastResponse == SPI_RSP_BUSY) || (m_lastResponse == SPI_RSP_SEND_FAILED)) )
+  {
+    /* Keep the event and try again later, backing off exponentially */
+    m_queueRetries++;
+    m_queueStats.retries++;
+    m_queueRetryStart_mS = timerRead_mS();
+    m_queueBackoff_mS = (m_queueBackoff_mS == 0) ? QUEUE_RETRY_MIN_MS : (m_queueBackoff_mS * 2);
+
+    if (m_queueBackoff_mS > QUEUE_RETRY_MAX_MS)
+    {
+      m_queueBackoff_mS = QUEUE_RETRY_MAX_MS;
+    }
+
+    return;
+  }
+
+  if (success)
+  {
+    m_queueStats.sent++;
+  }
+  else
+  {
+    /* Rejected by the shield, or still failing after every retry */
+    _LOG_ERROR("Dropped (CBERGCloudBase::queueSent)\r\n");
+    m_queueStats.dropped++;
+  }
+
+  queueRemove();
+}
+
+void CBERGCloudBase::setEventQueueDrop(uint8_t policy)
+{
+  m_queueDrop = policy;
+}
+
+const _BC_QUEUE_STATS *CBERGCloudBase::getEventQueueStats(void)
+{
+  return &m_queueStats;
+}
+
+void CBERGCloudBase::clearEventQueueStats(void)
+{
+  /* Counters only, the queue itself is unchanged */
+  uint16_t depth = m_queueStats.depth;
+
+  memset(&m_queueStats, 0, sizeof(m_queueStats));
+  m_queueStats.depth = depth;
+  m_queueStats.maxDepth = depth;
+}
+
+#endif // #ifdef BERGCLOUD_EVENT_QUEUE
+
+#ifdef BERGCLOUD_COMMAND_TABLE
+
+_BC_COMMAND_HANDLER *CBERGCloudBase::commandLookup(uint8_t commandID)
+{
+  /* Returns the entry for commandID, or the free entry it would use. */
+  /* NULL if the table is full and it isn't there. */
+#ifdef BERGCLOUD_COMMAND_TABLE_FULL
+  return &m_commandTable[commandID];
+#else
+  uint8_t i = commandID & (COMMAND_HANDLERS - 1);
+  uint8_t n;
+
+  for (n = 0; n < COMMAND_HANDLERS; n++)
+  {
+    if ((m_commandTable[i].fn == NULL) || (m_commandTable[i].commandID == commandID))
+    {
+      return &m_commandTable[i];
+    }
+
+    i = (i + 1) & (COMMAND_HANDLERS - 1);
+  }
+
+  return NULL;
+#endif
+}
+
+bool CBERGCloudBase::registerCommand(uint8_t commandID, _BC_COMMAND_FN fn, void *pContext)
+{
+  /* A NULL fn removes the handler for commandID */
+  _BC_COMMAND_HANDLER *pHandler = commandLookup(commandID);
+#ifndef BERGCLOUD_COMMAND_TABLE_FULL
+  _BC_COMMAND_HANDLER moved;
+  uint8_t i;
+#endif
+
+  if (pHandler == NULL)
+  {
+    _LOG_ERROR("Table full (CBERGCloudBase::registerCommand)\r\n");
+    return false;
+  }
+
+  pHandler->fn = fn;
+  pHandler->pContext = pContext;
+
+#ifndef BERGCLOUD_COMMAND_TABLE_FULL
+  pHandler->commandID = commandID;
+
+  if (fn == NULL)
+  {
+    /* Re-insert the entries after the one removed so lookups */
+    /* don't stop short at the gap */
+    i = ((pHandler - m_commandTable) + 1) & (COMMAND_HANDLERS - 1);
+
+    while (m_commandTable[i].fn != NULL)
+    {
+      moved = m_commandTable[i];
+      m_commandTable[i].fn = NULL;
+      *commandLookup(moved.commandID) = moved;
+      i = (i + 1) & (COMMAND_HANDLERS - 1);
+    }
+  }
+#endif
+
+  return true;
+}
+
+uint8_t CBERGCloudBase::processCommands(uint8_t *pBuffer, uint16_t bufferSize, uint8_t maxCommands)
+{
+  /* Poll for pending commands and pass each to its handler. Returns */
+  /* the number received, commands without a handler are discarded. */
+  _BC_COMMAND_HANDLER *pHandler;
+  uint16_t commandSize;
+  uint8_t commandID;
+  uint8_t count = 0;
+
+  while ((count < maxCommands) && pollForCommand(pBuffer, bufferSize, &commandSize, &commandID))
+  {
+    count++;
+    pHandler = commandLookup(commandID);
+
+    if ((pHandler != NULL) && (pHandler->fn != NULL))
+    {
+      pHandler->fn(pHandler->pContext, commandID, pBuffer, commandSize);
+    }
+    else
+    {
+      _LOG_ERROR("No handler (CBERGCloudBase::processCommands)\r\n");
+    }
+  }
+
+  return count;
+}
+
+#endif // #ifdef BERGCLOUD_COMMAND_TABLE
+
+#ifdef BERGCLOUD_CACHE
+
+bool CBERGCloudBase::cacheRead(uint8_t command, uint8_t type, uint8_t *pBuffer, uint32_t bufferSize)
+{
+  /* Returns TRUE if the request was completed from the cache. Not while */
+  /* a request is in progress, the caller reports that it is busy. */
+  uint32_t now_mS = timerRead_mS();
+  uint16_t size;
+
+  if ((m_trState != _BC_TR_IDLE) || (pBuffer == NULL))
+  {
+    return false;
+  }
+
+  switch (command)
+  {
+  case SPI_CMD_GET_NETWORK_STATE:
+    if (  ((m_cacheValid & _BC_CACHE_NETWORK_STATE) == 0) ||
+          ((now_mS - m_cacheNetworkTime_mS) >= m_cacheTTL_mS) )
+    {
+      _BC_STAT(cacheMisses)
+      return false;
+    }
+
+    *pBuffer = m_cacheNetworkState;
+    break;
+
+  case SPI_CMD_GET_CLAIM_STATE:
+    if (  ((m_cacheValid & _BC_CACHE_CLAIM_STATE) == 0) ||
+          ((now_mS - m_cacheClaimTime_mS) >= m_cacheTTL_mS) )
+    {
+      _BC_STAT(cacheMisses)
+      return false;
+    }
+
+    *pBuffer = m_cacheClaimState;
+    break;
+
+  case SPI_CMD_GET_CLAIMCODE:
+    /* Fetched again if the caller's buffer is too small for it */
+    if (  ((m_cacheValid & _BC_CACHE_CLAIMCODE) == 0) ||
+          (bufferSize < m_cacheClaimcodeSize) )
+    {
+      _BC_STAT(cacheMisses)
+      return false;
+    }
+
+    memcpy(pBuffer, m_cacheClaimcode, m_cacheClaimcodeSize);
+    break;
+
+  case SPI_CMD_GET_EUI64:
+    size = sizeof(m_cacheEUI64[0]);
+
+    if (  (type > BC_EUI64_COORDINATOR) ||
+          ((m_cacheValid & _BC_CACHE_EUI64(type)) == 0) ||
+          (bufferSize < size) )
+    {
+      _BC_STAT(cacheMisses)
+      return false;
+    }
+
+    memcpy(pBuffer, m_cacheEUI64[type], size);
+    break;
+
+  default:
+    return false;
+  }
+
+  _BC_STAT(cacheHits)
+
+  /* Complete as if the shield had responded */
+  m_tr.command = command;
+  m_lastResponse = SPI_RSP_SUCCESS;
+  m_asyncStatus = BC_ASYNC_SUCCESS;
+
+  /* The callback may start another request */
+  if (m_completionFn != NULL)
+  {
+    m_completionFn(m_completionContext, m_tr.command, m_asyncStatus);
+  }
+
+  return true;
+}
+
+void CBERGCloudBase::cacheStore(void)
+{
+  /* Keep the response to a successful request that can be cached */
+  uint8_t *pData = m_tr.rx[0].pData;
+  uint8_t type;
+
+  if ((m_tr.rxSegments == 0) || m_rxTruncated)
+  {
+    return;
+  }
+
+  switch (m_tr.command)
+  {
+  case SPI_CMD_GET_NETWORK_STATE:
+    if (m_rxStored == sizeof(m_cacheNetworkState))
+    {
+      m_cacheNetworkState = *pData;
+      m_cacheNetworkTime_mS = timerRead_mS();
+      m_cacheValid |= _BC_CACHE_NETWORK_STATE;
+    }
+    break;
+
+  case SPI_CMD_GET_CLAIM_STATE:
+    if (m_rxStored == sizeof(m_cacheClaimState))
+    {
+      m_cacheClaimState = *pData;
+      m_cacheClaimTime_mS = timerRead_mS();
+      m_cacheValid |= _BC_CACHE_CLAIM_STATE;
+    }
+    break;
+
+  case SPI_CMD_GET_CLAIMCODE:
+    if (m_rxStored <= sizeof(m_cacheClaimcode))
+    {
+      memcpy(m_cacheClaimcode, pData, m_rxStored);
+      m_cacheClaimcodeSize = m_rxStored;
+      m_cacheValid |= _BC_CACHE_CLAIMCODE;
+    }
+    break;
+
+  case SPI_CMD_GET_EUI64:
+    type = m_tr.tx[0].pData[0];
+
+    if ((type <= BC_EUI64_COORDINATOR) && (m_rxStored == sizeof(m_cacheEUI64[0])))
+    {
+      memcpy(m_cacheEUI64[type], pData, m_rxStored);
+      m_cacheValid |= _BC_CACHE_EUI64(type);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+void CBERGCloudBase::setCacheTTL(uint32_t ttl_mS)
+{
+  /* How long network and claim state are kept, zero to always fetch */
+  m_cacheTTL_mS = ttl_mS;
+}
+
+void CBERGCloudBase::invalidateCache(void)
+{
+  m_cacheValid = 0;
+}
+
+#endif // #ifdef BERGCLOUD_CACHE
+
+#ifdef BERGCLOUD_STATS
+
+/* Commands that have their own statistics, in _BC_STATS.command[] order */
+static const uint8_t statsCommands[BC_STATS_COMMANDS] = {
+  SPI_CMD_GET_NETWORK_STATE,
+  SPI_CMD_GET_CLAIMCODE,
+  SPI_CMD_GET_CLAIM_STATE,
+  SPI_CMD_GET_SIGNAL_QUALITY,
+  SPI_CMD_GET_EUI64,
+  SPI_CMD_SEND_PRODUCT_ANNOUNCE,
+  SPI_CMD_POLL_FOR_COMMAND,
+  SPI_CMD_DISPLAY_STYLE,
+  SPI_CMD_DISPLAY_PRINT,
+  SPI_CMD_SET_DISPLAY_STYLE,
+  SPI_CMD_SEND_EVENT
+};
+
+void CBERGCloudBase::statsResync(void)
+{
+  uint32_t sync_uS = timerRead_uS() - m_syncStart_uS;
+
+  m_stats.resyncTotal_uS += sync_uS;
+
+  if (sync_uS > m_stats.resyncMax_uS)
+  {
+    m_stats.resyncMax_uS = sync_uS;
+  }
+}
+
+void CBERGCloudBase::statsRecord(bool transferred)
+{
+  /* Called as each transaction ends, before anything can start another */
+  _BC_COMMAND_STATS *pStats = NULL;
+  uint32_t latency_uS;
+  uint32_t completed;
+  uint32_t bucket;
+  uint8_t i;
+
+  if (transferred)
+  {
+    if (m_header[4] == SPI_RSP_BUSY)
+    {
+      m_stats.busy++;
+    }
+    else if ((m_header[4] != SPI_RSP_SUCCESS) && (m_header[4] != SPI_RSP_NO_DATA))
+    {
+      m_stats.errorResponses++;
+    }
+  }
+
+  for (i = 0; i < BC_STATS_COMMANDS; i++)
+  {
+    if (m_stats.command[i].command == m_tr.command)
+    {
+      pStats = &m_stats.command[i];
+      break;
+    }
+  }
+
+  if (pStats == NULL)
+  {
+    return;
+  }
+
+  pStats->count++;
+  pStats->bytes += m_trBytes;
+
+  if (!transferred)
+  {
+    pStats->failed++;
+    return;
+  }
+
+  /* Latency of transactions that completed, from start to the end */
+  /* of the response */
+  latency_uS = timerRead_uS() - m_trStart_uS;
+  completed = pStats->count - pStats->failed;
+
+  if (completed == 1)
+  {
+    pStats->latencyMin_uS = latency_uS;
+    pStats->latencyMax_uS = latency_uS;
+    pStats->latencyMean_uS = latency_uS;
+  }
+  else
+  {
+    if (latency_uS < pStats->latencyMin_uS)
+    {
+      pStats->latencyMin_uS = latency_uS;
+    }
+
+    if (latency_uS > pStats->latencyMax_uS)
+    {
+      pStats->latencyMax_uS = latency_uS;
+    }
+
+    /* Running mean, so it can't overflow */
+    if (latency_uS > pStats->latencyMean_uS)
+    {
+      pStats->latencyMean_uS += (latency_uS - pStats->latencyMean_uS) / completed;
+    }
+    else
+    {
+      pStats->latencyMean_uS -= (pStats->latencyMean_uS - latency_uS) / completed;
+    }
+  }
+
+  /* Bucket i counts latencies below 1024uS << i, the last everything else */
+  latency_uS >>= 10;
+
+  for (bucket = 0; (latency_uS > 0) && (bucket < (BC_STATS_BUCKETS - 1)); bucket++)
+  {
+    latency_uS >>= 1;
+  }
+
+  if (pStats->histogram[bucket] < UINT16_MAX)
+  {
+    pStats->histogram[bucket]++;
+  }
+}
+
+const _BC_STATS *CBERGCloudBase::getStats(void)
+{
+  return &m_stats;
+}
+
+const _BC_COMMAND_STATS *CBERGCloudBase::getCommandStats(uint8_t command)
+{
+  /* NULL if statistics are not kept for command */
+  uint8_t i;
+
+  for (i = 0; i < BC_STATS_COMMANDS; i++)
+  {
+    if (m_stats.command[i].command == command)
+    {
+      return &m_stats.command[i];
+    }
+  }
+
+  return NULL;
+}
+
+void CBERGCloudBase::clearStats(void)
+{
+  uint8_t i;
+
+  memset(&m_stats, 0, sizeof(m_stats));
+
+  for (i = 0; i < BC_STATS_COMMANDS; i++)
+  {
+    m_stats.command[i].command = statsCommands[i];
+  }
+}
+
+#endif // #ifdef BERGCLOUD_STATS
+
+#ifdef BERGCLOUD_TRACE
+
+void CBERGCloudBase::traceStart(uint8_t type, uint8_t size)
+{
+  /* Start a record of size bytes, the data follows with traceAdd(). */
+  /* The oldest records are dropped to make room. */
+  uint32_t time_mS = timerRead_mS();
+  uint16_t recordSize = BC_TRACE_RECORD_HEADER_SIZE + size;
+
+  if (recordSize > sizeof(m_trace))
+  {
+    m_traceSkip = true;
+    return;
+  }
+
+  while ((sizeof(m_trace) - m_traceUsed) < recordSize)
+  {
+    traceRemove();
+  }
+
+  m_traceSkip = false;
+  traceByte(type);
+  traceByte(time_mS >> 24);
+  traceByte(time_mS >> 16);
+  traceByte(time_mS >> 8);
+  traceByte(time_mS);
+  traceByte(size);
+}
+
+void CBERGCloudBase::traceAdd(const uint8_t *pData, uint16_t size)
+{
+  if (m_traceSkip)
+  {
+    /* Record too large to keep */
+    return;
+  }
+
+  while (size-- > 0)
+  {
+    traceByte(*pData++);
+  }
+}
+
+void CBERGCloudBase::traceByte(uint8_t data)
+{
+  m_trace[(m_traceHead + m_traceUsed) % sizeof(m_trace)] = data;
+  m_traceUsed++;
+}
+
+void CBERGCloudBase::traceRemove(void)
+{
+  /* Remove the oldest record */
+  uint16_t recordSize = BC_TRACE_RECORD_HEADER_SIZE +
+    m_trace[(m_traceHead + BC_TRACE_RECORD_HEADER_SIZE - 1) % sizeof(m_trace)];
+
+  m_traceHead = (m_traceHead + recordSize) % sizeof(m_trace);
+  m_traceUsed -= recordSize;
+}
+
+void CBERGCloudBase::traceRequest(void)
+{
+  uint8_t i;
+  uint16_t size = SPI_PROTOCOL_HEADER_SIZE;
+
+  for (i = 0; i < m_tr.txSegments; i++)
+  {
+    size += m_tr.tx[i].size;
+  }
+
+  traceStart(BC_TRACE_REQUEST, (uint8_t)size);
+  traceAdd(m_header, SPI_PROTOCOL_HEADER_SIZE);
+
+  for (i = 0; i < m_tr.txSegments; i++)
+  {
+    traceAdd(m_tr.tx[i].pData, m_tr.tx[i].size);
+  }
+}
+
+void CBERGCloudBase::traceResponseData(void)
+{
+  /* The response data kept in the receive buffers */
+  uint16_t remaining = m_rxStored;
+  uint16_t size;
+  uint8_t i;
+
+  traceStart(BC_TRACE_DATA, (uint8_t)m_rxStored);
+
+  for (i = 0; (i < m_tr.rxSegments) && (remaining > 0); i++)
+  {
+    size = (m_tr.rx[i].size < remaining) ? m_tr.rx[i].size : remaining;
+    traceAdd(m_tr.rx[i].pData, size);
+    remaining -= size;
+  }
+}
+
+void CBERGCloudBase::traceEnd(bool transferred)
+{
+  /* The state the transaction ended in, and whether the response */
+  /* was received */
+  uint8_t end[2];
+
+  end[0] = m_trState;
+  end[1] = transferred ? 1 : 0;
+
+  traceStart(BC_TRACE_END, sizeof(end));
+  traceAdd(end, sizeof(end));
+}
+
+uint16_t CBERGCloudBase::traceRead(uint8_t *pBuffer, uint16_t bufferSize)
+{
+  /* Copy out and remove the oldest whole records that fit. Returns */
+  /* the number of bytes copied. */
+  uint16_t copied = 0;
+  uint16_t recordSize;
+
+  while (m_traceUsed > 0)
+  {
+    recordSize = BC_TRACE_RECORD_HEADER_SIZE +
+      m_trace[(m_traceHead + BC_TRACE_RECORD_HEADER_SIZE - 1) % sizeof(m_trace)];
+
+    if (recordSize > (bufferSize - copied))
+    {
+      break;
+    }
+
+    while (recordSize-- > 0)
+    {
+      pBuffer[copied++] = m_trace[m_traceHead];
+      m_traceHead = (m_traceHead + 1) % sizeof(m_trace);
+      m_traceUsed--;
+    }
+  }
+
+  return copied;
+}
+
+void CBERGCloudBase::traceClear(void)
+{
+  m_traceHead = 0;
+  m_traceUsed = 0;
+  m_traceSkip = false;
+}
+
+#ifdef _BC_LOG
+
+void CBERGCloudBase::traceDump(void)
+{
+  /* Print the trace with logPrintf() as lines of hex bytes starting */
+  /* "BCT:", as read by tools/trace/TraceReplay, and clear it */
+  uint16_t i;
+
+  for (i = 0; i < m_traceUsed; i++)
+  {
+    if ((i % 16) == 0)
+    {
+      if (i > 0)
+      {
+        logPrintf(_BC_PSTR("\r\n"));
+      }
+
+      logPrintf(_BC_PSTR("BCT:"));
+    }
+
+    logPrintf(_BC_PSTR(" %02x"), m_trace[(m_traceHead + i) % sizeof(m_trace)]);
+  }
+
+  if (i > 0)
+  {
+    logPrintf(_BC_PSTR("\r\n"));
+  }
+
+  traceClear();
+}
+
+#endif // #ifdef _BC_LOG
+
+#endif // #ifdef BERGCLOUD_TRACE
+
 uint8_t CBERGCloudBase::SPITransaction(uint8_t dataOut, bool finalCS)
 {
   uint8_t dataIn = 0;
 
   SPITransaction(&dataOut, &dataIn, (uint16_t)1, finalCS);
+  _BC_STAT_BYTES(1)
 
   return dataIn;
 }
 
+uint8_t CBERGCloudBase::SPISendBlock(uint8_t *pDataOut, uint16_t dataSize)
+{
+  /* Clock out a block of data in bursts. Returns SPI_PROTOCOL_PAD if */
+  /* every byte received was padding, otherwise the first one that wasn't */
+  uint8_t rxBurst[SPI_BURST_SIZE];
+  uint16_t burstSize;
+  uint16_t i;
+
+  while (dataSize > 0)
+  {
+    burstSize = (dataSize < sizeof(rxBurst)) ? dataSize : sizeof(rxBurst);
+
+    SPITransaction(pDataOut, rxBurst, burstSize, false);
+    _BC_STAT_BYTES(burstSize)
+
+    for (i = 0; i < burstSize; i++)
+    {
+      if (rxBurst[i] != SPI_PROTOCOL_PAD)
+      {
+        return rxBurst[i];
+      }
+    }
+
+    pDataOut += burstSize;
+    dataSize -= burstSize;
+  }
+
+  return SPI_PROTOCOL_PAD;
+}
+
+uint16_t CBERGCloudBase::SPIReceiveBlock(uint8_t *pDataIn, uint16_t dataSize, uint16_t crc)
+{
+  /* Clock in a block of data and return the updated CRC. If pDataIn */
+  /* is NULL the data is read in bursts and discarded */
+  uint8_t rxBurst[SPI_BURST_SIZE];
+  uint8_t *pBlock;
+  uint16_t blockSize;
+
+  while (dataSize > 0)
+  {
+    if (pDataIn != NULL)
+    {
+      /* Receive in place, the whole block at once */
+      pBlock = pDataIn;
+      blockSize = dataSize;
+      pDataIn += blockSize;
+    }
+    else
+    {
+      pBlock = rxBurst;
+      blockSize = (dataSize < sizeof(rxBurst)) ? dataSize : sizeof(rxBurst);
+    }
+
+    memset(pBlock, SPI_PROTOCOL_PAD, blockSize);
+    SPITransaction(pBlock, pBlock, blockSize, false);
+    _BC_STAT_BYTES(blockSize)
+    crc = crc16(pBlock, blockSize, crc);
+
+    dataSize -= blockSize;
+  }
+
+  return crc;
+}
+
 void CBERGCloudBase::begin(void)
 {
   m_synced = false;
+  /* After power up the reset byte may be the first byte clocked */
+  m_syncPad = true;
   m_lastResponse = SPI_RSP_SUCCESS;
+  m_trState = _BC_TR_IDLE;
+  m_asyncStatus = BC_ASYNC_IDLE;
+  m_trInternal = false;
+  m_commandTruncated = false;
+  m_completionFn = NULL;
+  m_completionContext = NULL;
+
+  m_pollTimeout_mS = POLL_TIMEOUT_MS;
+  m_syncTimeout_mS = SYNC_TIMEOUT_MS;
+  m_pollIntervalMax_uS = (uint32_t)POLL_INTERVAL_MAX_MS * 1000;
+  memset(m_pollEstimate_uS, 0, sizeof(m_pollEstimate_uS));
+  memset(m_pollCommand, 0, sizeof(m_pollCommand));
+  m_pollSlot = 0;
+  m_pollSlotNext = 0;
+
+#ifdef BERGCLOUD_FRAGMENTATION
+  m_fragActive = false;
+  m_fragHold_uS = 0;
+  m_fragSeq = 0;
+#endif
+
+#ifdef BERGCLOUD_BATCHING
+  m_batch[0] = BC_EVENT_START_BATCH >> 8;
+  m_batch[1] = 0; /* Number of events */
+  m_batchSize = 2;
+  m_batchSending = false;
+  m_batchMaxAge_mS = BATCH_MAX_AGE_MS;
+  clearBatchStats();
+#endif
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+  m_queueHead = 0;
+  m_queueUsed = 0;
+  m_queueSending = false;
+  m_queueDrop = BC_QUEUE_DROP_OLDEST;
+  m_queueBackoff_mS = 0;
+  m_queueRetries = 0;
+  memset(&m_queueStats, 0, sizeof(m_queueStats));
+#endif
+
+#ifdef BERGCLOUD_COMMAND_TABLE
+  memset(m_commandTable, 0, sizeof(m_commandTable));
+#endif
+
+#ifdef BERGCLOUD_CACHE
+  m_cacheValid = 0;
+  m_cacheTTL_mS = CACHE_TTL_MS;
+#endif
+
+#ifdef BERGCLOUD_STATS
+  clearStats();
+#endif
+
+#ifdef BERGCLOUD_TRACE
+  traceClear();
+#endif
+
+  /* Free running from here, phases are timed by difference */
+  timerReset();
 
 #ifdef _BC_LOG
 
   m_logError = true;
   m_logData = false;
 
+#ifdef BERGCLOUD_LOG_BINARY
+  m_logHead = 0;
+  m_logCount = 0;
+  m_logLost = 0;
+#endif
+
 #endif // #ifdef _BC_LOG
 }
 
@@ -588,6 +2867,202 @@ const char *CBERGCloudBase::getStatusText(uint8_t value)
   return NULL;
 }
 
+#ifdef BERGCLOUD_LOG_BINARY
+
+void CBERGCloudBase::logRecord(const char *format, ...)
+{
+  /* Binary form of logPrintf(): the format string and up to */
+  /* BC_LOG_BINARY_ARGS arguments are recorded for logDump() or */
+  /* logRead(). Each argument is read with the type its conversion */
+  /* gives it: integers (%d, %u, %x, %c...) as int, or as long with */
+  /* an 'l'. Other arguments (%s, %p, '*') aren't kept as what they */
+  /* point to may change, the entry is marked BC_LOG_UNFORMATTED. */
+  _BC_LOG_ENTRY *pEntry;
+  va_list argList;
+  uint16_t i = 0;
+  uint8_t args = 0;
+  bool isLong;
+  char c;
+
+  if (m_logCount == LOG_BINARY_SIZE)
+  {
+    /* Full, overwrite the oldest entry */
+    m_logHead = (m_logHead + 1) % LOG_BINARY_SIZE;
+    m_logCount--;
+
+    if (m_logLost < UINT16_MAX)
+    {
+      m_logLost++;
+    }
+  }
+
+  pEntry = &m_logEntries[(m_logHead + m_logCount) % LOG_BINARY_SIZE];
+  m_logCount++;
+
+  pEntry->format = format;
+  pEntry->time_mS = (uint16_t)timerRead_mS();
+  pEntry->flags = 0;
+  memset(pEntry->args, 0, sizeof(pEntry->args));
+
+  va_start(argList, format);
+
+  while ((c = _BC_LOG_READ(&format[i++])) != '\0')
+  {
+    if (c != '%')
+    {
+      continue;
+    }
+
+    c = _BC_LOG_READ(&format[i++]);
+
+    if (c == '%')
+    {
+      continue;
+    }
+
+    /* Flags, width and precision */
+    while (((c >= '0') && (c <= '9')) || (c == '.') ||
+           (c == '-') || (c == '+') || (c == ' ') || (c == '#'))
+    {
+      c = _BC_LOG_READ(&format[i++]);
+    }
+
+    /* Length, short arguments are passed as int */
+    isLong = (c == 'l');
+
+    if (isLong || (c == 'h'))
+    {
+      c = _BC_LOG_READ(&format[i++]);
+
+      if (!isLong && (c == 'h'))
+      {
+        c = _BC_LOG_READ(&format[i++]);
+      }
+    }
+
+    /* Integer conversions, anything else can't be recorded */
+    switch (c)
+    {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+      break;
+
+    default:
+      c = '\0';
+      break;
+    }
+
+    if ((c == '\0') || (args == BC_LOG_BINARY_ARGS))
+    {
+      /* Can't tell how to read the rest of the arguments */
+      pEntry->flags = BC_LOG_UNFORMATTED;
+      break;
+    }
+
+    if (isLong)
+    {
+      pEntry->args[args] = va_arg(argList, long);
+      pEntry->flags |= BC_LOG_ARG_LONG(args);
+    }
+    else
+    {
+      pEntry->args[args] = va_arg(argList, int);
+    }
+
+    args++;
+  }
+
+  va_end(argList);
+}
+
+bool CBERGCloudBase::logRead(_BC_LOG_ENTRY *pEntry)
+{
+  /* Remove the oldest entry, returns FALSE if there are none */
+  if (m_logCount == 0)
+  {
+    return false;
+  }
+
+  *pEntry = m_logEntries[m_logHead];
+  m_logHead = (m_logHead + 1) % LOG_BINARY_SIZE;
+  m_logCount--;
+  return true;
+}
+
+uint16_t CBERGCloudBase::logDump(void)
+{
+  /* Format and output every recorded entry with logPrintf(), call */
+  /* when the time this takes won't matter. Returns the number output. */
+  _BC_LOG_ENTRY entry;
+  uint16_t count = 0;
+  char text[17];
+  uint16_t i;
+  uint8_t n;
+
+  while (logRead(&entry))
+  {
+    logPrintf(_BC_PSTR("%u: "), (unsigned int)entry.time_mS);
+
+    /* Pass each argument with the type its conversion expects */
+    switch (entry.flags)
+    {
+    case 0:
+      logPrintf(entry.format, (int)entry.args[0], (int)entry.args[1]);
+      break;
+
+    case BC_LOG_ARG_LONG(0):
+      logPrintf(entry.format, entry.args[0], (int)entry.args[1]);
+      break;
+
+    case BC_LOG_ARG_LONG(1):
+      logPrintf(entry.format, (int)entry.args[0], entry.args[1]);
+      break;
+
+    case BC_LOG_ARG_LONG(0) | BC_LOG_ARG_LONG(1):
+      logPrintf(entry.format, entry.args[0], entry.args[1]);
+      break;
+
+    default:
+      /* Output the format as it is, a piece at a time */
+      i = 0;
+
+      do
+      {
+        for (n = 0; n < (sizeof(text) - 1); n++)
+        {
+          if ((text[n] = _BC_LOG_READ(&entry.format[i])) == '\0')
+          {
+            break;
+          }
+
+          i++;
+        }
+
+        text[n] = '\0';
+        logPrintf(_BC_PSTR("%s"), text);
+      } while (n == (sizeof(text) - 1));
+      break;
+    }
+
+    count++;
+  }
+
+  if (m_logLost > 0)
+  {
+    logPrintf(_BC_PSTR("%u lost\r\n"), (unsigned int)m_logLost);
+    m_logLost = 0;
+  }
+
+  return count;
+}
+
+uint16_t CBERGCloudBase::getLogLost(void)
+{
+  /* Entries overwritten since the last logDump() */
+  return m_logLost;
+}
+
+#endif // #ifdef BERGCLOUD_LOG_BINARY
+
 bool CBERGCloudBase::setLogOutput(bool logError = true, bool logData = false)
 {
   m_logError = logError;
@@ -28,35 +28,261 @@ THE SOFTWARE.
 #ifndef BERGCLOUDBASE_H
 #define BERGCLOUDBASE_H
 
+#include <stddef.h> /* For NULL */
+
 #include "BERGCloudConfig.h"
 #include "BERGCloudConst.h"
+#include "Message.h"
 
 #ifdef BERGCLOUD_LOG
 #define _BC_LOG
+#else
+#undef BERGCLOUD_LOG_BINARY
 #endif
 
-#ifdef _BC_LOG
-#define _LOG(...)       logPrintf(__VA_ARGS__);
-#define _LOG_ERROR(...) if (m_logError) { logPrintf(__VA_ARGS__); }
-#define _LOG_DATA(...)  if (m_logData)  { logPrintf(__VA_ARGS__); }
+/* Log format strings are kept in flash on AVR */
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define _BC_PSTR(s) PSTR(s)
+#else
+#define _BC_PSTR(s) (s)
+#endif
+
+#ifdef BERGCLOUD_LOG_BINARY
+#define _BC_LOG_OUT(format, ...) logRecord(_BC_PSTR(format), ##__VA_ARGS__);
+#else
+#define _BC_LOG_OUT(format, ...) logPrintf(_BC_PSTR(format), ##__VA_ARGS__);
+#endif
+
+#if defined(_BC_LOG) && (BERGCLOUD_LOG_LEVEL >= 1)
+#define _LOG(...)       _BC_LOG_OUT(__VA_ARGS__)
+#define _LOG_ERROR(...) if (m_logError) { _BC_LOG_OUT(__VA_ARGS__) }
 #else
 #define _LOG(...)
 #define _LOG_ERROR(...)
+#endif
+
+#if defined(_BC_LOG) && (BERGCLOUD_LOG_LEVEL >= 2)
+#define _LOG_DATA(...)  if (m_logData)  { _BC_LOG_OUT(__VA_ARGS__) }
+#else
 #define _LOG_DATA(...)
 #endif
 
 #define BERGCLOUD_LIB_VERSION (0x0100)
 #define _BC_LOG_LINE_LENGTH (80)
-#define MAX_SERIAL_DATA (64)
+
+/* Status of an asynchronous request, returned by service() */
+#define BC_ASYNC_IDLE     (0) /* No request has been started */
+#define BC_ASYNC_BUSY     (1) /* In progress, call service() again */
+#define BC_ASYNC_SUCCESS  (2) /* Completed with SPI_RSP_SUCCESS */
+#define BC_ASYNC_FAILED   (3) /* Transaction failed or shield returned an error */
+
+/* No deadline, the poll and sync timeouts still apply */
+#define BC_DEADLINE_NONE (0)
+
+/* Default number of bytes clocked per call to service() */
+#define BC_SERVICE_MAX_BYTES (16)
+
+/* SPI commands whose response time is learnt, see setPollBackoff() */
+#ifndef POLL_ESTIMATE_COMMANDS
+#define POLL_ESTIMATE_COMMANDS (4)
+#endif
+
+#ifdef BERGCLOUD_BATCHING
+typedef struct {
+  uint32_t eventsQueued;  /* Events added to a batch by queueEvent() */
+  uint32_t eventsSent;    /* Batched events delivered */
+  uint32_t batchesSent;   /* Frames that delivered them */
+  uint32_t batchesFailed; /* Flushes that failed, the batch is kept */
+  uint32_t bytesSavedEstimate; /* Framing bytes not clocked compared */
+                          /* with sending each event with sendEvent(), */
+                          /* worked out from the frame layout; pads, */
+                          /* polls and retries aren't counted */
+} _BC_BATCH_STATS;
+#endif
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+
+/* Bytes of event queue, each event takes its size plus three */
+#ifndef EVENT_QUEUE_SIZE
+#define EVENT_QUEUE_SIZE (128)
+#endif
+
+/* What postEvent() drops when the queue is full */
+#define BC_QUEUE_DROP_OLDEST (0)
+#define BC_QUEUE_DROP_NEWEST (1)
+
+typedef struct {
+  uint16_t depth;    /* Events in the queue */
+  uint16_t maxDepth; /* Highest depth since cleared */
+  uint32_t posted;   /* Events passed to postEvent() */
+  uint32_t sent;     /* Events delivered */
+  uint32_t dropped;  /* Events dropped when full, rejected by the shield */
+                     /* or still failing after QUEUE_RETRY_LIMIT retries */
+  uint32_t retries;  /* Sends retried after BUSY, SEND_FAILED or an error */
+} _BC_QUEUE_STATS;
+
+#endif // #ifdef BERGCLOUD_EVENT_QUEUE
+
+#ifdef BERGCLOUD_COMMAND_TABLE_FULL
+#ifndef BERGCLOUD_COMMAND_TABLE
+#define BERGCLOUD_COMMAND_TABLE
+#endif
+#endif
+
+#ifdef BERGCLOUD_COMMAND_TABLE
+
+/* Command handlers that can be registered, a power of two */
+#ifndef COMMAND_HANDLERS
+#define COMMAND_HANDLERS (8)
+#endif
+
+#if (COMMAND_HANDLERS & (COMMAND_HANDLERS - 1)) != 0
+#error "COMMAND_HANDLERS must be a power of two"
+#endif
+
+/* Maximum commands handled by one call to processCommands() */
+#define BC_PROCESS_COMMANDS_MAX (8)
+
+/* Called by processCommands() for each command received */
+typedef void (*_BC_COMMAND_FN)(void *pContext, uint8_t commandID, uint8_t *pData, uint16_t dataSize);
+
+typedef struct {
+  _BC_COMMAND_FN fn;
+  void *pContext;
+#ifndef BERGCLOUD_COMMAND_TABLE_FULL
+  uint8_t commandID;
+#endif
+} _BC_COMMAND_HANDLER;
+
+#endif // #ifdef BERGCLOUD_COMMAND_TABLE
+
+#ifdef BERGCLOUD_STATS
+
+/* SPI commands with their own statistics, and latency histogram */
+/* buckets for each: bucket i counts transactions that completed in */
+/* under 1024uS << i, the last bucket all those that took longer */
+#define BC_STATS_COMMANDS (11)
+#define BC_STATS_BUCKETS (8)
+
+typedef struct {
+  uint8_t command;         /* SPI_CMD_ value */
+  uint32_t count;          /* Transactions */
+  uint32_t failed;         /* Transactions that ended without a response */
+  uint32_t bytes;          /* Bytes clocked, including padding */
+  uint32_t latencyMin_uS;  /* Latency of those that completed */
+  uint32_t latencyMax_uS;
+  uint32_t latencyMean_uS;
+  uint16_t histogram[BC_STATS_BUCKETS];
+} _BC_COMMAND_STATS;
+
+typedef struct {
+  /* Failures, by where they were detected */
+  uint32_t syncTimeouts;   /* No reset byte while synchronising */
+  uint32_t resets;         /* Shield reset while sending or polling */
+  uint32_t syncErrors;     /* Unexpected byte while sending */
+  uint32_t pollTimeouts;   /* No response */
+  uint32_t sizeErrors;     /* Invalid response size */
+  uint32_t crcErrors;      /* Response CRC incorrect */
+  /* Responses */
+  uint32_t busy;           /* SPI_RSP_BUSY */
+  uint32_t errorResponses; /* Other responses except SUCCESS and NO_DATA */
+  /* Link */
+  uint32_t resyncs;        /* Successful synchronisations */
+  uint32_t resyncBytes;    /* Bytes clocked while synchronising */
+  uint32_t resyncTotal_uS; /* Time spent synchronising */
+  uint32_t resyncMax_uS;   /* Longest synchronisation */
+  uint32_t padBytes;       /* Padding clocked while polling for responses */
+  /* Cache, see BERGCLOUD_CACHE */
+  uint32_t cacheHits;      /* Requests completed without using the SPI bus */
+  uint32_t cacheMisses;    /* Requests that could have been but weren't */
+  _BC_COMMAND_STATS command[BC_STATS_COMMANDS];
+} _BC_STATS;
+
+#endif // #ifdef BERGCLOUD_STATS
+
+#ifdef BERGCLOUD_CACHE
+/* Claimcode bytes kept, including the terminator; a longer one is */
+/* fetched every time */
+#ifndef CACHE_CLAIMCODE_SIZE
+#define CACHE_CLAIMCODE_SIZE (20)
+#endif
+#endif // #ifdef BERGCLOUD_CACHE
+
+#ifdef BERGCLOUD_LOG_BINARY
+
+/* Log entries kept until logDump() */
+#ifndef LOG_BINARY_SIZE
+#define LOG_BINARY_SIZE (16)
+#endif
+
+/* Arguments recorded with each entry */
+#define BC_LOG_BINARY_ARGS (2)
+
+/* _BC_LOG_ENTRY flags */
+#define BC_LOG_ARG_LONG(n) (1 << (n)) /* args[n] is for a %l conversion */
+#define BC_LOG_UNFORMATTED (0x80)     /* Arguments not kept, see logRecord() */
+
+typedef struct {
+  const char *format;  /* Identifies the message, in flash on AVR */
+  uint16_t time_mS;    /* Low 16 bits of the time it was recorded */
+  uint8_t flags;
+  long args[BC_LOG_BINARY_ARGS];
+} _BC_LOG_ENTRY;
+
+#endif // #ifdef BERGCLOUD_LOG_BINARY
+
+#ifdef BERGCLOUD_TRACE
+/* Bytes of trace kept, the oldest records are dropped when full */
+#ifndef TRACE_SIZE
+#define TRACE_SIZE (256)
+#endif
+#endif
+
+/* Each BERGCLOUD_TRACE record is its type, the time from timerRead_mS() (four */
+/* bytes, MSByte first), the size of its data and then the data */
+#define BC_TRACE_RECORD_HEADER_SIZE (6)
+#define BC_TRACE_REQUEST  (1) /* Request frame as sent */
+#define BC_TRACE_RESPONSE (2) /* Response header as received */
+#define BC_TRACE_DATA     (3) /* Response data kept in the receive buffers */
+#define BC_TRACE_SYNC     (4) /* Resynchronised, no data */
+#define BC_TRACE_END      (5) /* Transaction state it ended in (see */
+                              /* BERGCloudBase.cpp) and 1 if the */
+                              /* response was received, else 0 */
+
+/* Called when an asynchronous request completes */
+typedef void (*_BC_COMPLETION_FN)(void *pContext, uint8_t command, uint8_t status);
+
+/* Maximum number of buffers the data of one request is sent from, */
+/* and the data of its response is received into */
+#define _BC_TX_SEGMENTS (3)
+#ifdef BERGCLOUD_FRAGMENTATION
+#define _BC_RX_SEGMENTS (3)
+#else
+#define _BC_RX_SEGMENTS (2)
+#endif
+
+#ifdef BERGCLOUD_FRAGMENTATION
+/* Event or command data carried by each fragment, and the largest */
+/* event or command that can be fragmented */
+#define BC_FRAGMENT_DATA_SIZE (MAX_SERIAL_DATA - 2 - BC_FRAGMENT_HEADER_SIZE)
+#define BC_FRAGMENT_MAX_SIZE ((BC_FRAGMENT_INDEX_MASK + 1) * BC_FRAGMENT_DATA_SIZE)
+#endif
+
+typedef struct {
+  uint8_t *pData;
+  uint16_t size;
+} _BC_SEGMENT;
 
 typedef struct {
   uint8_t command;
-  uint8_t *pTx;
-  uint16_t txSize;
+  _BC_SEGMENT tx[_BC_TX_SEGMENTS];
+  uint8_t txSegments;
   uint8_t *pResponse;
-  uint8_t *pRx;
-  uint16_t rxMaxSize;
+  _BC_SEGMENT rx[_BC_RX_SEGMENTS];
+  uint8_t rxSegments;
   uint16_t *pRxSize;
+  uint32_t deadline_mS;
 } _BC_TRANSACTION;
 
 #ifdef _BC_LOG
@@ -71,37 +297,322 @@ typedef struct {
 class CBERGCloudBase
 {
 public:
-  bool pollForCommand(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint16_t *pCommandSize, uint8_t *pCommandID);
-  bool sendEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize);
+  bool pollForCommand(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint16_t *pCommandSize, uint8_t *pCommandID, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool pollForCommand(CMessage& buffer, uint8_t *pCommandID, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  /* A command larger than the buffer is read and the rest discarded; */
+  /* pollForCommand() returns false but sets the command ID and its */
+  /* full size, and getCommandTruncated() returns TRUE until the next */
+  /* poll. A NULL or zero size buffer asks for only the ID and size. */
+  bool getCommandTruncated(void);
+  bool sendEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool sendEvent(uint8_t eventCode, CMessage& buffer, uint32_t deadline_mS = BC_DEADLINE_NONE);
   bool setLogOutput(bool logError, bool logData);
-  bool getNetworkState(uint8_t *pState);
-  bool joinNetwork(const uint8_t productID[16] = nullProductID, uint32_t version = 0);
-  bool getClaimingState(uint8_t *pState);
-  bool getClaimcode(char *pBuffer, uint32_t bufferSize);
-  bool getEUI64(uint8_t type, uint8_t *pBuffer, uint32_t bufferSize);
-  bool setDisplayStyle(uint8_t style);
-  bool print(const char *pText);
+  bool getNetworkState(uint8_t *pState, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool joinNetwork(const uint8_t productID[16] = nullProductID, uint32_t version = 0, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getClaimingState(uint8_t *pState, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getClaimcode(char *pBuffer, uint32_t bufferSize, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getEUI64(uint8_t type, uint8_t *pBuffer, uint32_t bufferSize, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getSignalQuality(int8_t *pRSSI, uint8_t *pLQI, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool setDisplayStyle(uint8_t style, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool print(const char *pText, uint32_t deadline_mS = BC_DEADLINE_NONE);
+
+  /* Asynchronous forms of the above. Each starts a request and returns */
+  /* false if one is already in progress; service() then advances it. */
+  /* Buffers passed in must remain valid until the request completes. */
+  /* getAsyncStatus() and the completion callback only report requests */
+  /* started by the caller, not events the library sends in the */
+  /* background from service(). A request answered from the cache */
+  /* (BERGCLOUD_CACHE) has completed when its Async call returns: the */
+  /* callback has been called and the status is BC_ASYNC_SUCCESS. */
+  bool pollForCommandAsync(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint16_t *pCommandSize, uint8_t *pCommandID, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool pollForCommandAsync(CMessage& buffer, uint8_t *pCommandID, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool sendEventAsync(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool sendEventAsync(uint8_t eventCode, CMessage& buffer, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getNetworkStateAsync(uint8_t *pState, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool joinNetworkAsync(const uint8_t productID[16] = nullProductID, uint32_t version = 0, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getClaimingStateAsync(uint8_t *pState, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getClaimcodeAsync(char *pBuffer, uint32_t bufferSize, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getEUI64Async(uint8_t type, uint8_t *pBuffer, uint32_t bufferSize, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool getSignalQualityAsync(int8_t *pRSSI, uint8_t *pLQI, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool setDisplayStyleAsync(uint8_t style, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool printAsync(const char *pText, uint32_t deadline_mS = BC_DEADLINE_NONE);
+  uint8_t service(uint16_t maxBytes = BC_SERVICE_MAX_BYTES);
+  uint8_t getAsyncStatus(void);
+  void setCompletionCallback(_BC_COMPLETION_FN fn, void *pContext = NULL);
+  void setTimeouts(uint32_t pollTimeout_mS, uint32_t syncTimeout_mS);
+  void setPollBackoff(uint16_t maxInterval_mS);
+  uint32_t getResponseEstimate_uS(uint8_t command);
+
+#ifdef BERGCLOUD_BATCHING
+  /* Batched events. queueEvent() adds an event to the batch, which is */
+  /* sent when the next event won't fit, when it is older than the */
+  /* maximum age (checked by queueEvent() and by service() when idle) */
+  /* or by flushEvents(). queueEvent() may block while a batch is sent, */
+  /* and returns FALSE if the batch must be sent to make room while an */
+  /* async request is in progress. */
+  bool queueEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize);
+  bool queueEvent(uint8_t eventCode, CMessage& buffer);
+  bool flushEvents(uint32_t deadline_mS = BC_DEADLINE_NONE);
+  bool flushEventsAsync(uint32_t deadline_mS = BC_DEADLINE_NONE);
+  void setBatchMaxAge(uint32_t maxAge_mS);
+  const _BC_BATCH_STATS *getBatchStats(void);
+  void clearBatchStats(void);
+#endif
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+  /* Queued events. postEvent() copies an event into the queue, it is */
+  /* then sent by service() when no other request is in progress. */
+  /* Blocking calls first finish any event being sent this way. An */
+  /* event that fails is retried with backoff, QUEUE_RETRY_LIMIT times. */
+  bool postEvent(uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize);
+  bool postEvent(uint8_t eventCode, CMessage& buffer);
+  void setEventQueueDrop(uint8_t policy);
+  const _BC_QUEUE_STATS *getEventQueueStats(void);
+  void clearEventQueueStats(void);
+#endif
+
+#ifdef BERGCLOUD_COMMAND_TABLE
+  bool registerCommand(uint8_t commandID, _BC_COMMAND_FN fn, void *pContext = NULL);
+  uint8_t processCommands(uint8_t *pBuffer, uint16_t bufferSize, uint8_t maxCommands = BC_PROCESS_COMMANDS_MAX);
+#endif
+
+#ifdef BERGCLOUD_CACHE
+  /* EUI64s and the claimcode are kept until invalidateCache(), except */
+  /* the parent and coordinator EUI64s which, with network and claim */
+  /* state, are dropped on joinNetwork() and when the link is */
+  /* resynchronised. Network and claim state also expire after the TTL. */
+  void setCacheTTL(uint32_t ttl_mS);
+  void invalidateCache(void);
+#endif
+
+#ifdef BERGCLOUD_STATS
+  const _BC_STATS *getStats(void);
+  const _BC_COMMAND_STATS *getCommandStats(uint8_t command);
+  void clearStats(void);
+#endif
+
+#ifdef BERGCLOUD_TRACE
+  uint16_t traceRead(uint8_t *pBuffer, uint16_t bufferSize);
+  void traceClear(void);
+#ifdef _BC_LOG
+  void traceDump(void);
+#endif
+#endif
+
+#ifdef BERGCLOUD_LOG_BINARY
+  /* Recorded log entries. Integer arguments (with 'l' for long) are */
+  /* kept; an entry with %s, %p or more than BC_LOG_BINARY_ARGS */
+  /* arguments is marked BC_LOG_UNFORMATTED and dumped as its format. */
+  bool logRead(_BC_LOG_ENTRY *pEntry);
+  uint16_t logDump(void);
+  uint16_t getLogLost(void);
+#endif
+
   uint8_t m_lastResponse;
   static uint8_t nullProductID[16];
 protected:
   void begin(void);
   void end(void);
   void logError(uint8_t value);
+  /* pDataIn may be the same buffer as pDataOut */
   virtual uint16_t SPITransaction(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS) = 0;
   virtual void timerReset(void) = 0;
   virtual uint32_t timerRead_mS(void) = 0;
+  virtual uint32_t timerRead_uS(void);
 private:
-  uint16_t Crc16(uint8_t data, uint16_t crc);
   uint8_t SPITransaction(uint8_t data, bool finalCS);
-  bool transaction(_BC_TRANSACTION *tr);
+  uint8_t SPISendBlock(uint8_t *pDataOut, uint16_t dataSize);
+  bool pollForCommandStart(uint8_t *pCommandBuffer, uint16_t commandBufferSize, uint32_t deadline_mS);
+  bool sendEventStart(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS);
+  uint16_t SPIReceiveBlock(uint8_t *pDataIn, uint16_t dataSize, uint16_t crc);
+  bool transactionStart(_BC_TRANSACTION *pTr);
+  bool transactionBusy(void);
+  void transactionPhase(uint8_t state);
+  bool transactionTimeout(uint32_t timeout_mS);
+  void pollSchedule(void);
+  void pollLearn(void);
+  uint8_t pollEstimateSlot(uint8_t command);
+  void transactionHeaderReceived(void);
+  void transactionRxLimit(void);
+  void transactionDataReceived(void);
+  void transactionEnd(bool success);
+  bool commandReceived(void);
+  bool wait(void);
+  void finishBackground(void);
+#ifdef BERGCLOUD_FRAGMENTATION
+  bool fragmentSendStart(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize, uint32_t deadline_mS);
+  bool fragmentSend(void);
+  void commandFormatReceived(void);
+  bool fragmentReceived(void);
+  bool fragmentNext(bool transferred, bool *pSuccess);
+  void fragmentHold(void);
+  uint32_t fragmentRemaining_mS(void);
+#endif
+#ifdef BERGCLOUD_BATCHING
+  bool batchDue(void);
+  bool batchAdd(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize);
+  void batchSent(bool success);
+#endif
+#ifdef BERGCLOUD_EVENT_QUEUE
+  void queueCopy(uint16_t offset, const uint8_t *pData, uint16_t size);
+  void queueRemove(void);
+  bool queuePost(uint16_t format, uint8_t eventCode, uint8_t *pEventBuffer, uint16_t eventSize);
+  void queueSend(void);
+  void queueSent(bool transferred, bool success);
+#endif
+#ifdef BERGCLOUD_COMMAND_TABLE
+  _BC_COMMAND_HANDLER *commandLookup(uint8_t commandID);
+#endif
+#ifdef BERGCLOUD_CACHE
+  bool cacheRead(uint8_t command, uint8_t type, uint8_t *pBuffer, uint32_t bufferSize);
+  void cacheStore(void);
+#endif
+#ifdef BERGCLOUD_STATS
+  void statsRecord(bool transferred);
+  void statsResync(void);
+#endif
+#ifdef BERGCLOUD_TRACE
+  void traceStart(uint8_t type, uint8_t size);
+  void traceAdd(const uint8_t *pData, uint16_t size);
+  void traceByte(uint8_t data);
+  void traceRemove(void);
+  void traceRequest(void);
+  void traceResponseData(void);
+  void traceEnd(bool transferred);
+#endif
   bool m_synced;
+  bool m_syncPad; /* Last byte clocked while synchronising was a pad */
+
+  /* Current transaction */
+  _BC_TRANSACTION m_tr;
+  uint8_t m_trState;
+  uint8_t m_header[SPI_PROTOCOL_HEADER_SIZE];
+  uint16_t m_trOffset;
+  uint8_t m_trSegment;
+  uint32_t m_trStart_mS;
+  uint32_t m_trPhaseStart_mS;
+  uint16_t m_trCRC;
+  uint16_t m_rxCRC;
+  uint16_t m_rxDataSize;
+  uint16_t m_rxStored;
+  uint16_t m_rxSegmentOffset;
+  bool m_rxTruncated;
+  uint8_t m_asyncStatus;
+  bool m_trInternal; /* Started by the library, not reported to the caller */
+  _BC_COMPLETION_FN m_completionFn;
+  void *m_completionContext;
+
+  /* Timeouts and response polling */
+  uint32_t m_pollTimeout_mS;
+  uint32_t m_syncTimeout_mS;
+  uint32_t m_pollIntervalMax_uS;
+  uint32_t m_pollStart_uS;
+  uint32_t m_pollNext_uS;
+  uint32_t m_pollLast_uS;
+  uint32_t m_pollEstimate_uS[POLL_ESTIMATE_COMMANDS];
+  uint8_t m_pollCommand[POLL_ESTIMATE_COMMANDS];
+  uint8_t m_pollSlot;
+  uint8_t m_pollSlotNext;
+
+  /* Request data that must outlive the call that started it. Fields */
+  /* the library adds or removes are held in m_fields, caller data is */
+  /* sent from and received into the caller's buffers directly. */
+  uint8_t m_fields[2 + BC_FRAGMENT_HEADER_SIZE];
+  uint16_t *m_pCommandSize;
+  uint8_t *m_pCommandID;
+  CMessage *m_pCommandMessage;
+  uint16_t m_commandBufferSize;
+  bool m_commandTruncated;
+
+#ifdef BERGCLOUD_FRAGMENTATION
+  /* Fragmented event being sent or command being reassembled */
+  bool m_fragActive;
+  uint8_t *m_pFragData;
+  uint16_t m_fragSize;
+  uint16_t m_fragOffset;
+  uint16_t m_fragLength;
+  uint8_t m_fragSeq;
+  uint8_t m_fragIndex;
+  uint8_t m_fragID;
+  uint8_t m_fragRetries;
+  uint32_t m_fragHold_uS;
+  uint32_t m_fragStart_mS;
+  uint32_t m_fragDeadline_mS;
+#endif
+
+#ifdef BERGCLOUD_BATCHING
+  /* Batch frame, see BC_EVENT_START_BATCH */
+  uint8_t m_batch[MAX_SERIAL_DATA];
+  uint16_t m_batchSize;
+  bool m_batchSending;
+  uint32_t m_batchStart_mS;
+  uint32_t m_batchMaxAge_mS;
+  _BC_BATCH_STATS m_batchStats;
+#endif
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+  /* Ring of queued events, see queuePost() */
+  uint8_t m_queue[EVENT_QUEUE_SIZE];
+  uint16_t m_queueHead;
+  uint16_t m_queueUsed;
+  bool m_queueSending;
+  uint8_t m_queueDrop;
+  uint32_t m_queueRetryStart_mS;
+  uint32_t m_queueBackoff_mS;
+  uint8_t m_queueRetries;
+  _BC_QUEUE_STATS m_queueStats;
+#endif
+
+#ifdef BERGCLOUD_COMMAND_TABLE
+#ifdef BERGCLOUD_COMMAND_TABLE_FULL
+  _BC_COMMAND_HANDLER m_commandTable[256];
+#else
+  _BC_COMMAND_HANDLER m_commandTable[COMMAND_HANDLERS];
+#endif
+#endif
+
+#ifdef BERGCLOUD_CACHE
+  uint8_t m_cacheValid;
+  uint8_t m_cacheEUI64[BC_EUI64_COORDINATOR + 1][8];
+  char m_cacheClaimcode[CACHE_CLAIMCODE_SIZE];
+  uint8_t m_cacheClaimcodeSize;
+  uint8_t m_cacheNetworkState;
+  uint8_t m_cacheClaimState;
+  uint32_t m_cacheNetworkTime_mS;
+  uint32_t m_cacheClaimTime_mS;
+  uint32_t m_cacheTTL_mS;
+#endif
+
+#ifdef BERGCLOUD_STATS
+  _BC_STATS m_stats;
+  uint32_t m_trStart_uS;
+  uint16_t m_trBytes;
+  uint32_t m_syncStart_uS;
+#endif
+
+#ifdef BERGCLOUD_TRACE
+  /* Ring of trace records, see BC_TRACE_REQUEST */
+  uint8_t m_trace[TRACE_SIZE];
+  uint16_t m_traceHead;
+  uint16_t m_traceUsed;
+  bool m_traceSkip;
+#endif
 
 #ifdef _BC_LOG
 
 protected:
+  /* format is in flash (PROGMEM) on AVR */
   virtual void logPrintf(const char *format, ...) = 0;
   bool m_logError;
   bool m_logData;
+#ifdef BERGCLOUD_LOG_BINARY
+  void logRecord(const char *format, ...);
+private:
+  _BC_LOG_ENTRY m_logEntries[LOG_BINARY_SIZE];
+  uint8_t m_logHead;
+  uint8_t m_logCount;
+  uint16_t m_logLost;
+#endif
 private:
   static const _BC_STATUS_MAP statusTextMap[];
   const char *getStatusText(uint8_t value);
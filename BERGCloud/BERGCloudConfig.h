@@ -31,4 +31,73 @@ THE SOFTWARE.
 /* Include debug logging */
 #define BERGCLOUD_LOG
 
+/* Logging compiled in when BERGCLOUD_LOG is defined: */
+/*   1 - errors */
+/*   2 - errors and data */
+/*   3 - as 2, plus a trace of CMessage packing (not on Arduino) */
+#ifndef BERGCLOUD_LOG_LEVEL
+#define BERGCLOUD_LOG_LEVEL (1)
+#endif
+
+/* Record log messages in a ring of LOG_BINARY_SIZE entries (see */
+/* BERGCloudBase.h) instead of printing them, so logging doesn't hold */
+/* up requests. logDump() prints them later. */
+//#define BERGCLOUD_LOG_BINARY
+
+/* CRC16 implementation used by the SPI framing layer, define one of: */
+/*   BERGCLOUD_CRC16_BITWISE - shift/xor per byte, no table */
+/*   BERGCLOUD_CRC16_NIBBLE  - 16 entry table, 32 bytes of flash */
+/*   BERGCLOUD_CRC16_TABLE   - 256 entry table, 512 bytes of flash, fastest */
+#define BERGCLOUD_CRC16_TABLE
+
+/* Split events larger than one SPI frame into fragments and reassemble */
+/* fragmented commands into the caller's buffer. Adds about 20 bytes */
+/* of RAM; the cloud application must understand the fragment format. */
+//#define BERGCLOUD_FRAGMENTATION
+
+/* Resynchronise by starting each burst of SPI_BURST_SIZE pad bytes */
+/* with a frame header with an invalid size, instead of only clocking */
+/* pads until the shield sends a reset byte. This relies on the shield */
+/* resetting when it receives an invalid header, which is how the */
+/* simulator behaves but has not been confirmed with shield firmware. */
+//#define BERGCLOUD_SYNC_REQUEST
+
+/* Gather events passed to queueEvent() into one SPI frame. Adds a */
+/* 64 byte batch buffer; the cloud application must understand the */
+/* batch format. */
+//#define BERGCLOUD_BATCHING
+
+/* Store events passed to postEvent() and send them from service(), */
+/* retrying when the shield is busy or the send fails. Adds a ring */
+/* buffer of EVENT_QUEUE_SIZE bytes (see BERGCloudBase.h). */
+//#define BERGCLOUD_EVENT_QUEUE
+
+/* Dispatch commands to handlers added with registerCommand(), see */
+/* processCommands(). Handlers are kept in a small hash table of */
+/* COMMAND_HANDLERS entries (see BERGCloudBase.h), or define */
+/* BERGCLOUD_COMMAND_TABLE_FULL as well for a 256 entry table indexed */
+/* by command ID, which uses 1KB of RAM on AVR. */
+//#define BERGCLOUD_COMMAND_TABLE
+//#define BERGCLOUD_COMMAND_TABLE_FULL
+
+/* Keep link statistics, see getStats(): call counts, bytes clocked */
+/* and latency for each SPI command, and counts of each kind of */
+/* error. Adds about 500 bytes of RAM. */
+//#define BERGCLOUD_STATS
+
+/* Make CMessage pack integers and strings in the shortest MessagePack */
+/* form by default, see CMessage::setPackCompact() */
+//#define BERGCLOUD_PACK_COMPACT
+
+/* Keep the results of getEUI64() and getClaimcode(), and of */
+/* getNetworkState() and getClaimingState() for CACHE_TTL_MS (see */
+/* setCacheTTL()), so repeated calls don't use the SPI bus. Adds */
+/* about 70 bytes of RAM. */
+//#define BERGCLOUD_CACHE
+
+/* Record each request and response frame in a ring of TRACE_SIZE */
+/* bytes (see BERGCloudBase.h), read with traceRead() or traceDump() */
+/* and replayed on a host with tools/trace/TraceReplay. */
+//#define BERGCLOUD_TRACE
+
 #endif // #ifndef BERGCLOUDCONFIG_H
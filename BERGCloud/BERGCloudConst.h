@@ -25,6 +25,18 @@ THE SOFTWARE.
 */
 
 
+/*
+ * Transport layer
+ */
+
+#define SPI_PROTOCOL_HEADER_SIZE (5) // Data length, CRC16 and command/status
+
+#define SPI_PROTOCOL_PAD    (0xff)
+#define SPI_PROTOCOL_RESET  (0xf5)
+
+#define MAX_SERIAL_DATA (64)
+#define MAX_DATA_SIZE (MAX_SERIAL_DATA + SPI_PROTOCOL_HEADER_SIZE)
+
 /*
  * Network layer
  */
@@ -33,6 +45,7 @@ THE SOFTWARE.
 
 #define BC_COMMAND_START_BINARY     0xC000
 #define BC_COMMAND_START_PACKED     0xC100
+#define BC_COMMAND_START_FRAGMENT   0xC200
 #define BC_COMMAND_ID_MASK          0x00FF
 #define BC_COMMAND_FORMAT_MASK      0xFF00
 
@@ -41,12 +54,28 @@ THE SOFTWARE.
 
 #define BC_EVENT_START_BINARY       0xE000
 #define BC_EVENT_START_PACKED       0xE100
+#define BC_EVENT_START_FRAGMENT     0xE200
+#define BC_EVENT_START_BATCH        0xE300
 #define BC_EVENT_ID_MASK            0x00FF
 #define BC_EVENT_FORMAT_MASK        0xFF00
 
 #define BC_COMMAND_FIRMWARE_ARDUINO 0xF010
 #define BC_COMMAND_FIRMWARE_MBED    0xF020
 
+/* A fragment follows its two byte event or command header with a */
+/* sequence number, its index (BC_FRAGMENT_LAST set on the final one) */
+/* and the format of the whole event or command, then its data */
+#define BC_FRAGMENT_HEADER_SIZE     (3)
+#define BC_FRAGMENT_LAST            0x80
+#define BC_FRAGMENT_INDEX_MASK      0x7F
+
+/* A batch has the number of events in place of the event code, then */
+/* each event as its code, its size (BC_BATCH_PACKED set for a packed */
+/* event) and its data */
+#define BC_BATCH_ENTRY_HEADER_SIZE  (2)
+#define BC_BATCH_PACKED             0x80
+#define BC_BATCH_SIZE_MASK          0x7F
+
 /*
  * Application layer
  */
@@ -0,0 +1,254 @@
+/*
+
+BERGCloud library for Linux
+
+Copyright (c) 2013 BERG Ltd. http://bergcloud.com/
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#ifndef ARDUINO
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include "BERGCloudLinux.h"
+
+CBERGCloudLinux BERGCloud;
+
+/*
+    spidev transport
+*/
+
+CBERGCloudSpidev::CBERGCloudSpidev(void)
+{
+  m_fd = -1;
+  m_speedHz = BC_SPIDEV_SPEED_HZ;
+}
+
+CBERGCloudSpidev::~CBERGCloudSpidev(void)
+{
+  close();
+}
+
+bool CBERGCloudSpidev::open(const char *pDevice, uint32_t speedHz)
+{
+  uint8_t mode = SPI_MODE_0;
+  uint8_t bits = 8;
+  uint8_t lsbFirst = 0;
+
+  close();
+
+  m_fd = ::open(pDevice, O_RDWR);
+
+  if (m_fd < 0)
+  {
+    return false;
+  }
+
+  m_speedHz = speedHz;
+
+  if ((ioctl(m_fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+      (ioctl(m_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+      (ioctl(m_fd, SPI_IOC_WR_LSB_FIRST, &lsbFirst) < 0) ||
+      (ioctl(m_fd, SPI_IOC_WR_MAX_SPEED_HZ, &m_speedHz) < 0))
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void CBERGCloudSpidev::close(void)
+{
+  if (m_fd >= 0)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+bool CBERGCloudSpidev::transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS)
+{
+  /* Split the block into spi_ioc_transfer entries and submit up to */
+  /* BC_SPIDEV_MAX_BATCH of them per SPI_IOC_MESSAGE, so a whole frame */
+  /* is normally a single system call */
+  struct spi_ioc_transfer xfer[BC_SPIDEV_MAX_BATCH];
+  uint16_t count;
+  uint16_t size;
+
+  if (m_fd < 0)
+  {
+    return false;
+  }
+
+  while (dataSize > 0)
+  {
+    memset(xfer, 0, sizeof(xfer));
+    count = 0;
+
+    while ((dataSize > 0) && (count < BC_SPIDEV_MAX_BATCH))
+    {
+      size = (dataSize < BC_SPIDEV_MAX_TRANSFER) ? dataSize : BC_SPIDEV_MAX_TRANSFER;
+
+      xfer[count].tx_buf = (unsigned long)pDataOut;
+      xfer[count].rx_buf = (unsigned long)pDataIn;
+      xfer[count].len = size;
+      xfer[count].speed_hz = m_speedHz;
+      xfer[count].bits_per_word = 8;
+
+      pDataOut += size;
+      pDataIn += size;
+      dataSize -= size;
+      count++;
+    }
+
+    /* On the last transfer of a message cs_change leaves nSSEL asserted */
+    xfer[count - 1].cs_change = ((dataSize > 0) || !finalCS) ? 1 : 0;
+
+    if (ioctl(m_fd, SPI_IOC_MESSAGE(count), xfer) < 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+    In-process transport
+*/
+
+CBERGCloudInProcess::CBERGCloudInProcess(void)
+{
+  m_fn = NULL;
+  m_pContext = NULL;
+}
+
+void CBERGCloudInProcess::begin(_BC_INPROCESS_FN fn, void *pContext)
+{
+  m_fn = fn;
+  m_pContext = pContext;
+}
+
+bool CBERGCloudInProcess::transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS)
+{
+  if (m_fn == NULL)
+  {
+    return false;
+  }
+
+  m_fn(m_pContext, pDataOut, pDataIn, dataSize, finalCS);
+  return true;
+}
+
+/*
+    CBERGCloudLinux
+*/
+
+static uint64_t monotonic_uS(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+uint16_t CBERGCloudLinux::SPITransaction(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS)
+{
+  if ( (pDataOut == NULL) || (pDataIn == NULL) || (m_pTransport == NULL) )
+  {
+    _LOG_ERROR("Invalid parameter (CBERGCloudLinux::SPITransaction)\r\n");
+    return 0;
+  }
+
+  if (!m_pTransport->transfer(pDataOut, pDataIn, dataSize, finalCS))
+  {
+    _LOG_ERROR("Transfer failed (CBERGCloudLinux::SPITransaction)\r\n");
+
+    /* Present a failed transfer as padding, the caller will time out */
+    memset(pDataIn, 0xff, dataSize);
+    return 0;
+  }
+
+  return dataSize;
+}
+
+void CBERGCloudLinux::timerReset(void)
+{
+  m_resetTime_uS = monotonic_uS();
+}
+
+uint32_t CBERGCloudLinux::timerRead_mS(void)
+{
+  return (uint32_t)((monotonic_uS() - m_resetTime_uS) / 1000);
+}
+
+uint32_t CBERGCloudLinux::timerRead_uS(void)
+{
+  return (uint32_t)(monotonic_uS() - m_resetTime_uS);
+}
+
+void CBERGCloudLinux::begin(CBERGCloudTransport *pTransport)
+{
+  /* Call base class method */
+  CBERGCloudBase::begin();
+
+  m_pTransport = pTransport;
+
+  if (m_pTransport == NULL)
+  {
+    _LOG_ERROR("pTransport is NULL (CBERGCloudLinux::begin)\r\n");
+  }
+}
+
+void CBERGCloudLinux::end()
+{
+  m_pTransport = NULL;
+
+  /* Call base class method */
+  CBERGCloudBase::end();
+}
+
+#ifdef _BC_LOG
+
+void CBERGCloudLinux::logPrintf(const char *format, ...)
+{
+  /* Log to stderr so output from host tools stays clean */
+  va_list argList;
+
+  va_start(argList, format);
+  vfprintf(stderr, format, argList);
+  va_end(argList);
+}
+
+#endif // #ifdef _BC_LOG
+
+#endif // #ifndef ARDUINO
@@ -0,0 +1,104 @@
+/*
+
+BERGCloud library for Linux
+
+Copyright (c) 2013 BERG Ltd. http://bergcloud.com/
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#ifndef BERGCLOUDLINUX_H
+#define BERGCLOUDLINUX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "BERGCloudBase.h"
+
+/* Default spidev clock, matches SPI_CLOCK_DIV4 on a 16MHz Arduino */
+#define BC_SPIDEV_SPEED_HZ (4000000)
+
+/* Largest block passed to spidev in a single spi_ioc_transfer */
+#define BC_SPIDEV_MAX_TRANSFER (64)
+
+/* Largest number of spi_ioc_transfer entries in one SPI_IOC_MESSAGE */
+#define BC_SPIDEV_MAX_BATCH (8)
+
+class CBERGCloudTransport
+{
+public:
+  virtual ~CBERGCloudTransport(void) {};
+  /* Full duplex transfer, pDataIn may be the same buffer as pDataOut. */
+  /* nSSEL stays asserted afterwards unless finalCS is true. */
+  virtual bool transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS) = 0;
+};
+
+class CBERGCloudSpidev : public CBERGCloudTransport
+{
+public:
+  CBERGCloudSpidev(void);
+  ~CBERGCloudSpidev(void);
+  bool open(const char *pDevice, uint32_t speedHz = BC_SPIDEV_SPEED_HZ);
+  void close(void);
+  bool transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS);
+private:
+  int m_fd;
+  uint32_t m_speedHz;
+};
+
+/* Called for each block clocked through a CBERGCloudInProcess transport */
+typedef void (*_BC_INPROCESS_FN)(void *pContext, uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS);
+
+class CBERGCloudInProcess : public CBERGCloudTransport
+{
+public:
+  CBERGCloudInProcess(void);
+  void begin(_BC_INPROCESS_FN fn, void *pContext);
+  bool transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS);
+private:
+  _BC_INPROCESS_FN m_fn;
+  void *m_pContext;
+};
+
+class CBERGCloudLinux : public CBERGCloudBase
+{
+public:
+  void begin(CBERGCloudTransport *pTransport);
+  void end();
+private:
+  uint16_t SPITransaction(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS);
+  void timerReset(void);
+  uint32_t timerRead_mS(void);
+  uint32_t timerRead_uS(void);
+  CBERGCloudTransport *m_pTransport;
+  uint64_t m_resetTime_uS;
+
+#ifdef _BC_LOG
+
+protected:
+  void logPrintf(const char *format, ...);
+
+#endif // #ifdef _BC_LOG
+
+};
+
+extern CBERGCloudLinux BERGCloud;
+
+#endif // #ifndef BERGCLOUDLINUX_H
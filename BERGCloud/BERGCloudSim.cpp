@@ -0,0 +1,477 @@
+/*
+
+BERGCloud Devboard shield simulator
+
+Copyright (c) 2013 BERG Ltd. http://bergcloud.com/
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#ifndef ARDUINO
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "BERGCloudSim.h"
+#include "CRC16.h"
+
+CBERGCloudSim::CBERGCloudSim(void)
+{
+  uint8_t i;
+
+  memset(m_handler, 0, sizeof(m_handler));
+  memset(m_handlerContext, 0, sizeof(m_handlerContext));
+  memset(m_forcedCount, 0, sizeof(m_forcedCount));
+
+  m_delayPadBytes = 0;
+  m_delay_uS = 0;
+  m_faultInterval = 0;
+  m_faultCount = 0;
+
+  m_networkState = BC_NETWORK_STATE_DISCONNECTED;
+  m_claimState = BC_CLAIM_STATE_NOT_CLAIMED;
+  setClaimcode("SIMU-LATE-DSHI-ELD0");
+  setSignalQuality(-60, 200);
+
+  for (i = 0; i < 3; i++)
+  {
+    memset(m_eui64[i], 0, BC_SIM_EUI64_SIZE);
+    m_eui64[i][0] = i + 1;
+    m_eui64[i][7] = 0xbc;
+  }
+
+  m_lastEventSize = 0;
+  clearCommands();
+  clearStats();
+  reset();
+}
+
+/*
+    Transport
+*/
+
+bool CBERGCloudSim::transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS)
+{
+  uint16_t i;
+
+  /* pDataIn may alias pDataOut, read each byte before it is replaced */
+  for (i = 0; i < dataSize; i++)
+  {
+    pDataIn[i] = clock(pDataOut[i], finalCS && (i == (dataSize - 1)));
+  }
+
+  return true;
+}
+
+uint8_t CBERGCloudSim::clock(uint8_t dataOut, bool finalCS)
+{
+  /* The byte returned is the one the shield had loaded before */
+  /* dataOut arrived, as it would be on the wire */
+  uint8_t dataIn = SPI_PROTOCOL_PAD;
+
+  m_stats.bytesClocked++;
+
+  switch (m_state)
+  {
+  case SIM_RESET:
+    dataIn = SPI_PROTOCOL_RESET;
+    m_stats.resets++;
+    m_state = SIM_IDLE;
+    break;
+
+  case SIM_IDLE:
+  case SIM_REQUEST:
+    receiveByte(dataOut);
+    break;
+
+  case SIM_PROCESSING:
+    m_stats.padBytesPolled++;
+
+    if (m_delayRemaining > 0)
+    {
+      m_delayRemaining--;
+    }
+
+    if ((m_delayRemaining == 0) && (now_uS() >= m_readyTime_uS))
+    {
+      /* Response starts on the next byte */
+      m_state = SIM_RESPONSE;
+    }
+    break;
+
+  case SIM_RESPONSE:
+    dataIn = m_response[m_responseSent++];
+
+    if (m_responseSent >= m_responseSize)
+    {
+      m_stats.framesSent++;
+      m_state = SIM_IDLE;
+    }
+    break;
+  }
+
+  if (finalCS && (m_state == SIM_REQUEST))
+  {
+    /* Request abandoned part way through */
+    m_state = SIM_IDLE;
+  }
+
+  return dataIn;
+}
+
+void CBERGCloudSim::receiveByte(uint8_t data)
+{
+  uint16_t size;
+
+  if (m_state == SIM_IDLE)
+  {
+    if (data == SPI_PROTOCOL_PAD)
+    {
+      /* Padding between frames */
+      return;
+    }
+
+    m_requestSize = 0;
+    m_requestExpected = SPI_PROTOCOL_HEADER_SIZE;
+    m_state = SIM_REQUEST;
+  }
+
+  m_request[m_requestSize++] = data;
+
+  if (m_requestSize == 2)
+  {
+    size = ((uint16_t)m_request[0] << 8) | m_request[1];
+
+    if ((size < SPI_PROTOCOL_HEADER_SIZE) || (size > MAX_DATA_SIZE))
+    {
+      /* Assumed, not confirmed with shield firmware. This is the only */
+      /* way the simulator resynchronises, see BERGCLOUD_SYNC_REQUEST. */
+      m_stats.protocolErrors++;
+      m_state = SIM_RESET;
+      return;
+    }
+
+    m_requestExpected = size;
+  }
+
+  if (m_requestSize == m_requestExpected)
+  {
+    processRequest();
+  }
+}
+
+void CBERGCloudSim::processRequest(void)
+{
+  uint16_t requestCRC;
+  uint16_t calcCRC;
+  uint16_t responseSize = 0;
+  uint8_t command;
+  uint8_t status;
+
+  requestCRC = ((uint16_t)m_request[2] << 8) | m_request[3];
+  m_request[2] = 0;
+  m_request[3] = 0;
+  calcCRC = crc16(m_request, m_requestSize, CRC16_INIT);
+
+  if (calcCRC != requestCRC)
+  {
+    m_stats.protocolErrors++;
+    m_state = SIM_RESET;
+    return;
+  }
+
+  m_stats.framesReceived++;
+  command = m_request[4];
+
+  if (m_forcedCount[command] > 0)
+  {
+    m_forcedCount[command]--;
+    status = m_forcedStatus[command];
+  }
+  else if (m_handler[command] != NULL)
+  {
+    status = m_handler[command](m_handlerContext[command], command,
+      &m_request[SPI_PROTOCOL_HEADER_SIZE], m_requestSize - SPI_PROTOCOL_HEADER_SIZE,
+      &m_response[SPI_PROTOCOL_HEADER_SIZE], &responseSize);
+  }
+  else
+  {
+    status = defaultHandler(command,
+      &m_request[SPI_PROTOCOL_HEADER_SIZE], m_requestSize - SPI_PROTOCOL_HEADER_SIZE,
+      &m_response[SPI_PROTOCOL_HEADER_SIZE], &responseSize);
+  }
+
+  if (responseSize > BC_SIM_MAX_FRAME_DATA)
+  {
+    responseSize = BC_SIM_MAX_FRAME_DATA;
+  }
+
+  buildResponse(status, responseSize);
+
+  m_delayRemaining = m_delayPadBytes;
+  m_readyTime_uS = (m_delay_uS > 0) ? now_uS() + m_delay_uS : 0;
+  m_state = ((m_delayRemaining == 0) && (m_delay_uS == 0)) ? SIM_RESPONSE : SIM_PROCESSING;
+}
+
+void CBERGCloudSim::buildResponse(uint8_t status, uint16_t dataSize)
+{
+  uint16_t frameSize = SPI_PROTOCOL_HEADER_SIZE + dataSize;
+  uint16_t calcCRC;
+
+  m_response[0] = frameSize >> 8;
+  m_response[1] = frameSize & 0xff;
+  m_response[2] = 0;
+  m_response[3] = 0;
+  m_response[4] = status;
+
+  calcCRC = crc16(m_response, frameSize, CRC16_INIT);
+  m_response[2] = calcCRC >> 8;
+  m_response[3] = calcCRC & 0xff;
+
+  m_responseSize = frameSize;
+  m_responseSent = 0;
+
+  if ((m_faultInterval > 0) && (++m_faultCount >= m_faultInterval))
+  {
+    /* Corrupt a different byte each time, including the size */
+    m_response[m_stats.faultsInjected % frameSize] ^= 0x5a;
+    m_stats.faultsInjected++;
+    m_faultCount = 0;
+  }
+}
+
+uint8_t CBERGCloudSim::defaultHandler(uint8_t command, const uint8_t *pRequest, uint16_t requestSize,
+  uint8_t *pResponse, uint16_t *pResponseSize)
+{
+  _BC_SIM_COMMAND *pCommand;
+
+  *pResponseSize = 0;
+
+  switch (command)
+  {
+  case SPI_CMD_GET_NETWORK_STATE:
+    pResponse[0] = m_networkState;
+    *pResponseSize = 1;
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_GET_CLAIM_STATE:
+    pResponse[0] = m_claimState;
+    *pResponseSize = 1;
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_GET_CLAIMCODE:
+    *pResponseSize = strlen(m_claimcode) + 1;
+    memcpy(pResponse, m_claimcode, *pResponseSize);
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_GET_SIGNAL_QUALITY:
+    pResponse[0] = (uint8_t)m_rssi;
+    pResponse[1] = m_lqi;
+    *pResponseSize = 2;
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_GET_EUI64:
+    if ((requestSize < 1) || (pRequest[0] > BC_EUI64_COORDINATOR))
+    {
+      return SPI_RSP_INVALID_COMMAND;
+    }
+
+    memcpy(pResponse, m_eui64[pRequest[0]], BC_SIM_EUI64_SIZE);
+    *pResponseSize = BC_SIM_EUI64_SIZE;
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_SEND_PRODUCT_ANNOUNCE:
+    if (requestSize != (16 + sizeof(uint32_t)))
+    {
+      return SPI_RSP_INVALID_COMMAND;
+    }
+
+    m_networkState = BC_NETWORK_STATE_CONNECTED;
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_POLL_FOR_COMMAND:
+    if (m_commandCount == 0)
+    {
+      return SPI_RSP_NO_DATA;
+    }
+
+    pCommand = &m_commands[m_commandHead];
+    pResponse[0] = pCommand->format;
+    pResponse[1] = pCommand->commandID;
+    memcpy(&pResponse[2], pCommand->data, pCommand->size);
+    *pResponseSize = pCommand->size + 2;
+
+    m_commandHead = (m_commandHead + 1) % BC_SIM_COMMAND_QUEUE;
+    m_commandCount--;
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_SEND_EVENT:
+    if (requestSize < 2)
+    {
+      return SPI_RSP_INVALID_COMMAND;
+    }
+
+    memcpy(m_lastEvent, pRequest, requestSize);
+    m_lastEventSize = requestSize;
+    m_stats.eventsReceived++;
+    return SPI_RSP_SUCCESS;
+
+  case SPI_CMD_DISPLAY_STYLE:
+  case SPI_CMD_DISPLAY_PRINT:
+  case SPI_CMD_SET_DISPLAY_STYLE:
+    return SPI_RSP_SUCCESS;
+
+  default:
+    return SPI_RSP_INVALID_COMMAND;
+  }
+}
+
+uint64_t CBERGCloudSim::now_uS(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/*
+    Shield state
+*/
+
+void CBERGCloudSim::reset(void)
+{
+  /* As after power up, the shield announces itself with a reset byte */
+  m_state = SIM_RESET;
+  m_requestSize = 0;
+  m_responseSize = 0;
+  m_responseSent = 0;
+}
+
+void CBERGCloudSim::setNetworkState(uint8_t state)
+{
+  m_networkState = state;
+}
+
+void CBERGCloudSim::setClaimState(uint8_t state)
+{
+  m_claimState = state;
+}
+
+void CBERGCloudSim::setClaimcode(const char *pClaimcode)
+{
+  strncpy(m_claimcode, pClaimcode, sizeof(m_claimcode) - 1);
+  m_claimcode[sizeof(m_claimcode) - 1] = '\0';
+}
+
+void CBERGCloudSim::setEUI64(uint8_t type, const uint8_t eui64[BC_SIM_EUI64_SIZE])
+{
+  if (type <= BC_EUI64_COORDINATOR)
+  {
+    memcpy(m_eui64[type], eui64, BC_SIM_EUI64_SIZE);
+  }
+}
+
+void CBERGCloudSim::setSignalQuality(int8_t rssi, uint8_t lqi)
+{
+  m_rssi = rssi;
+  m_lqi = lqi;
+}
+
+/*
+    Scripting
+*/
+
+void CBERGCloudSim::setResponseDelay(uint16_t padBytes, uint32_t delay_uS)
+{
+  /* Response is held back for at least padBytes of polling and delay_uS */
+  m_delayPadBytes = padBytes;
+  m_delay_uS = delay_uS;
+}
+
+void CBERGCloudSim::setHandler(uint8_t command, _BC_SIM_HANDLER handler, void *pContext)
+{
+  /* NULL restores the built-in behaviour */
+  m_handler[command] = handler;
+  m_handlerContext[command] = pContext;
+}
+
+void CBERGCloudSim::injectFaults(uint16_t interval)
+{
+  /* Corrupt one byte of every interval-th response frame, zero for none */
+  m_faultInterval = interval;
+  m_faultCount = 0;
+}
+
+void CBERGCloudSim::forceStatus(uint8_t command, uint8_t status, uint16_t count)
+{
+  /* Answer the next count requests for command with status and no data */
+  m_forcedStatus[command] = status;
+  m_forcedCount[command] = count;
+}
+
+bool CBERGCloudSim::queueCommand(uint8_t commandID, const uint8_t *pData, uint8_t dataSize, uint16_t format)
+{
+  _BC_SIM_COMMAND *pCommand;
+
+  if ((m_commandCount >= BC_SIM_COMMAND_QUEUE) || (dataSize > sizeof(pCommand->data)))
+  {
+    return false;
+  }
+
+  pCommand = &m_commands[(m_commandHead + m_commandCount) % BC_SIM_COMMAND_QUEUE];
+  pCommand->format = format >> 8;
+  pCommand->commandID = commandID;
+  pCommand->size = dataSize;
+  memcpy(pCommand->data, pData, dataSize);
+  m_commandCount++;
+  return true;
+}
+
+void CBERGCloudSim::clearCommands(void)
+{
+  m_commandHead = 0;
+  m_commandCount = 0;
+}
+
+/*
+    Results
+*/
+
+const uint8_t *CBERGCloudSim::getLastEvent(uint16_t *pSize)
+{
+  /* Event data as sent, including the two byte prefix */
+  *pSize = m_lastEventSize;
+  return m_lastEvent;
+}
+
+const _BC_SIM_STATS *CBERGCloudSim::getStats(void)
+{
+  return &m_stats;
+}
+
+void CBERGCloudSim::clearStats(void)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+#endif // #ifndef ARDUINO
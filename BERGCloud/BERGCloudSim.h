@@ -0,0 +1,138 @@
+/*
+
+BERGCloud Devboard shield simulator
+
+Copyright (c) 2013 BERG Ltd. http://bergcloud.com/
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#ifndef BERGCLOUDSIM_H
+#define BERGCLOUDSIM_H
+
+#include "BERGCloudLinux.h"
+
+#define BC_SIM_MAX_FRAME_DATA   (MAX_SERIAL_DATA)
+#define BC_SIM_COMMAND_QUEUE    (8)
+#define BC_SIM_CLAIMCODE_SIZE   (20)
+#define BC_SIM_EUI64_SIZE       (8)
+
+/* Override for a command; return the SPI_RSP_* status and set *pResponseSize */
+typedef uint8_t (*_BC_SIM_HANDLER)(void *pContext, uint8_t command,
+  const uint8_t *pRequest, uint16_t requestSize,
+  uint8_t *pResponse, uint16_t *pResponseSize);
+
+typedef struct {
+  uint32_t bytesClocked;    /* All bytes exchanged with the host */
+  uint32_t padBytesPolled;  /* Padding clocked while a response was pending */
+  uint32_t framesReceived;  /* Valid request frames */
+  uint32_t framesSent;      /* Response frames */
+  uint32_t protocolErrors;  /* Bad size or CRC in a request, forces a reset */
+  uint32_t resets;          /* SPI_PROTOCOL_RESET bytes sent */
+  uint32_t eventsReceived;  /* SPI_CMD_SEND_EVENT requests */
+  uint32_t faultsInjected;  /* Response frames corrupted, see injectFaults() */
+} _BC_SIM_STATS;
+
+typedef struct {
+  uint8_t format;
+  uint8_t commandID;
+  uint8_t size;
+  uint8_t data[BC_SIM_MAX_FRAME_DATA - 2];
+} _BC_SIM_COMMAND;
+
+class CBERGCloudSim : public CBERGCloudTransport
+{
+public:
+  CBERGCloudSim(void);
+  bool transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS);
+
+  /* Shield state */
+  void reset(void);
+  void setNetworkState(uint8_t state);
+  void setClaimState(uint8_t state);
+  void setClaimcode(const char *pClaimcode);
+  void setEUI64(uint8_t type, const uint8_t eui64[BC_SIM_EUI64_SIZE]);
+  void setSignalQuality(int8_t rssi, uint8_t lqi);
+
+  /* Scripting */
+  void setResponseDelay(uint16_t padBytes, uint32_t delay_uS);
+  void setHandler(uint8_t command, _BC_SIM_HANDLER handler, void *pContext);
+  void forceStatus(uint8_t command, uint8_t status, uint16_t count);
+  bool queueCommand(uint8_t commandID, const uint8_t *pData, uint8_t dataSize, uint16_t format = BC_COMMAND_START_BINARY);
+  void clearCommands(void);
+  void injectFaults(uint16_t interval);
+
+  /* Results */
+  const uint8_t *getLastEvent(uint16_t *pSize);
+  const _BC_SIM_STATS *getStats(void);
+  void clearStats(void);
+
+private:
+  uint8_t clock(uint8_t dataOut, bool finalCS);
+  void receiveByte(uint8_t data);
+  void processRequest(void);
+  void buildResponse(uint8_t status, uint16_t dataSize);
+  uint8_t defaultHandler(uint8_t command, const uint8_t *pRequest, uint16_t requestSize,
+    uint8_t *pResponse, uint16_t *pResponseSize);
+  uint64_t now_uS(void);
+
+  enum {
+    SIM_RESET,      /* Next byte out is SPI_PROTOCOL_RESET */
+    SIM_IDLE,       /* Waiting for the first byte of a request */
+    SIM_REQUEST,    /* Receiving a request frame */
+    SIM_PROCESSING, /* Response pending, clocking out padding */
+    SIM_RESPONSE    /* Clocking out a response frame */
+  } m_state;
+
+  uint8_t m_request[MAX_DATA_SIZE];
+  uint16_t m_requestSize;
+  uint16_t m_requestExpected;
+  uint8_t m_response[MAX_DATA_SIZE];
+  uint16_t m_responseSize;
+  uint16_t m_responseSent;
+  uint16_t m_delayPadBytes;
+  uint32_t m_delay_uS;
+  uint16_t m_delayRemaining;
+  uint64_t m_readyTime_uS;
+  uint16_t m_faultInterval;
+  uint16_t m_faultCount;
+
+  _BC_SIM_HANDLER m_handler[256];
+  void *m_handlerContext[256];
+  uint8_t m_forcedStatus[256];
+  uint16_t m_forcedCount[256];
+
+  _BC_SIM_COMMAND m_commands[BC_SIM_COMMAND_QUEUE];
+  uint8_t m_commandHead;
+  uint8_t m_commandCount;
+
+  uint8_t m_networkState;
+  uint8_t m_claimState;
+  char m_claimcode[BC_SIM_CLAIMCODE_SIZE];
+  uint8_t m_eui64[3][BC_SIM_EUI64_SIZE];
+  int8_t m_rssi;
+  uint8_t m_lqi;
+  uint8_t m_lastEvent[BC_SIM_MAX_FRAME_DATA];
+  uint16_t m_lastEventSize;
+
+  _BC_SIM_STATS m_stats;
+};
+
+#endif // #ifndef BERGCLOUDSIM_H
@@ -26,9 +26,7 @@ THE SOFTWARE.
 
 
 #include <stdint.h>
-
-
-#include <stdio.h> // TODO TEMP
+#include <string.h> /* For memcpy() */
 
 #include "Buffer.h"
 
@@ -72,7 +70,6 @@ bool CBuffer::removeFromBuffer(uint8_t *data)
   if (m_read < m_written)
   {
     *data = m_data[m_read++];
-    printf("0x%02x\n", *data);
     return true;
   }
 
@@ -80,6 +77,44 @@ bool CBuffer::removeFromBuffer(uint8_t *data)
   return false;
 }
 
+bool CBuffer::append(const uint8_t *pData, uint16_t size)
+{
+  /* Add size bytes to buffer, or nothing if they don't all fit */
+  if (size > getBufferFreeSpace())
+  {
+    return false;
+  }
+
+  memcpy(&m_data[m_written], pData, size);
+  m_written += size;
+  return true;
+}
+
+bool CBuffer::read(uint8_t *pData, uint16_t size)
+{
+  /* Remove size bytes from buffer, or nothing if there are fewer */
+  if (size > getBufferDataRemaining())
+  {
+    return false;
+  }
+
+  memcpy(pData, &m_data[m_read], size);
+  m_read += size;
+  return true;
+}
+
+bool CBuffer::skip(uint16_t size)
+{
+  /* Discard size bytes, or nothing if there are fewer */
+  if (size > getBufferDataRemaining())
+  {
+    return false;
+  }
+
+  m_read += size;
+  return true;
+}
+
 void CBuffer::clearBuffer(void)
 {
   /* Empty buffer */
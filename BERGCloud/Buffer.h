@@ -42,6 +42,9 @@ public:
   ~CBuffer(void);
   bool addToBuffer(uint8_t data);
   bool removeFromBuffer(uint8_t *data);
+  bool append(const uint8_t *pData, uint16_t size);
+  bool read(uint8_t *pData, uint16_t size);
+  bool skip(uint16_t size);
   uint16_t getBufferFreeSpace(void);
   uint16_t getBufferDataRemaining(void);
   void clearBuffer(void);
@@ -0,0 +1,46 @@
+/*
+
+CRC16 implementations
+
+Copyright (c) 2013 BERG Ltd. http://bergcloud.com/
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+
+#include "BERGCloudConfig.h"
+
+/* Initial value for a frame CRC */
+#define CRC16_INIT (0xffff)
+
+/* Single byte update, all variants return the same result */
+uint16_t crc16Bitwise(uint8_t data, uint16_t crc);
+uint16_t crc16Nibble(uint8_t data, uint16_t crc);
+uint16_t crc16Table(uint8_t data, uint16_t crc);
+
+/* Block update using the variant selected in BERGCloudConfig.h */
+uint16_t crc16(const uint8_t *pData, uint16_t size, uint16_t crc);
+
+#endif // #ifndef CRC16_H
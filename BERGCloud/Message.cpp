@@ -30,8 +30,7 @@ THE SOFTWARE.
 #define __STDC_LIMIT_MACROS /* Include C99 stdint defines in C++ code */
 #include <stdint.h>
 #include <stddef.h>
-#include <stdio.h>
-#include <string.h> /* For memcpy() */
+#include <string.h> /* For memcmp(), memcpy(), memmove(), strlen() */
 
 #include "Message.h"
 
@@ -40,6 +39,13 @@ THE SOFTWARE.
 CMessage::CMessage(void)
 {
   clearCachedType();
+  m_containerDepth = 0;
+
+#ifdef BERGCLOUD_PACK_COMPACT
+  m_packCompact = true;
+#else
+  m_packCompact = false;
+#endif
 }
 
 CMessage::~CMessage(void)
@@ -80,102 +86,341 @@ CMessage::~CMessage(void)
     Pack methods
 */
 
-bool CMessage::pack(uint8_t n)
+bool CMessage::packType(uint8_t type, uint32_t value, uint8_t valueBytes)
 {
-  _LOG_PACK("pack uint8_t\n");
+  /* Add a type followed by valueBytes of value, MSByte first */
+  uint8_t data[1 + sizeof(uint32_t)];
+  uint8_t i;
+
+  data[0] = type;
 
-  if (getBufferFreeSpace() < (sizeof(n) + 1))
+  for (i = valueBytes; i > 0; i--)
+  {
+    data[i] = (uint8_t)value;
+    value >>= 8;
+  }
+
+  if (!append(data, 1 + valueBytes))
   {
-    /* Not enough space remaining in the buffer */
     return false;
   }
 
-  addToBuffer(_MP_UINT8);
-  addToBuffer(n);
+  packCount();
   return true;
 }
 
-bool CMessage::pack(uint16_t n)
+void CMessage::packCount(void)
 {
-  _LOG_PACK("pack uint16_t\n");
+  /* Called once for each item packed. Items inside an array or map */
+  /* given a count by packArray()/packMap() are owed to it, any others */
+  /* belong to the innermost container opened by Begin(). */
+  uint8_t i;
 
-  if (getBufferFreeSpace() < (sizeof(n) + 1))
+  if (m_containerDepth == 0)
+  {
+    return;
+  }
+
+  i = m_containerDepth - 1;
+
+  if (m_containerOwed[i] > 0)
+  {
+    m_containerOwed[i]--;
+  }
+  else
+  {
+    m_containerCount[i]++;
+  }
+}
+
+bool CMessage::packUnsigned(uint32_t n)
+{
+  /* Shortest unsigned form */
+  if (n <= _MP_FIXNUM_POS_MAX)
+  {
+    return packType((uint8_t)n, 0, 0);
+  }
+
+  if (n <= UINT8_MAX)
+  {
+    return packType(_MP_UINT8, n, sizeof(uint8_t));
+  }
+
+  if (n <= UINT16_MAX)
+  {
+    return packType(_MP_UINT16, n, sizeof(uint16_t));
+  }
+
+  return packType(_MP_UINT32, n, sizeof(uint32_t));
+}
+
+bool CMessage::packSigned(int32_t n)
+{
+  /* Shortest signed form; negative fixnums are -32 to -1 */
+  if ((n >= -32) && (n <= _MP_FIXNUM_POS_MAX))
+  {
+    return packType((uint8_t)n, 0, 0);
+  }
+
+  if ((n >= INT8_MIN) && (n <= INT8_MAX))
+  {
+    return packType(_MP_INT8, (uint8_t)n, sizeof(int8_t));
+  }
+
+  if ((n >= INT16_MIN) && (n <= INT16_MAX))
+  {
+    return packType(_MP_INT16, (uint16_t)n, sizeof(int16_t));
+  }
+
+  return packType(_MP_INT32, n, sizeof(int32_t));
+}
+
+bool CMessage::packRaw(uint8_t *pData, uint32_t sizeInBytes)
+{
+  /* RAW16, or FixRaw in compact mode if it is short enough */
+  bool fixRaw = m_packCompact && (sizeInBytes <= (_MP_FIXRAW_MAX - _MP_FIXRAW_MIN));
+  uint8_t headerSize = fixRaw ? 1 : (1 + sizeof(uint16_t));
+
+  if (sizeInBytes > UINT16_MAX)
+  {
+    /* Too big to encode as RAW16 */
+    return false;
+  }
+
+  if (getBufferFreeSpace() < (sizeInBytes + headerSize))
   {
     /* Not enough space remaining in the buffer */
     return false;
   }
 
-  addToBuffer(_MP_UINT16);
-  addToBuffer((uint8_t)(n >> 8));
-  addToBuffer((uint8_t)n);
+  if (fixRaw)
+  {
+    packType(_MP_FIXRAW_MIN + sizeInBytes, 0, 0);
+  }
+  else
+  {
+    packType(_MP_RAW16, sizeInBytes, sizeof(uint16_t));
+  }
+
+  return append(pData, (uint16_t)sizeInBytes);
+}
+
+void CMessage::setPackCompact(bool compact)
+{
+  m_packCompact = compact;
+}
+
+bool CMessage::packContainer(uint8_t fixType, uint8_t type16, uint16_t count)
+{
+  /* FixArray/FixMap if the count is small enough, otherwise 16-bit */
+  bool packed;
+
+  if (count <= 0x0f)
+  {
+    packed = packType(fixType + count, 0, 0);
+  }
+  else
+  {
+    packed = packType(type16, count, sizeof(uint16_t));
+  }
+
+  if (packed && (m_containerDepth > 0))
+  {
+    /* Its items, keys and values for a map, are owed to it */
+    m_containerOwed[m_containerDepth - 1] += (fixType == _MP_FIXMAP_MIN) ? (2 * (uint32_t)count) : count;
+  }
+
+  return packed;
+}
+
+bool CMessage::packArray(uint16_t count)
+{
+  _LOG_PACK("pack array\n");
+  return packContainer(_MP_FIXARRAY_MIN, _MP_ARRAY16, count);
+}
+
+bool CMessage::packMap(uint16_t count)
+{
+  /* count is the number of key/value pairs that follow */
+  _LOG_PACK("pack map\n");
+  return packContainer(_MP_FIXMAP_MIN, _MP_MAP16, count);
+}
+
+bool CMessage::packBegin(uint8_t fixType)
+{
+  /* Reserve a one byte header, widened by packEnd() if necessary */
+  if (m_containerDepth >= PACK_CONTAINER_DEPTH)
+  {
+    /* Nested too deeply */
+    return false;
+  }
+
+  if (!addToBuffer(fixType))
+  {
+    /* Buffer is full */
+    return false;
+  }
+
+  /* An item of any enclosing container */
+  packCount();
+
+  m_containerStart[m_containerDepth] = m_written - 1;
+  m_containerCount[m_containerDepth] = 0;
+  m_containerOwed[m_containerDepth] = 0;
+  m_containerDepth++;
   return true;
 }
 
-bool CMessage::pack(uint32_t n)
+bool CMessage::packEnd(uint8_t fixType, uint8_t type16)
 {
-  _LOG_PACK("pack uint32_t\n");
+  uint16_t start;
+  uint16_t count;
+  uint8_t i;
 
-  if (getBufferFreeSpace() < (sizeof(n) + 1))
+  if ((m_containerDepth == 0) || (m_data[m_containerStart[m_containerDepth - 1]] != fixType))
+  {
+    /* No container of this kind to end */
+    return false;
+  }
+
+  i = m_containerDepth - 1;
+  start = m_containerStart[i];
+  count = m_containerCount[i];
+
+  if (m_containerOwed[i] > 0)
+  {
+    /* An array or map inside it is missing items */
+    return false;
+  }
+
+  if (fixType == _MP_FIXMAP_MIN)
+  {
+    /* Keys and values */
+    if ((count & 1) != 0)
+    {
+      return false;
+    }
+
+    count /= 2;
+  }
+
+  if (count <= 0x0f)
+  {
+    m_data[start] = fixType + count;
+    m_containerDepth--;
+    return true;
+  }
+
+  /* Widen the header to 16 bits, moving the items up to make room */
+  if (getBufferFreeSpace() < sizeof(uint16_t))
   {
     /* Not enough space remaining in the buffer */
     return false;
   }
 
-  addToBuffer(_MP_UINT32);
-  addToBuffer((uint8_t)(n >> 24));
-  addToBuffer((uint8_t)(n >> 16));
-  addToBuffer((uint8_t)(n >> 8));
-  addToBuffer((uint8_t)n);
+  memmove(&m_data[start + 1 + sizeof(uint16_t)], &m_data[start + 1], m_written - (start + 1));
+  m_written += sizeof(uint16_t);
+  m_data[start] = type16;
+  m_data[start + 1] = (uint8_t)(count >> 8);
+  m_data[start + 2] = (uint8_t)count;
+  m_containerDepth--;
   return true;
 }
 
+bool CMessage::packArrayBegin(void)
+{
+  _LOG_PACK("pack array begin\n");
+  return packBegin(_MP_FIXARRAY_MIN);
+}
+
+bool CMessage::packArrayEnd(void)
+{
+  _LOG_PACK("pack array end\n");
+  return packEnd(_MP_FIXARRAY_MIN, _MP_ARRAY16);
+}
+
+bool CMessage::packMapBegin(void)
+{
+  _LOG_PACK("pack map begin\n");
+  return packBegin(_MP_FIXMAP_MIN);
+}
+
+bool CMessage::packMapEnd(void)
+{
+  _LOG_PACK("pack map end\n");
+  return packEnd(_MP_FIXMAP_MIN, _MP_MAP16);
+}
+
+bool CMessage::pack(uint8_t n)
+{
+  _LOG_PACK("pack uint8_t\n");
+
+  if (m_packCompact)
+  {
+    return packUnsigned(n);
+  }
+
+  return packType(_MP_UINT8, n, sizeof(n));
+}
+
+bool CMessage::pack(uint16_t n)
+{
+  _LOG_PACK("pack uint16_t\n");
+
+  if (m_packCompact)
+  {
+    return packUnsigned(n);
+  }
+
+  return packType(_MP_UINT16, n, sizeof(n));
+}
+
+bool CMessage::pack(uint32_t n)
+{
+  _LOG_PACK("pack uint32_t\n");
+
+  if (m_packCompact)
+  {
+    return packUnsigned(n);
+  }
+
+  return packType(_MP_UINT32, n, sizeof(n));
+}
+
 bool CMessage::pack(int8_t n)
 {
   _LOG_PACK("pack int8_t\n");
 
-  if (getBufferFreeSpace() < (sizeof(n) + 1))
+  if (m_packCompact)
   {
-    /* Not enough space remaining in the buffer */
-    return false;
+    return packSigned(n);
   }
 
-  addToBuffer(_MP_INT8);
-  addToBuffer((uint8_t)n);
-  return true;
+  return packType(_MP_INT8, (uint8_t)n, sizeof(n));
 }
 
 bool CMessage::pack(int16_t n)
 {
   _LOG_PACK("pack int16_t\n");
 
-  if (getBufferFreeSpace() < (sizeof(n) + 1))
+  if (m_packCompact)
   {
-    /* Not enough space remaining in the buffer */
-    return false;
+    return packSigned(n);
   }
 
-  addToBuffer(_MP_INT16);
-  addToBuffer((uint8_t)(n >> 8));
-  addToBuffer((uint8_t)n);
-  return true;
+  return packType(_MP_INT16, (uint16_t)n, sizeof(n));
 }
 
 bool CMessage::pack(int32_t n)
 {
   _LOG_PACK("pack int32_t\n");
 
-  if (getBufferFreeSpace() < (sizeof(n) + 1))
+  if (m_packCompact)
   {
-    /* Not enough space remaining in the buffer */
-    return false;
+    return packSigned(n);
   }
 
-  addToBuffer(_MP_INT32);
-  addToBuffer((uint8_t)(n >> 24));
-  addToBuffer((uint8_t)(n >> 16));
-  addToBuffer((uint8_t)(n >> 8));
-  addToBuffer((uint8_t)n);
-  return true;
+  return packType(_MP_INT32, n, sizeof(n));
 }
 
 bool CMessage::pack(float n)
@@ -184,21 +429,10 @@ bool CMessage::pack(float n)
 
   _LOG_PACK("pack float\n");
 
-  if (getBufferFreeSpace() < (sizeof(data) + 1))
-  {
-    /* Not enough space remaining in the buffer */
-    return false;
-  }
-
   /* Convert to binary data */
   memcpy(&data, &n, sizeof(float));
 
-  addToBuffer(_MP_FLOAT);
-  addToBuffer((uint8_t)(data >> 24));
-  addToBuffer((uint8_t)(data >> 16));
-  addToBuffer((uint8_t)(data >> 8));
-  addToBuffer((uint8_t)data);
-  return true;
+  return packType(_MP_FLOAT, data, sizeof(data));
 }
 
 bool CMessage::pack(bool n)
@@ -219,6 +453,7 @@ bool CMessage::pack(bool n)
   }
 
   addToBuffer(n ? _MP_BOOL_TRUE : _MP_BOOL_FALSE);
+  packCount();
   return true;
 }
 
@@ -235,50 +470,13 @@ bool CMessage::pack(char *pString)
     strLen++;
   }
 
-  if (getBufferFreeSpace() < (strLen + 1 + sizeof(uint16_t)))
-  {
-    /* Not enough space remaining in the buffer */
-    return false;
-  }
-
-  addToBuffer(_MP_RAW16);
-  addToBuffer((uint8_t)(strLen >> 8));
-  addToBuffer((uint8_t)strLen);
-
-  while (strLen-- > 0)
-  {
-    addToBuffer((uint8_t)*pString++);
-  }
-
-  return true;
+  return packRaw((uint8_t *)pString, strLen);
 }
 
 bool CMessage::pack(uint8_t *pData, uint32_t sizeInBytes)
 {
   _LOG_PACK("pack data\n");
-
-  if (sizeInBytes > UINT16_MAX)
-  {
-    /* Too big to encode as RAW16 */
-    return false;
-  }
-
-  if (getBufferFreeSpace() < (sizeInBytes + 1 + sizeof(uint16_t)))
-  {
-    /* Not enough space remaining in the buffer */
-    return false;
-  }
-
-  addToBuffer(_MP_RAW16);
-  addToBuffer((uint8_t)(sizeInBytes >> 8));
-  addToBuffer((uint8_t)sizeInBytes);
-
-  while (sizeInBytes-- > 0)
-  {
-    addToBuffer((uint8_t)*pData++);
-  }
-
-  return true;
+  return packRaw(pData, sizeInBytes);
 }
 
 #ifdef ARDUINO
@@ -320,11 +518,53 @@ bool CMessage::getNextType(uint8_t *pMessagePackType)
   return true;
 }
 
+bool CMessage::getBigEndian(uint32_t *pValue, uint8_t valueBytes)
+{
+  /* Read valueBytes, MSByte first */
+  uint8_t data[sizeof(uint32_t)];
+  uint8_t i;
+
+  if (!read(data, valueBytes))
+  {
+    /* Not enough data remaining in the buffer */
+    return false;
+  }
+
+  *pValue = 0;
+
+  for (i = 0; i < valueBytes; i++)
+  {
+    *pValue = (*pValue << 8) | data[i];
+  }
+
+  return true;
+}
+
+uint16_t CMessage::getPosition(void)
+{
+  /* Offset of the next item, including a type read ahead by getNextType() */
+  return m_read - (m_cached ? 1 : 0);
+}
+
+void CMessage::setPosition(uint16_t position)
+{
+  m_read = position;
+  clearCachedType();
+}
+
 void CMessage::clearCachedType(void)
 {
   m_cached = false;
 }
 
+void CMessage::clearBuffer(void)
+{
+  /* Empty buffer, including any type read ahead by getNextType() */
+  CBuffer::clearBuffer();
+  clearCachedType();
+  m_containerDepth = 0;
+}
+
 bool CMessage::getUnsignedInteger(uint32_t *pValue, uint8_t maxBytes)
 {
   uint8_t type;
@@ -364,42 +604,14 @@ bool CMessage::getUnsignedInteger(uint32_t *pValue, uint8_t maxBytes)
 
   if ((type == _MP_UINT16) && (maxBytes >= sizeof(uint16_t)))
   {
-    if (getBufferDataRemaining() < sizeof(uint16_t))
-    {
-      /* Not enough data remaining in the buffer */
-      return false;
-    }
-
     /* Get 16-bit unsigned integer */
-    removeFromBuffer(&temp);
-    *pValue = temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
-    return true;
+    return getBigEndian(pValue, sizeof(uint16_t));
   }
 
   if ((type == _MP_UINT32) && (maxBytes >= sizeof(uint32_t)))
   {
-    if (getBufferDataRemaining() < sizeof(uint32_t))
-    {
-      /* Not enough data remaining in the buffer */
-      return false;
-    }
-
     /* Get 32-bit unsigned integer */
-    removeFromBuffer(&temp);
-    *pValue = temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
-    return true;
+    return getBigEndian(pValue, sizeof(uint32_t));
   }
 
   /* Can't convert this type */
@@ -408,6 +620,7 @@ bool CMessage::getUnsignedInteger(uint32_t *pValue, uint8_t maxBytes)
 
 bool CMessage::getSignedInteger(int32_t *pValue, uint8_t maxBytes)
 {
+  uint32_t data;
   uint8_t type;
   uint8_t temp;
 
@@ -431,8 +644,8 @@ bool CMessage::getSignedInteger(int32_t *pValue, uint8_t maxBytes)
 
   if (IN_RANGE(type, _MP_FIXNUM_NEG_MIN, _MP_FIXNUM_NEG_MAX))
   {
-    /* FixedNum value */
-    *pValue = (int32_t)type;
+    /* FixedNum value, -32 to -1 */
+    *pValue = (int8_t)type;
     return true;
   }
 
@@ -446,47 +659,31 @@ bool CMessage::getSignedInteger(int32_t *pValue, uint8_t maxBytes)
 
     /* Get 8-bit signed integer */
     removeFromBuffer(&temp);
-    *pValue = temp;
+    *pValue = (int8_t)temp;
     return true;
   }
 
   if ((type == _MP_INT16) && (maxBytes >= sizeof(int16_t)))
   {
-    if (getBufferDataRemaining() < sizeof(int16_t))
+    /* Get 16-bit signed integer */
+    if (!getBigEndian(&data, sizeof(int16_t)))
     {
-      /* Not enough data remaining in the buffer */
       return false;
     }
 
-    /* Get 16-bit signed integer */
-    removeFromBuffer(&temp);
-    *pValue = temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
+    *pValue = (int16_t)data;
     return true;
   }
 
   if ((type == _MP_INT32) && (maxBytes >= sizeof(int32_t)))
   {
-    if (getBufferDataRemaining() < sizeof(int32_t))
+    /* Get 32-bit signed integer */
+    if (!getBigEndian(&data, sizeof(int32_t)))
     {
-      /* Not enough data remaining in the buffer */
       return false;
     }
 
-    /* Get 32-bit signed integer */
-    removeFromBuffer(&temp);
-    *pValue = temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
-    *pValue = *pValue << 8;
-    removeFromBuffer(&temp);
-    *pValue |= temp;
+    *pValue = (int32_t)data;
     return true;
   }
 
@@ -496,7 +693,195 @@ bool CMessage::getSignedInteger(int32_t *pValue, uint8_t maxBytes)
 
 bool CMessage::unpack(void)
 {
+  /* Skip the next item, including everything in it if it is an array */
+  /* or map. Nothing is skipped if the item is incomplete. */
+  uint16_t position = getPosition();
+  uint32_t items = 1; /* Items left to skip */
+  uint32_t count;     /* Items in an array or map */
+  uint32_t size;      /* Bytes after the type and any size */
+  uint8_t type;
+  bool ok;
+
   _LOG_PACK("unpack skip\n");
+
+  while (items > 0)
+  {
+    ok = getNextType(&type);
+    clearCachedType();
+    items--;
+    count = 0;
+    size = 0;
+
+    if (!ok)
+    {
+      /* Not enough data remaining in the buffer */
+    }
+    else if (IN_RANGE(type, _MP_FIXMAP_MIN, _MP_FIXMAP_MAX))
+    {
+      count = (uint32_t)(type - _MP_FIXMAP_MIN) * 2;
+    }
+    else if (IN_RANGE(type, _MP_FIXARRAY_MIN, _MP_FIXARRAY_MAX))
+    {
+      count = type - _MP_FIXARRAY_MIN;
+    }
+    else if (IN_RANGE(type, _MP_FIXRAW_MIN, _MP_FIXRAW_MAX))
+    {
+      size = type - _MP_FIXRAW_MIN;
+    }
+    else if ( IN_RANGE(type, _MP_FIXNUM_POS_MIN, _MP_FIXNUM_POS_MAX) ||
+              IN_RANGE(type, _MP_FIXNUM_NEG_MIN, _MP_FIXNUM_NEG_MAX) )
+    {
+      /* Value is in the type */
+    }
+    else
+    {
+      switch (type)
+      {
+      case _MP_NIL:
+      case _MP_BOOL_FALSE:
+      case _MP_BOOL_TRUE:
+        break;
+
+      case _MP_UINT8:
+      case _MP_INT8:
+        size = sizeof(uint8_t);
+        break;
+
+      case _MP_UINT16:
+      case _MP_INT16:
+        size = sizeof(uint16_t);
+        break;
+
+      case _MP_FLOAT:
+      case _MP_UINT32:
+      case _MP_INT32:
+        size = sizeof(uint32_t);
+        break;
+
+      case _MP_DOUBLE:
+      case _MP_UNIT64:
+      case _MP_INT64:
+        size = 2 * sizeof(uint32_t);
+        break;
+
+      case _MP_RAW16:
+        ok = getBigEndian(&size, sizeof(uint16_t));
+        break;
+
+      case _MP_RAW32:
+        ok = getBigEndian(&size, sizeof(uint32_t));
+        break;
+
+      case _MP_ARRAY16:
+      case _MP_MAP16:
+        ok = getBigEndian(&count, sizeof(uint16_t));
+        break;
+
+      case _MP_ARRAY32:
+      case _MP_MAP32:
+        ok = getBigEndian(&count, sizeof(uint32_t));
+        break;
+
+      default:
+        /* Reserved */
+        ok = false;
+        break;
+      }
+
+      if ((type == _MP_MAP16) || (type == _MP_MAP32))
+      {
+        /* A key and a value for each; each item is at least one byte */
+        count = (count > getBufferDataRemaining()) ? UINT32_MAX : (count * 2);
+      }
+    }
+
+    /* Each remaining item takes at least one byte */
+    if (  !ok ||
+          (size > getBufferDataRemaining()) ||
+          (count > (getBufferDataRemaining() - size)) ||
+          (items > (getBufferDataRemaining() - size - count)) )
+    {
+      setPosition(position);
+      return false;
+    }
+
+    skip((uint16_t)size);
+    items += count;
+  }
+
+  return true;
+}
+
+bool CMessage::seek(uint16_t index)
+{
+  /* Go to top level item index, counting from the start of the */
+  /* buffer. The position is unchanged if there are fewer items. */
+  uint16_t position = getPosition();
+
+  m_read = 0;
+  clearCachedType();
+
+  while (index-- > 0)
+  {
+    if (!unpack())
+    {
+      setPosition(position);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool CMessage::findKey(const char *pKey)
+{
+  /* The next item must be a map; go to the value for the first key */
+  /* that is a string matching pKey. The position is unchanged if it */
+  /* isn't found. */
+  uint16_t position = getPosition();
+  uint32_t keyLen = strlen(pKey);
+  uint32_t entries;
+  uint32_t size;
+
+  if (getContainerSize(&entries, _MP_FIXMAP_MIN, _MP_FIXMAP_MAX, _MP_MAP16, _MP_MAP32))
+  {
+    clearCachedType();
+
+    while (entries-- > 0)
+    {
+      if (getContainerSize(&size, _MP_FIXRAW_MIN, _MP_FIXRAW_MAX, _MP_RAW16, _MP_RAW32))
+      {
+        /* Compare in place */
+        clearCachedType();
+
+        if (size > getBufferDataRemaining())
+        {
+          break;
+        }
+
+        if ((size == keyLen) && (memcmp(&m_data[m_read], pKey, keyLen) == 0))
+        {
+          skip((uint16_t)size);
+          return true;
+        }
+
+        skip((uint16_t)size);
+      }
+      else if (!unpack())
+      {
+        /* Key isn't a string, or is incomplete */
+        break;
+      }
+
+      if (!unpack())
+      {
+        /* Value is incomplete */
+        break;
+      }
+    }
+  }
+
+  setPosition(position);
   return false;
 }
 
@@ -593,7 +978,6 @@ bool CMessage::unpack(int32_t& n)
 bool CMessage::unpack(float& n)
 {
   uint32_t data;
-  uint8_t temp;
   uint8_t type;
 
   _LOG_PACK("unpack float\n");
@@ -606,24 +990,12 @@ bool CMessage::unpack(float& n)
 
   if (type == _MP_FLOAT)
   {
-    if (getBufferDataRemaining() < sizeof(float))
+    if (!getBigEndian(&data, sizeof(float)))
     {
       /* Not enough data remaining in the buffer */
       return false;
     }
 
-    removeFromBuffer(&temp);
-    data = temp;
-    data = data << 8;
-    removeFromBuffer(&temp);
-    data |= temp;
-    data = data << 8;
-    removeFromBuffer(&temp);
-    data |= temp;
-    data = data << 8;
-    removeFromBuffer(&temp);
-    data |= temp;
-
     /* Convert to float */
     memcpy(&n, &data, sizeof(float));
 
@@ -664,7 +1036,6 @@ bool CMessage::getContainerSize(uint32_t *size, /* Returned size */
 {
   /* Get the size of a RAW, ARRAY or MAP type */
   uint8_t type;
-  uint8_t temp;
 
   if (!getNextType(&type))
   {
@@ -681,50 +1052,49 @@ bool CMessage::getContainerSize(uint32_t *size, /* Returned size */
 
   if (type == mp_16)
   {
-    if (getBufferDataRemaining() < sizeof(uint16_t))
-    {
-      /* Not enough data remaining in the buffer */
-      return false;
-    }
-
     /* Get 16-bit unsigned integer */
-    removeFromBuffer(&temp);
-    *size = temp;
-    *size = *size << 8;
-    removeFromBuffer(&temp);
-    *size |= temp;
-    return true;
+    return getBigEndian(size, sizeof(uint16_t));
   }
 
   if (type == mp_32)
   {
-    if (getBufferDataRemaining() < sizeof(uint32_t))
-    {
-      /* Not enough data remaining in the buffer */
-      return false;
-    }
-
     /* Get 32-bit unsigned integer */
-    removeFromBuffer(&temp);
-    *size = temp;
-    *size = *size << 8;
-    removeFromBuffer(&temp);
-    *size |= temp;
-    *size = *size << 8;
-    removeFromBuffer(&temp);
-    *size |= temp;
-    *size = *size << 8;
-    removeFromBuffer(&temp);
-    *size |= temp;
+    return getBigEndian(size, sizeof(uint32_t));
   }
 
   return false;
 }
 
-bool CMessage::unpack(char *pString, uint32_t maxSizeInBytes)
+bool CMessage::getRaw(const uint8_t **ppData, uint16_t *pSize)
 {
+  /* Find the data of a RAW item in the buffer and move past it */
+  uint16_t position = getPosition();
   uint32_t size;
-  uint8_t temp;
+
+  if (!getContainerSize(&size, _MP_FIXRAW_MIN, _MP_FIXRAW_MAX, _MP_RAW16, _MP_RAW32))
+  {
+    return false;
+  }
+
+  if (size > getBufferDataRemaining())
+  {
+    /* Not enough data remaining in the buffer */
+    setPosition(position);
+    return false;
+  }
+
+  *ppData = &m_data[m_read];
+  *pSize = (uint16_t)size;
+  skip((uint16_t)size);
+
+  clearCachedType();
+  return true;
+}
+
+bool CMessage::unpack(char *pString, uint32_t maxSizeInBytes)
+{
+  const uint8_t *pData;
+  uint16_t size;
 
   _LOG_PACK("unpack string\n");
 
@@ -734,66 +1104,60 @@ bool CMessage::unpack(char *pString, uint32_t maxSizeInBytes)
     return false;
   }
 
-  if (!getContainerSize(&size, _MP_FIXRAW_MIN, _MP_FIXRAW_MAX, _MP_RAW16, _MP_RAW32))
+  if (!getRaw(&pData, &size))
   {
     return false;
   }
 
-  /* Must read all of the data but only copy up to maxSizeInBytes-1 */
-  while (size-- > 0)
+  /* Copy up to maxSizeInBytes-1, reserving one byte for the terminator */
+  if (size > (maxSizeInBytes - 1))
   {
-    if (!removeFromBuffer(&temp))
-    {
-      /* Not enough data remaining in the buffer */
-      return false;
-    }
-
-    if (maxSizeInBytes > 1) /* Reserve one byte for null terminator */
-    {
-      maxSizeInBytes--;
-      *pString++ = temp;
-    }
+    size = maxSizeInBytes - 1;
   }
 
-  /* Add terminator */
-  *pString = '\0';
-
-  clearCachedType();
+  memcpy(pString, pData, size);
+  pString[size] = '\0';
   return true;
 }
 
 bool CMessage::unpack(uint8_t *pData, uint32_t maxSizeInBytes)
 {
-  uint32_t size;
-  uint8_t temp;
+  const uint8_t *pRaw;
+  uint16_t size;
 
   _LOG_PACK("unpack data\n");
 
-  if (!getContainerSize(&size, _MP_FIXRAW_MIN, _MP_FIXRAW_MAX, _MP_RAW16, _MP_RAW32))
+  if (!getRaw(&pRaw, &size))
   {
     return false;
   }
 
-  /* Must read all of the data but only copy up to maxSizeInBytes */
-  while (size-- > 0)
-  {
-    if (!removeFromBuffer(&temp))
-    {
-      /* Not enough data remaining in the buffer */
-      return false;
-    }
+  /* Copy up to maxSizeInBytes */
+  memcpy(pData, pRaw, (size < maxSizeInBytes) ? size : maxSizeInBytes);
+  return true;
+}
 
-    if (maxSizeInBytes > 0)
-    {
-      maxSizeInBytes--;
-      *pData++ = temp;
-    }
+bool CMessage::unpackView(const char *&pString, uint16_t& length)
+{
+  const uint8_t *pData;
+
+  _LOG_PACK("unpack string view\n");
+
+  if (!getRaw(&pData, &length))
+  {
+    return false;
   }
 
-  clearCachedType();
+  pString = (const char *)pData;
   return true;
 }
 
+bool CMessage::unpackView(const uint8_t *&pData, uint16_t& size)
+{
+  _LOG_PACK("unpack data view\n");
+  return getRaw(&pData, &size);
+}
+
 #ifdef ARDUINO
 //bool CMessage::unpack(string& s)
 //{
@@ -31,11 +31,13 @@ THE SOFTWARE.
 #define MESSAGE_H
 
 #include "Buffer.h"
-//#include "BERGCloudConfig.h"
+#include "BERGCloudConfig.h"
 
-#define _LOG_PACK(...) printf(__VA_ARGS__);
-
-#ifndef _LOG_PACK
+/* Trace of packing and unpacking, host builds only */
+#if defined(BERGCLOUD_LOG) && (BERGCLOUD_LOG_LEVEL >= 3) && !defined(ARDUINO)
+#include <stdio.h>
+#define _LOG_PACK(...) fprintf(stderr, __VA_ARGS__);
+#else
 #define _LOG_PACK(...)
 #endif
 
@@ -70,11 +72,22 @@ THE SOFTWARE.
 #define _MP_FIXNUM_NEG_MIN  0xe0
 #define _MP_FIXNUM_NEG_MAX  0xff
 
+/* Arrays and maps that can be open at once, see packArrayBegin() */
+#ifndef PACK_CONTAINER_DEPTH
+#define PACK_CONTAINER_DEPTH 4
+#endif
+
 class CMessage : public CBuffer
 {
 public:
   CMessage(void);
   ~CMessage(void);
+  void clearBuffer(void);
+
+  /* Pack each integer and string in the shortest form that holds it */
+  /* instead of one set by its C type. Signed values are still packed */
+  /* as signed types, so either form unpacks to the same C types. */
+  void setPackCompact(bool compact);
 
   /* Pack methods */
   bool pack(uint8_t n);
@@ -87,6 +100,16 @@ public:
   bool pack(bool n);
   bool pack(char *pString);
   bool pack(uint8_t *pData, uint32_t sizeInBytes);
+
+  /* Arrays and maps. Either give the number of items (key/value pairs */
+  /* for a map) up front, or pack them between Begin() and End(), which */
+  /* counts them and fills in the header. Containers may be nested. */
+  bool packArray(uint16_t count);
+  bool packMap(uint16_t count);
+  bool packArrayBegin(void);
+  bool packArrayEnd(void);
+  bool packMapBegin(void);
+  bool packMapEnd(void);
   #ifdef ARDUINO
   //bool pack(string s);
   #else
@@ -106,6 +129,16 @@ public:
   bool unpack(bool& n);
   bool unpack(char *pString, uint32_t maxSizeInBytes);
   bool unpack(uint8_t *pData, uint32_t maxSizeInBytes);
+
+  /* Point to string or raw data in the buffer instead of copying it. */
+  /* The string isn't terminated. Valid until the buffer is changed. */
+  bool unpackView(const char *&pString, uint16_t& length);
+  bool unpackView(const uint8_t *&pData, uint16_t& size);
+
+  /* Navigation, see unpack(void) to skip an item */
+  bool seek(uint16_t index);
+  bool findKey(const char *pKey);
+
   #ifdef ARDUINO
 //  bool unpack(string& s);
   #else
@@ -113,12 +146,32 @@ public:
   #endif
 
 private:
+  /* Packs schema fields without the free space checks, MessageSchema.h */
+  friend class CMessageSchemaWriter;
+
   void clearCachedType(void);
+  uint16_t getPosition(void);
+  void setPosition(uint16_t position);
+  bool getRaw(const uint8_t **ppData, uint16_t *pSize);
+  bool packType(uint8_t type, uint32_t value, uint8_t valueBytes);
+  bool packUnsigned(uint32_t n);
+  bool packSigned(int32_t n);
+  bool packRaw(uint8_t *pData, uint32_t sizeInBytes);
+  bool packContainer(uint8_t fixType, uint8_t type16, uint16_t count);
+  bool packBegin(uint8_t fixType);
+  bool packEnd(uint8_t fixType, uint8_t type16);
+  void packCount(void);
+  bool getBigEndian(uint32_t *pValue, uint8_t valueBytes);
   bool getUnsignedInteger(uint32_t *pValue, uint8_t maxBytes);
   bool getSignedInteger(int32_t *pValue, uint8_t maxBytes);
   bool getContainerSize(uint32_t *size, uint8_t mp_min, uint8_t mp_max, uint8_t mp_16, uint8_t mp_32);
   bool m_cached;
   uint8_t m_messagePack_t;
+  bool m_packCompact;
+  uint16_t m_containerStart[PACK_CONTAINER_DEPTH];
+  uint16_t m_containerCount[PACK_CONTAINER_DEPTH]; /* Items packed directly in it */
+  uint32_t m_containerOwed[PACK_CONTAINER_DEPTH];  /* Items still due to packArray()/packMap() */
+  uint8_t m_containerDepth;
 
 };
 
@@ -0,0 +1,257 @@
+/*
+
+BERGCloud message schemas
+
+Copyright (c) 2013 BERG Ltd. http://bergcloud.com/
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#ifndef MESSAGESCHEMA_H
+#define MESSAGESCHEMA_H
+
+#include <stdint.h>
+#include <string.h> /* For memcpy() */
+
+#include "BERGCloudConst.h"
+#include "Message.h"
+
+/*
+  Pack and unpack a plain struct from a list of its fields, so that the
+  event and command sides use the same description, e.g.
+
+  struct READING {uint16_t temperature; int8_t rssi; char name[8];};
+
+  typedef CMessageSchema<READING,
+    BC_SCHEMA_FIELD(READING, temperature),
+    BC_SCHEMA_FIELD(READING, rssi),
+    BC_SCHEMA_FIELD(READING, name)> READING_SCHEMA;
+
+  READING_SCHEMA::pack(message, reading);
+  READING_SCHEMA::unpack(message, reading);
+
+  Fields are packed in order, each in the fixed form of its C type as
+  with setPackCompact(false). char[N] is packed as a string of up to N-1
+  characters and uint8_t[N] as N bytes of raw data.
+
+  The worst case size of a schema is known when it is compiled, and a
+  schema that could not fit in the buffer or in one event fails to build
+  (C++98 has no static_assert so this is a negative array size error).
+  pack() checks the free space once and then writes each field without
+  checking it again.
+
+  BC_SCHEMA_FIELD() uses the GNU __typeof__ extension, which GCC (and so
+  avr-gcc) and Clang support. With another compiler write the field out
+  as CMessageField<S, type, &S::member>.
+*/
+
+/* Declare a field, the type is taken from the struct member */
+#define BC_SCHEMA_FIELD(s, member) CMessageField<s, __typeof__(((s *)0)->member), &s::member>
+
+/* Compile time check, fails to build if c is false */
+#define _BC_SCHEMA_ASSERT(c, name) typedef char name[(c) ? 1 : -1]
+
+/* Largest encoding of one schema */
+#define _BC_SCHEMA_MAX_SIZE (MAX_SERIAL_DATA - 2)
+
+/* Writes fields without checking for space, the caller must have */
+/* checked there is room for them */
+class CMessageSchemaWriter
+{
+public:
+  /* A type and valueBytes of value, MSByte first */
+  static void put(CMessage& message, uint8_t type, uint32_t value, uint8_t valueBytes)
+  {
+    uint8_t *pData = &message.m_data[message.m_written];
+    uint8_t i;
+
+    pData[0] = type;
+
+    for (i = valueBytes; i > 0; i--)
+    {
+      pData[i] = (uint8_t)value;
+      value >>= 8;
+    }
+
+    message.m_written += 1 + valueBytes;
+
+    /* Counted as an item of any array or map being packed */
+    message.packCount();
+  }
+
+  static void putRaw(CMessage& message, const uint8_t *pData, uint16_t size)
+  {
+    put(message, _MP_RAW16, size, sizeof(uint16_t));
+    memcpy(&message.m_data[message.m_written], pData, size);
+    message.m_written += size;
+  }
+};
+
+/* How each field type is packed. There is no default, so a field */
+/* of any other type fails to build. */
+template <typename T> struct CMessageFieldType;
+
+#define _BC_SCHEMA_TYPE(t, mpType, valueType) \
+  template <> struct CMessageFieldType<t> \
+  { \
+    enum {maxSize = 1 + sizeof(t)}; \
+    static void pack(CMessage& message, const t& n) \
+    { \
+      CMessageSchemaWriter::put(message, mpType, (valueType)n, sizeof(t)); \
+    } \
+    static bool unpack(CMessage& message, t& n) \
+    { \
+      return message.unpack(n); \
+    } \
+  };
+
+_BC_SCHEMA_TYPE(uint8_t, _MP_UINT8, uint8_t)
+_BC_SCHEMA_TYPE(uint16_t, _MP_UINT16, uint16_t)
+_BC_SCHEMA_TYPE(uint32_t, _MP_UINT32, uint32_t)
+_BC_SCHEMA_TYPE(int8_t, _MP_INT8, uint8_t)
+_BC_SCHEMA_TYPE(int16_t, _MP_INT16, uint16_t)
+_BC_SCHEMA_TYPE(int32_t, _MP_INT32, uint32_t)
+
+template <> struct CMessageFieldType<float>
+{
+  enum {maxSize = 1 + sizeof(float)};
+  static void pack(CMessage& message, const float& n)
+  {
+    uint32_t data;
+    memcpy(&data, &n, sizeof(float));
+    CMessageSchemaWriter::put(message, _MP_FLOAT, data, sizeof(data));
+  }
+  static bool unpack(CMessage& message, float& n)
+  {
+    return message.unpack(n);
+  }
+};
+
+template <> struct CMessageFieldType<bool>
+{
+  enum {maxSize = 1};
+  static void pack(CMessage& message, const bool& n)
+  {
+    CMessageSchemaWriter::put(message, n ? _MP_BOOL_TRUE : _MP_BOOL_FALSE, 0, 0);
+  }
+  static bool unpack(CMessage& message, bool& n)
+  {
+    return message.unpack(n);
+  }
+};
+
+template <uint16_t N> struct CMessageFieldType<char[N]>
+{
+  /* At least one character plus terminator, as unpack(char *) */
+  _BC_SCHEMA_ASSERT(N >= 2, stringTooShort);
+
+  enum {maxSize = 1 + sizeof(uint16_t) + (N - 1)};
+  static void pack(CMessage& message, const char (&s)[N])
+  {
+    uint16_t length = 0;
+
+    /* Not necessarily terminated if it fills the array */
+    while ((length < (N - 1)) && (s[length] != '\0'))
+    {
+      length++;
+    }
+
+    CMessageSchemaWriter::putRaw(message, (const uint8_t *)s, length);
+  }
+  static bool unpack(CMessage& message, char (&s)[N])
+  {
+    return message.unpack(s, N);
+  }
+};
+
+template <uint16_t N> struct CMessageFieldType<uint8_t[N]>
+{
+  enum {maxSize = 1 + sizeof(uint16_t) + N};
+  static void pack(CMessage& message, const uint8_t (&data)[N])
+  {
+    CMessageSchemaWriter::putRaw(message, data, N);
+  }
+  static bool unpack(CMessage& message, uint8_t (&data)[N])
+  {
+    return message.unpack(data, N);
+  }
+};
+
+/* A member of struct S */
+template <typename S, typename T, T S::*M> struct CMessageField
+{
+  enum {maxSize = CMessageFieldType<T>::maxSize};
+  static void pack(CMessage& message, const S& s)
+  {
+    CMessageFieldType<T>::pack(message, s.*M);
+  }
+  static bool unpack(CMessage& message, S& s)
+  {
+    return CMessageFieldType<T>::unpack(message, s.*M);
+  }
+};
+
+/* Unused schema field */
+struct CMessageFieldNone
+{
+  enum {maxSize = 0};
+  template <typename S> static void pack(CMessage&, const S&) {}
+  template <typename S> static bool unpack(CMessage&, S&) {return true;}
+};
+
+template <typename S, typename F1,
+  typename F2 = CMessageFieldNone, typename F3 = CMessageFieldNone,
+  typename F4 = CMessageFieldNone, typename F5 = CMessageFieldNone,
+  typename F6 = CMessageFieldNone, typename F7 = CMessageFieldNone,
+  typename F8 = CMessageFieldNone>
+struct CMessageSchema
+{
+  enum {maxSize = F1::maxSize + F2::maxSize + F3::maxSize + F4::maxSize +
+    F5::maxSize + F6::maxSize + F7::maxSize + F8::maxSize};
+
+  _BC_SCHEMA_ASSERT(maxSize <= BUFFER_SIZE_BYTES, schemaTooBigForBuffer);
+  _BC_SCHEMA_ASSERT(maxSize <= _BC_SCHEMA_MAX_SIZE, schemaTooBigForEvent);
+
+  static bool pack(CMessage& message, const S& s)
+  {
+    if (message.getBufferFreeSpace() < maxSize)
+    {
+      /* Not enough space remaining in the buffer */
+      return false;
+    }
+
+    F1::pack(message, s); F2::pack(message, s);
+    F3::pack(message, s); F4::pack(message, s);
+    F5::pack(message, s); F6::pack(message, s);
+    F7::pack(message, s); F8::pack(message, s);
+    return true;
+  }
+
+  static bool unpack(CMessage& message, S& s)
+  {
+    return F1::unpack(message, s) && F2::unpack(message, s) &&
+      F3::unpack(message, s) && F4::unpack(message, s) &&
+      F5::unpack(message, s) && F6::unpack(message, s) &&
+      F7::unpack(message, s) && F8::unpack(message, s);
+  }
+};
+
+#endif // #ifndef MESSAGESCHEMA_H
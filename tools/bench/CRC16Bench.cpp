@@ -0,0 +1,130 @@
+/*
+    CRC16Bench - Host benchmark for the CRC16 implementations used by the
+                 SPI framing layer. Checks that every variant matches the
+                 shift/xor routine and reports throughput in bytes/second.
+
+    Build and run from this directory:
+
+      g++ -O2 -I../../BERGCloud CRC16Bench.cpp ../../BERGCloud/CRC16.cpp -o crc16bench
+      ./crc16bench
+
+    This example code is in the public domain.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "CRC16.h"
+
+#define FRAME_SIZE      (69) /* Header plus MAX_SERIAL_DATA */
+#define BENCH_BYTES     (64UL * 1024UL * 1024UL)
+
+typedef uint16_t (*CRC16_FN)(uint8_t data, uint16_t crc);
+
+typedef struct {
+  const char *name;
+  CRC16_FN fn;
+} BENCH_VARIANT;
+
+static const BENCH_VARIANT variants[] = {
+  {"bitwise", crc16Bitwise},
+  {"nibble",  crc16Nibble},
+  {"table",   crc16Table},
+};
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static bool verify(CRC16_FN fn)
+{
+  uint32_t crc;
+  uint16_t data;
+
+  /* Every CRC state against every data byte */
+  for (crc = 0; crc <= 0xffff; crc++)
+  {
+    for (data = 0; data <= 0xff; data++)
+    {
+      if (fn((uint8_t)data, (uint16_t)crc) != crc16Bitwise((uint8_t)data, (uint16_t)crc))
+      {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+int main(void)
+{
+  uint8_t frame[FRAME_SIZE];
+  volatile uint16_t sink = 0;
+  uint32_t i;
+  uint32_t frames;
+  uint32_t f;
+  uint16_t j;
+  uint16_t crc;
+  double start;
+  double elapsed;
+  int result = 0;
+
+  srand(1);
+
+  for (i = 0; i < sizeof(frame); i++)
+  {
+    frame[i] = (uint8_t)rand();
+  }
+
+  frames = BENCH_BYTES / sizeof(frame);
+
+  printf("%-8s %-6s %14s\n", "variant", "match", "bytes/s");
+
+  for (i = 0; i < sizeof(variants) / sizeof(variants[0]); i++)
+  {
+    bool match = verify(variants[i].fn);
+
+    if (!match)
+    {
+      result = 1;
+    }
+
+    start = now_s();
+
+    for (f = 0; f < frames; f++)
+    {
+      crc = CRC16_INIT;
+
+      for (j = 0; j < sizeof(frame); j++)
+      {
+        crc = variants[i].fn(frame[j], crc);
+      }
+
+      sink ^= crc;
+    }
+
+    elapsed = now_s() - start;
+
+    printf("%-8s %-6s %14.0f\n", variants[i].name, match ? "yes" : "NO",
+      (frames * sizeof(frame)) / elapsed);
+  }
+
+  /* Block helper with the variant selected in BERGCloudConfig.h */
+  start = now_s();
+
+  for (i = 0; i < frames; i++)
+  {
+    sink ^= crc16(frame, sizeof(frame), CRC16_INIT);
+  }
+
+  elapsed = now_s() - start;
+  printf("%-8s %-6s %14.0f\n", "crc16()", "-", (frames * sizeof(frame)) / elapsed);
+
+  (void)sink;
+  return result;
+}
@@ -0,0 +1,575 @@
+/*
+    HostBench - Benchmark suite for the library on the host: every
+                CMessage pack() and unpack() overload, CMessageSchema,
+                CBuffer, crc16() and sendEvent()/pollForCommand() round
+                trips against the simulated Devboard shield.
+
+    Build and run from this directory:
+
+      g++ -O2 -I../../BERGCloud HostBench.cpp ../../BERGCloud/BERGCloudBase.cpp \
+        ../../BERGCloud/BERGCloudLinux.cpp ../../BERGCloud/BERGCloudSim.cpp \
+        ../../BERGCloud/CRC16.cpp ../../BERGCloud/Message.cpp \
+        ../../BERGCloud/Buffer.cpp -o hostbench
+      ./hostbench [-csv] [-scale N]
+
+    For each benchmark it reports ns/op, bytes clocked over SPI per op
+    (round trips only) and the peak stack used by one op, measured by
+    painting the stack below the caller beforehand. -csv prints the
+    same as comma separated values, one benchmark per line, for
+    comparing releases. -scale multiplies the iteration counts. A
+    benchmark whose ops did not all succeed is reported and the exit
+    status is the number of such benchmarks. What the ops produce is
+    checked by tools/test/SimTest.cpp.
+
+    This example code is in the public domain.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "BERGCloud.h"
+#include "BERGCloudSim.h"
+#include "CRC16.h"
+#include "MessageSchema.h"
+
+#define MICRO_ITERATIONS      (1000000UL)
+#define ROUND_TRIP_ITERATIONS (100000UL)
+
+/* Stack below the caller painted before each op */
+#define STACK_PAINT_SIZE      (16384)
+#define STACK_PAINT_VALUE     (0xA5)
+
+#define FRAME_SIZE            (69) /* Header plus MAX_SERIAL_DATA */
+
+typedef uint32_t (*BENCH_FN)(uint32_t iterations);
+
+typedef struct {
+  const char *name;
+  BENCH_FN fn;
+  uint32_t iterations;
+  bool spi; /* Clocks bytes over SPI, reported per op */
+} BENCH;
+
+static CBERGCloudSim sim;
+static CMessage message;
+static CBuffer buffer;
+static uint8_t frame[FRAME_SIZE];
+static char text[] = "BERGCloud string";
+static uint8_t data[16] = {0};
+static volatile uint32_t sink;
+
+typedef struct {
+  uint16_t temperature;
+  int8_t rssi;
+  bool alarm;
+  char name[8];
+} READING;
+
+typedef CMessageSchema<READING,
+  BC_SCHEMA_FIELD(READING, temperature),
+  BC_SCHEMA_FIELD(READING, rssi),
+  BC_SCHEMA_FIELD(READING, alarm),
+  BC_SCHEMA_FIELD(READING, name)> READING_SCHEMA;
+
+static READING reading = {2150, -60, false, "kitchen"};
+
+/*
+    Stack measurement
+*/
+
+static void __attribute__((noinline)) stackPaint(void)
+{
+  volatile uint8_t area[STACK_PAINT_SIZE];
+  uint32_t i;
+
+  for (i = 0; i < sizeof(area); i++)
+  {
+    area[i] = STACK_PAINT_VALUE;
+  }
+}
+
+static uint32_t __attribute__((noinline)) stackUsed(void)
+{
+  /* Occupies the same stack as stackPaint(), so the lowest byte */
+  /* changed since shows how deep the op went */
+  volatile uint8_t area[STACK_PAINT_SIZE];
+  volatile uint8_t *pArea = area;
+  uint32_t i;
+
+  for (i = 0; i < sizeof(area); i++)
+  {
+    if (pArea[i] != STACK_PAINT_VALUE)
+    {
+      break;
+    }
+  }
+
+  return sizeof(area) - i;
+}
+
+/*
+    CMessage
+*/
+
+#define PACK_BENCH(name, value) \
+  static uint32_t name(uint32_t iterations) \
+  { \
+    uint32_t ok = 0; \
+    while (iterations-- > 0) \
+    { \
+      message.clearBuffer(); \
+      ok += message.pack(value) ? 1 : 0; \
+    } \
+    return ok; \
+  }
+
+PACK_BENCH(benchPackUint8, (uint8_t)200)
+PACK_BENCH(benchPackUint16, (uint16_t)60000)
+PACK_BENCH(benchPackUint32, (uint32_t)4000000000UL)
+PACK_BENCH(benchPackInt8, (int8_t)-100)
+PACK_BENCH(benchPackInt16, (int16_t)-30000)
+PACK_BENCH(benchPackInt32, (int32_t)-2000000000L)
+PACK_BENCH(benchPackFloat, (float)3.14159f)
+PACK_BENCH(benchPackBool, true)
+PACK_BENCH(benchPackString, text)
+
+static uint32_t benchPackData(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    message.clearBuffer();
+    ok += message.pack(data, sizeof(data)) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+#define UNPACK_BENCH(name, type, value) \
+  static uint32_t name(uint32_t iterations) \
+  { \
+    uint32_t ok = 0; \
+    type n; \
+    message.clearBuffer(); \
+    message.pack(value); \
+    while (iterations-- > 0) \
+    { \
+      message.m_read = 0; \
+      ok += message.unpack(n) ? 1 : 0; \
+      sink += (uint32_t)n; \
+    } \
+    return ok; \
+  }
+
+UNPACK_BENCH(benchUnpackUint8, uint8_t, (uint8_t)200)
+UNPACK_BENCH(benchUnpackUint16, uint16_t, (uint16_t)60000)
+UNPACK_BENCH(benchUnpackUint32, uint32_t, (uint32_t)4000000000UL)
+UNPACK_BENCH(benchUnpackInt8, int8_t, (int8_t)-100)
+UNPACK_BENCH(benchUnpackInt16, int16_t, (int16_t)-30000)
+UNPACK_BENCH(benchUnpackInt32, int32_t, (int32_t)-2000000000L)
+UNPACK_BENCH(benchUnpackFloat, float, (float)3.14159f)
+UNPACK_BENCH(benchUnpackBool, bool, true)
+
+static uint32_t benchUnpackString(uint32_t iterations)
+{
+  char out[sizeof(text)];
+  uint32_t ok = 0;
+
+  message.clearBuffer();
+  message.pack(text);
+
+  while (iterations-- > 0)
+  {
+    message.m_read = 0;
+    ok += message.unpack(out, sizeof(out)) ? 1 : 0;
+    sink += out[0];
+  }
+
+  return ok;
+}
+
+static uint32_t benchUnpackData(uint32_t iterations)
+{
+  uint8_t out[sizeof(data)];
+  uint32_t ok = 0;
+
+  message.clearBuffer();
+  message.pack(data, sizeof(data));
+
+  while (iterations-- > 0)
+  {
+    message.m_read = 0;
+    ok += message.unpack(out, sizeof(out)) ? 1 : 0;
+    sink += out[0];
+  }
+
+  return ok;
+}
+
+static uint32_t benchUnpackStringView(uint32_t iterations)
+{
+  const char *pOut;
+  uint16_t length;
+  uint32_t ok = 0;
+
+  message.clearBuffer();
+  message.pack(text);
+
+  while (iterations-- > 0)
+  {
+    message.m_read = 0;
+    ok += message.unpackView(pOut, length) ? 1 : 0;
+    sink += pOut[0];
+  }
+
+  return ok;
+}
+
+static uint32_t benchUnpackSkip(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  message.clearBuffer();
+  message.pack(text);
+
+  while (iterations-- > 0)
+  {
+    message.m_read = 0;
+    ok += message.unpack() ? 1 : 0;
+  }
+
+  return ok;
+}
+
+/*
+    CMessageSchema, against the same fields packed by hand
+*/
+
+static uint32_t benchPackSchema(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    message.clearBuffer();
+    ok += READING_SCHEMA::pack(message, reading) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+static uint32_t benchPackHand(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    message.clearBuffer();
+    ok += (message.pack(reading.temperature) && message.pack(reading.rssi) &&
+      message.pack(reading.alarm) && message.pack(reading.name)) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+static uint32_t benchUnpackSchema(uint32_t iterations)
+{
+  READING out;
+  uint32_t ok = 0;
+
+  message.clearBuffer();
+  READING_SCHEMA::pack(message, reading);
+
+  while (iterations-- > 0)
+  {
+    message.m_read = 0;
+    ok += READING_SCHEMA::unpack(message, out) ? 1 : 0;
+    sink += out.temperature;
+  }
+
+  return ok;
+}
+
+/*
+    CBuffer and CRC16, per byte
+*/
+
+static uint32_t benchBufferAdd(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    if (buffer.getBufferFreeSpace() == 0)
+    {
+      buffer.clearBuffer();
+    }
+
+    ok += buffer.addToBuffer((uint8_t)iterations) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+static uint32_t benchBufferRemove(uint32_t iterations)
+{
+  uint32_t ok = 0;
+  uint8_t value;
+
+  buffer.clearBuffer();
+
+  while (buffer.addToBuffer(0x55))
+  {
+  }
+
+  while (iterations-- > 0)
+  {
+    if (buffer.getBufferDataRemaining() == 0)
+    {
+      buffer.m_read = 0;
+    }
+
+    ok += buffer.removeFromBuffer(&value) ? 1 : 0;
+    sink += value;
+  }
+
+  return ok;
+}
+
+static uint32_t benchCRC16(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    frame[0] = (uint8_t)iterations;
+    sink += crc16(frame, sizeof(frame), CRC16_INIT);
+    ok++;
+  }
+
+  return ok;
+}
+
+/*
+    Round trips against the simulated shield
+*/
+
+static uint32_t benchSendEvent(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    data[0] = (uint8_t)iterations;
+    ok += BERGCloud.sendEvent(0x01, data, 8) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+static uint32_t benchSendEventMessage(uint32_t iterations)
+{
+  uint32_t ok = 0;
+
+  message.clearBuffer();
+  message.pack(data, 8);
+
+  while (iterations-- > 0)
+  {
+    ok += BERGCloud.sendEvent(0x01, message) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+static uint32_t benchPollNone(uint32_t iterations)
+{
+  uint8_t command[20];
+  uint16_t commandSize;
+  uint8_t commandID;
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    /* NO_DATA, so counted as ok if the transaction completed */
+    BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID);
+    ok += (BERGCloud.m_lastResponse == SPI_RSP_NO_DATA) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+static uint32_t benchPollCommand(uint32_t iterations)
+{
+  uint8_t command[20];
+  uint16_t commandSize;
+  uint8_t commandID;
+  uint32_t ok = 0;
+
+  while (iterations-- > 0)
+  {
+    sim.queueCommand(0x02, data, sizeof(data));
+    ok += BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID) ? 1 : 0;
+  }
+
+  return ok;
+}
+
+static const BENCH benches[] = {
+  {"pack(uint8_t)",         benchPackUint8,        MICRO_ITERATIONS,      false},
+  {"pack(uint16_t)",        benchPackUint16,       MICRO_ITERATIONS,      false},
+  {"pack(uint32_t)",        benchPackUint32,       MICRO_ITERATIONS,      false},
+  {"pack(int8_t)",          benchPackInt8,         MICRO_ITERATIONS,      false},
+  {"pack(int16_t)",         benchPackInt16,        MICRO_ITERATIONS,      false},
+  {"pack(int32_t)",         benchPackInt32,        MICRO_ITERATIONS,      false},
+  {"pack(float)",           benchPackFloat,        MICRO_ITERATIONS,      false},
+  {"pack(bool)",            benchPackBool,         MICRO_ITERATIONS,      false},
+  {"pack(char *)",          benchPackString,       MICRO_ITERATIONS,      false},
+  {"pack(uint8_t *)",       benchPackData,         MICRO_ITERATIONS,      false},
+  {"unpack(uint8_t)",       benchUnpackUint8,      MICRO_ITERATIONS,      false},
+  {"unpack(uint16_t)",      benchUnpackUint16,     MICRO_ITERATIONS,      false},
+  {"unpack(uint32_t)",      benchUnpackUint32,     MICRO_ITERATIONS,      false},
+  {"unpack(int8_t)",        benchUnpackInt8,       MICRO_ITERATIONS,      false},
+  {"unpack(int16_t)",       benchUnpackInt16,      MICRO_ITERATIONS,      false},
+  {"unpack(int32_t)",       benchUnpackInt32,      MICRO_ITERATIONS,      false},
+  {"unpack(float)",         benchUnpackFloat,      MICRO_ITERATIONS,      false},
+  {"unpack(bool)",          benchUnpackBool,       MICRO_ITERATIONS,      false},
+  {"unpack(char *)",        benchUnpackString,     MICRO_ITERATIONS,      false},
+  {"unpack(uint8_t *)",     benchUnpackData,       MICRO_ITERATIONS,      false},
+  {"unpackView(char *)",    benchUnpackStringView, MICRO_ITERATIONS,      false},
+  {"unpack()",              benchUnpackSkip,       MICRO_ITERATIONS,      false},
+  {"schema pack(4)",        benchPackSchema,       MICRO_ITERATIONS,      false},
+  {"hand pack(4)",          benchPackHand,         MICRO_ITERATIONS,      false},
+  {"schema unpack(4)",      benchUnpackSchema,     MICRO_ITERATIONS,      false},
+  {"addToBuffer",           benchBufferAdd,        MICRO_ITERATIONS,      false},
+  {"removeFromBuffer",      benchBufferRemove,     MICRO_ITERATIONS,      false},
+  {"crc16(69)",             benchCRC16,            MICRO_ITERATIONS,      false},
+  {"sendEvent(8)",          benchSendEvent,        ROUND_TRIP_ITERATIONS, true},
+  {"sendEvent(CMessage)",   benchSendEventMessage, ROUND_TRIP_ITERATIONS, true},
+  {"pollForCommand(none)",  benchPollNone,         ROUND_TRIP_ITERATIONS, true},
+  {"pollForCommand(16)",    benchPollCommand,      ROUND_TRIP_ITERATIONS, true},
+};
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+  uint8_t command[20];
+  uint16_t commandSize;
+  uint8_t commandID;
+  bool csv = false;
+  uint32_t scale = 1;
+  char *pEnd;
+  int failed = 0;
+  uint32_t iterations;
+  uint32_t ok;
+  uint32_t stack;
+  uint32_t bytes;
+  double elapsed;
+  int i;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-csv") == 0)
+    {
+      csv = true;
+    }
+    else if ((strcmp(argv[i], "-scale") == 0) && ((i + 1) < argc))
+    {
+      scale = strtoul(argv[++i], &pEnd, 0);
+
+      if ((*pEnd != '\0') || (scale < 1))
+      {
+        fprintf(stderr, "-scale must be a whole number of at least 1\n");
+        return 1;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [-csv] [-scale N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  BERGCloud.begin(&sim);
+  BERGCloud.setLogOutput(false, false);
+
+  /* The simulated shield answers at once, so measure the framing */
+  /* rather than time spent backing off */
+  BERGCloud.setPollBackoff(0);
+
+  /* Sync once so it is not counted */
+  BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID);
+
+  if (csv)
+  {
+    printf("name,iterations,ok,ns_per_op,bytes_per_op,stack_bytes\n");
+  }
+
+  for (i = 0; i < (int)(sizeof(benches) / sizeof(BENCH)); i++)
+  {
+    iterations = benches[i].iterations * scale;
+
+    /* One op on a painted stack first, after one to resolve any */
+    /* library symbols it uses */
+    benches[i].fn(1);
+    stackPaint();
+    benches[i].fn(1);
+    stack = stackUsed();
+
+    sim.clearStats();
+    elapsed = now_s();
+    ok = benches[i].fn(iterations);
+    elapsed = now_s() - elapsed;
+    bytes = sim.getStats()->bytesClocked;
+
+    if (ok != iterations)
+    {
+      /* Timings of ops that went wrong mean nothing */
+      fprintf(stderr, "FAIL %s: %lu of %lu ok\n", benches[i].name,
+        (unsigned long)ok, (unsigned long)iterations);
+      failed++;
+    }
+
+    if (csv)
+    {
+      printf("\"%s\",%lu,%lu,%.2f,", benches[i].name,
+        (unsigned long)iterations, (unsigned long)ok,
+        (elapsed * 1e9) / iterations);
+
+      if (benches[i].spi)
+      {
+        printf("%.2f", (double)bytes / iterations);
+      }
+
+      printf(",%lu\n", (unsigned long)stack);
+    }
+    else
+    {
+      printf("%-22s %9lu ok %10.2f ns/op ", benches[i].name,
+        (unsigned long)ok, (elapsed * 1e9) / iterations);
+
+      if (benches[i].spi)
+      {
+        printf("%7.2f bytes/op ", (double)bytes / iterations);
+      }
+      else
+      {
+        printf("%17s", "");
+      }
+
+      printf("%6lu bytes stack\n", (unsigned long)stack);
+    }
+  }
+
+  return failed;
+}
@@ -0,0 +1,213 @@
+/*
+    SimBench - Measures sendEvent(), pollForCommand() and status requests
+               against the simulated Devboard shield on the host.
+
+    Build and run from this directory:
+
+      g++ -O2 -I../../BERGCloud SimBench.cpp ../../BERGCloud/BERGCloudBase.cpp \
+        ../../BERGCloud/BERGCloudLinux.cpp ../../BERGCloud/BERGCloudSim.cpp \
+        ../../BERGCloud/CRC16.cpp ../../BERGCloud/Message.cpp \
+        ../../BERGCloud/Buffer.cpp -o simbench
+      ./simbench
+
+    Add -DBERGCLOUD_BATCHING to include the event batching case and
+    -DBERGCLOUD_SYNC_REQUEST to include the resynchronisation case. The
+    simulator only resets on an invalid request, so the default pad
+    byte synchronisation can't recover from a corrupted response. The
+    resynchronisation figures are for the simulator, which answers at
+    once; they say nothing about how long shield firmware takes.
+
+    This example code is in the public domain.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "BERGCloud.h"
+#include "BERGCloudSim.h"
+
+#define BENCH_ITERATIONS (100000UL)
+#define FAULT_ITERATIONS (10000UL)
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void report(const char *name, CBERGCloudSim *pSim, uint32_t ok, double elapsed)
+{
+  const _BC_SIM_STATS *pStats = pSim->getStats();
+
+  printf("%-22s %8lu ok %10.0f ops/s %8.2f us/op %6.1f bytes/op\n", name,
+    (unsigned long)ok, BENCH_ITERATIONS / elapsed,
+    (elapsed * 1e6) / BENCH_ITERATIONS,
+    (double)pStats->bytesClocked / BENCH_ITERATIONS);
+}
+
+int main(void)
+{
+  static CBERGCloudSim sim;
+  CMessage message;
+  uint8_t event[8] = {'B', 'E', 'R', 'G', 0, 0, 0, 0};
+  uint8_t payload[16] = {0};
+  uint8_t command[20];
+  uint16_t commandSize;
+  uint8_t commandID;
+  uint8_t networkState;
+  uint8_t claimState;
+  int8_t rssi;
+  uint8_t lqi;
+  uint32_t i;
+  uint32_t ok;
+  double start;
+#ifdef BERGCLOUD_SYNC_REQUEST
+  double resync_s;
+  int32_t resyncBytes;
+  uint32_t bytes;
+#endif
+
+  BERGCloud.begin(&sim);
+  BERGCloud.setLogOutput(false, false);
+
+  /* Sync once so it is not counted */
+  BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID);
+
+  /* sendEvent, 8 byte payload */
+  sim.clearStats();
+  ok = 0;
+  start = now_s();
+
+  for (i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    event[7] = (uint8_t)i;
+    ok += BERGCloud.sendEvent(0x01, event, sizeof(event)) ? 1 : 0;
+  }
+
+  report("sendEvent(8)", &sim, ok, now_s() - start);
+
+  /* sendEvent, packed 8 byte payload */
+  message.pack(event, sizeof(event));
+  sim.clearStats();
+  ok = 0;
+  start = now_s();
+
+  for (i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    ok += BERGCloud.sendEvent(0x01, message) ? 1 : 0;
+  }
+
+  report("sendEvent(CMessage)", &sim, ok, now_s() - start);
+
+#ifdef BERGCLOUD_BATCHING
+  /* queueEvent, 8 byte payload, batched */
+  sim.clearStats();
+  BERGCloud.clearBatchStats();
+  ok = 0;
+  start = now_s();
+
+  for (i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    event[7] = (uint8_t)i;
+    ok += BERGCloud.queueEvent(0x01, event, sizeof(event)) ? 1 : 0;
+  }
+
+  BERGCloud.flushEvents();
+  report("queueEvent(8)", &sim, ok, now_s() - start);
+  printf("%-22s %8lu batches %6.1f events/batch %8lu bytes saved (est)\n", "",
+    (unsigned long)BERGCloud.getBatchStats()->batchesSent,
+    (double)BERGCloud.getBatchStats()->eventsSent / BERGCloud.getBatchStats()->batchesSent,
+    (unsigned long)BERGCloud.getBatchStats()->bytesSavedEstimate);
+#endif
+
+  /* pollForCommand, nothing pending */
+  sim.clearStats();
+  ok = 0;
+  start = now_s();
+
+  for (i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    ok += BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID) ? 1 : 0;
+  }
+
+  report("pollForCommand(none)", &sim, ok, now_s() - start);
+
+  /* pollForCommand, 16 byte command pending every time */
+  sim.clearStats();
+  ok = 0;
+  start = now_s();
+
+  for (i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    sim.queueCommand(0x02, payload, sizeof(payload));
+    ok += BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID) ? 1 : 0;
+  }
+
+  report("pollForCommand(cmd)", &sim, ok, now_s() - start);
+
+  /* Network state, claim state and signal quality */
+  sim.clearStats();
+  ok = 0;
+  start = now_s();
+
+  for (i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    ok += (BERGCloud.getNetworkState(&networkState) &&
+      BERGCloud.getClaimingState(&claimState) &&
+      BERGCloud.getSignalQuality(&rssi, &lqi)) ? 1 : 0;
+  }
+
+  report("status, 3 calls", &sim, ok, now_s() - start);
+
+  /* sendEvent with the shield holding the response for 32 pad bytes; */
+  /* the delay is counted in bytes so poll back to back */
+  BERGCloud.setPollBackoff(0);
+  sim.setResponseDelay(32, 0);
+  sim.clearStats();
+  ok = 0;
+  start = now_s();
+
+  for (i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    ok += BERGCloud.sendEvent(0x01, event, sizeof(event)) ? 1 : 0;
+  }
+
+  report("sendEvent(8), delay 32", &sim, ok, now_s() - start);
+
+#ifdef BERGCLOUD_SYNC_REQUEST
+  /* Resynchronisation. Each pass corrupts one response, then times */
+  /* the sendEvent that has to resynchronise first against one that */
+  /* doesn't; the difference is the cost of resynchronising. */
+  sim.setResponseDelay(0, 0);
+  ok = 0;
+  resync_s = 0;
+  resyncBytes = 0;
+
+  for (i = 0; i < FAULT_ITERATIONS; i++)
+  {
+    sim.injectFaults(1);
+    BERGCloud.sendEvent(0x01, event, sizeof(event));
+    sim.injectFaults(0);
+
+    bytes = sim.getStats()->bytesClocked;
+    start = now_s();
+    ok += BERGCloud.sendEvent(0x01, event, sizeof(event)) ? 1 : 0;
+    resync_s += now_s() - start;
+    resyncBytes += sim.getStats()->bytesClocked - bytes;
+
+    bytes = sim.getStats()->bytesClocked;
+    start = now_s();
+    BERGCloud.sendEvent(0x01, event, sizeof(event));
+    resync_s -= now_s() - start;
+    resyncBytes -= sim.getStats()->bytesClocked - bytes;
+  }
+
+  printf("%-22s %8lu ok %8.2f us/resync %6.1f bytes/resync\n", "resync (simulator)",
+    (unsigned long)ok, (resync_s * 1e6) / FAULT_ITERATIONS,
+    (double)resyncBytes / FAULT_ITERATIONS);
+#endif
+
+  return 0;
+}
@@ -0,0 +1,1346 @@
+/*
+    SimTest - Round trip checks of the library against the simulated
+              Devboard shield on the host. Each check compares what
+              the shield received, or what the library returned, with
+              what was sent, and fails on any difference.
+
+    Build and run from this directory:
+
+      g++ -O2 -DBERGCLOUD_FRAGMENTATION -DBERGCLOUD_BATCHING \
+        -DBERGCLOUD_EVENT_QUEUE -DBERGCLOUD_CACHE -DBERGCLOUD_COMMAND_TABLE \
+        -DBERGCLOUD_STATS -DBERGCLOUD_TRACE -DQUEUE_RETRY_MIN_MS=1 \
+        -I../../BERGCloud SimTest.cpp \
+        ../../BERGCloud/BERGCloudBase.cpp ../../BERGCloud/BERGCloudLinux.cpp \
+        ../../BERGCloud/BERGCloudSim.cpp ../../BERGCloud/CRC16.cpp \
+        ../../BERGCloud/Message.cpp ../../BERGCloud/Buffer.cpp -o simtest
+      ./simtest
+
+    Checks for options that are not defined are skipped. A short
+    QUEUE_RETRY_MIN_MS keeps the event queue retry checks quick. The
+    exit status is the number of checks that failed.
+
+    This example code is in the public domain.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "BERGCloud.h"
+#include "BERGCloudSim.h"
+#include "MessageSchema.h"
+
+/* Defaults from BERGCloudBase.cpp, unless set when building */
+#ifndef QUEUE_RETRY_LIMIT
+#define QUEUE_RETRY_LIMIT (8)
+#endif
+
+typedef bool (*TEST_FN)(void);
+
+typedef struct {
+  const char *name;
+  TEST_FN fn;
+} TEST;
+
+static CBERGCloudSim sim;
+
+/* Completions reported to the callback */
+static uint16_t completions;
+static uint8_t completedCommand;
+
+/* Report the first failed condition of a check */
+#define CHECK(c) \
+  if (!(c)) \
+  { \
+    printf("  %s:%d: %s\n", __FILE__, __LINE__, #c); \
+    return false; \
+  }
+
+static void completed(void *pContext, uint8_t command, uint8_t status)
+{
+  (void)pContext;
+  (void)status;
+  completions++;
+  completedCommand = command;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void reset(void)
+{
+  /* Start each check with a fresh shield and library */
+  uint16_t command;
+
+  for (command = 0; command < 256; command++)
+  {
+    sim.setHandler((uint8_t)command, NULL, NULL);
+  }
+
+  sim.reset();
+  sim.clearCommands();
+  sim.clearStats();
+  sim.setResponseDelay(0, 0);
+  sim.injectFaults(0);
+  BERGCloud.begin(&sim);
+  BERGCloud.setLogOutput(false, false);
+  BERGCloud.setPollBackoff(0);
+  BERGCloud.setCompletionCallback(completed);
+  completions = 0;
+}
+
+/* Events the shield received, in order, as format, code and data */
+#define RECORD_EVENTS (8)
+static uint8_t recordEvent[RECORD_EVENTS][BC_SIM_MAX_FRAME_DATA];
+static uint16_t recordEventSize[RECORD_EVENTS];
+static uint8_t recordEvents;
+
+static uint8_t recordHandler(void *pContext, uint8_t command,
+  const uint8_t *pRequest, uint16_t requestSize,
+  uint8_t *pResponse, uint16_t *pResponseSize)
+{
+  (void)pContext;
+  (void)command;
+  (void)pResponse;
+
+  if (recordEvents < RECORD_EVENTS)
+  {
+    memcpy(recordEvent[recordEvents], pRequest, requestSize);
+    recordEventSize[recordEvents] = requestSize;
+  }
+
+  recordEvents++;
+  *pResponseSize = 0;
+  return SPI_RSP_SUCCESS;
+}
+
+static void recordStart(void)
+{
+  sim.setHandler(SPI_CMD_SEND_EVENT, recordHandler, NULL);
+  recordEvents = 0;
+}
+
+#if defined(BERGCLOUD_FRAGMENTATION) || defined(BERGCLOUD_BATCHING) || \
+    defined(BERGCLOUD_EVENT_QUEUE) || defined(BERGCLOUD_CACHE)
+static uint8_t waitAsync(void)
+{
+  uint8_t status;
+
+  do
+  {
+    status = BERGCloud.service();
+  } while (status == BC_ASYNC_BUSY);
+
+  return status;
+}
+#endif
+
+/*
+    Synchronisation
+*/
+
+static uint8_t staleResetHandler(void *pContext, uint8_t command,
+  const uint8_t *pRequest, uint16_t requestSize,
+  uint8_t *pResponse, uint16_t *pResponseSize)
+{
+  /* Signal quality with an LQI that looks like a reset byte */
+  (void)pContext;
+  (void)command;
+  (void)pRequest;
+  (void)requestSize;
+
+  pResponse[0] = 0x01;
+  pResponse[1] = SPI_PROTOCOL_RESET;
+  *pResponseSize = 2;
+  return SPI_RSP_SUCCESS;
+}
+
+static bool testResyncStaleReset(void)
+{
+  /* A reset byte left in a response abandoned after a size error */
+  /* must not be taken as the shield resetting */
+  int8_t rssi;
+  uint8_t lqi;
+  uint8_t state;
+
+  reset();
+  sim.setHandler(SPI_CMD_GET_SIGNAL_QUALITY, staleResetHandler, NULL);
+  sim.setNetworkState(BC_NETWORK_STATE_CONNECTING);
+  BERGCloud.setTimeouts(1000, 50);
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+  CHECK(lqi == SPI_PROTOCOL_RESET);
+
+  /* Corrupts the size, so the rest of the response is left unread */
+  sim.injectFaults(1);
+  CHECK(!BERGCloud.getSignalQuality(&rssi, &lqi));
+  sim.injectFaults(0);
+
+#ifdef BERGCLOUD_SYNC_REQUEST
+  CHECK(BERGCloud.getNetworkState(&state));
+  CHECK(state == BC_NETWORK_STATE_CONNECTING);
+  CHECK(sim.getStats()->resets == 2);
+#else
+  /* The simulator only resets when it receives an invalid request, */
+  /* so without one the link can't recover, but nor may it appear to */
+  CHECK(!BERGCloud.getNetworkState(&state));
+  CHECK(sim.getStats()->resets == 1);
+#endif
+  return true;
+}
+
+static bool testResyncShieldReset(void)
+{
+  /* The shield resetting between requests fails the request it sees */
+  /* the reset in, and the link is resynchronised for the next one */
+  int8_t rssi;
+  uint8_t lqi;
+
+  reset();
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+  CHECK(sim.getStats()->resets == 1);
+
+  sim.reset();
+  CHECK(!BERGCloud.getSignalQuality(&rssi, &lqi));
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+  return true;
+}
+
+/*
+    Servicing
+*/
+
+static bool testServiceMaxBytes(void)
+{
+  /* service() clocks no more than it is allowed on each call */
+  uint8_t event[20] = {0};
+  uint32_t clocked;
+  uint16_t calls = 0;
+  uint8_t status;
+
+  reset();
+  CHECK(BERGCloud.sendEventAsync(0x01, event, sizeof(event)));
+
+  do
+  {
+    clocked = sim.getStats()->bytesClocked;
+    status = BERGCloud.service(3);
+    CHECK((sim.getStats()->bytesClocked - clocked) <= 3);
+    calls++;
+  } while (status == BC_ASYNC_BUSY);
+
+  CHECK(status == BC_ASYNC_SUCCESS);
+  CHECK(sim.getStats()->eventsReceived == 1);
+  CHECK(calls >= (sim.getStats()->bytesClocked / 3));
+  return true;
+}
+
+static bool testDeadline(void)
+{
+  /* A request not answered by its deadline fails then, instead of */
+  /* waiting for the poll timeout */
+  int8_t rssi;
+  uint8_t lqi;
+  double elapsed;
+
+  reset();
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+
+  sim.setResponseDelay(0, 500000);
+  elapsed = now_s();
+  CHECK(!BERGCloud.getSignalQuality(&rssi, &lqi, 20));
+  elapsed = now_s() - elapsed;
+  CHECK((elapsed >= 0.02) && (elapsed < 0.25));
+  CHECK(BERGCloud.getAsyncStatus() == BC_ASYNC_FAILED);
+  CHECK(completions == 2);
+
+#ifdef BERGCLOUD_SYNC_REQUEST
+  /* Without one, a delay within the poll timeout is waited out */
+  sim.setResponseDelay(0, 100000);
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+#endif
+  return true;
+}
+
+/*
+    Commands
+*/
+
+static bool testCommandTruncated(void)
+{
+  /* The ID, full size and start of a command too big for the buffer */
+  /* are kept, and the next command is unaffected */
+  uint8_t data[20];
+  uint8_t command[8];
+  uint16_t commandSize = 0;
+  uint8_t commandID = 0;
+  uint8_t i;
+
+  reset();
+
+  for (i = 0; i < sizeof(data); i++)
+  {
+    data[i] = i + 1;
+  }
+
+  CHECK(sim.queueCommand(0x11, data, sizeof(data)));
+  CHECK(sim.queueCommand(0x12, data, sizeof(command)));
+
+  CHECK(!BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID));
+  CHECK(BERGCloud.getCommandTruncated());
+  CHECK(commandID == 0x11);
+  CHECK(commandSize == sizeof(data));
+  CHECK(memcmp(command, data, sizeof(command)) == 0);
+
+  CHECK(BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID));
+  CHECK(!BERGCloud.getCommandTruncated());
+  CHECK(commandID == 0x12);
+  CHECK(commandSize == sizeof(command));
+  return true;
+}
+
+static bool testCommandNoBuffer(void)
+{
+  /* With no buffer, or an empty one, only the ID and size are wanted */
+  uint8_t data[6] = {0};
+  uint8_t command[1];
+  uint16_t commandSize = 0;
+  uint8_t commandID = 0;
+
+  reset();
+  CHECK(sim.queueCommand(0x21, data, sizeof(data)));
+  CHECK(sim.queueCommand(0x22, data, 3));
+
+  CHECK(BERGCloud.pollForCommand(NULL, 0, &commandSize, &commandID));
+  CHECK(!BERGCloud.getCommandTruncated());
+  CHECK(commandID == 0x21);
+  CHECK(commandSize == sizeof(data));
+
+  CHECK(BERGCloud.pollForCommand(command, 0, &commandSize, &commandID));
+  CHECK(commandID == 0x22);
+  CHECK(commandSize == 3);
+  return true;
+}
+
+#ifdef BERGCLOUD_FRAGMENTATION
+/*
+    Fragmentation
+*/
+
+/* Event data reassembled from the fragments the shield received */
+static uint8_t fragEvent[BC_FRAGMENT_MAX_SIZE];
+static uint16_t fragEventSize;
+static bool fragEventLast;
+
+static uint8_t fragHandler(void *pContext, uint8_t command,
+  const uint8_t *pRequest, uint16_t requestSize,
+  uint8_t *pResponse, uint16_t *pResponseSize)
+{
+  /* Format, event code, sequence, index, format, then data */
+  uint16_t offset;
+  uint16_t size;
+
+  (void)pContext;
+  (void)command;
+  (void)pResponse;
+
+  if ((requestSize < (2 + BC_FRAGMENT_HEADER_SIZE)) ||
+    (pRequest[0] != (BC_EVENT_START_FRAGMENT >> 8)))
+  {
+    return SPI_RSP_INVALID_COMMAND;
+  }
+
+  offset = (pRequest[3] & BC_FRAGMENT_INDEX_MASK) * BC_FRAGMENT_DATA_SIZE;
+  size = requestSize - (2 + BC_FRAGMENT_HEADER_SIZE);
+  memcpy(&fragEvent[offset], &pRequest[2 + BC_FRAGMENT_HEADER_SIZE], size);
+
+  if (pRequest[3] & BC_FRAGMENT_LAST)
+  {
+    fragEventSize = offset + size;
+    fragEventLast = true;
+  }
+
+  *pResponseSize = 0;
+  return SPI_RSP_SUCCESS;
+}
+
+static bool testFragmentedEvent(void)
+{
+  uint8_t event[200];
+  uint16_t i;
+
+  reset();
+  sim.setHandler(SPI_CMD_SEND_EVENT, fragHandler, NULL);
+  fragEventLast = false;
+
+  for (i = 0; i < sizeof(event); i++)
+  {
+    event[i] = (uint8_t)i;
+  }
+
+  CHECK(BERGCloud.sendEvent(0x01, event, sizeof(event)));
+  CHECK(fragEventLast);
+  CHECK(fragEventSize == sizeof(event));
+  CHECK(memcmp(fragEvent, event, sizeof(event)) == 0);
+  return true;
+}
+
+static bool testFragmentedEventBusyPoll(void)
+{
+  /* A poll rejected while a fragmented event is being sent must not */
+  /* change what the remaining fragments are sent from */
+  uint8_t event[200];
+  uint8_t command[200];
+  uint16_t commandSize;
+  uint8_t commandID;
+  uint16_t i;
+
+  reset();
+  sim.setHandler(SPI_CMD_SEND_EVENT, fragHandler, NULL);
+  fragEventLast = false;
+
+  for (i = 0; i < sizeof(event); i++)
+  {
+    event[i] = (uint8_t)i;
+  }
+
+  memset(command, 0xAA, sizeof(command));
+
+  CHECK(BERGCloud.sendEventAsync(0x01, event, sizeof(event)));
+  CHECK(!BERGCloud.pollForCommandAsync(command, sizeof(command), &commandSize, &commandID));
+  CHECK(waitAsync() == BC_ASYNC_SUCCESS);
+  CHECK(fragEventLast);
+  CHECK(fragEventSize == sizeof(event));
+  CHECK(memcmp(fragEvent, event, sizeof(event)) == 0);
+  return true;
+}
+
+static bool queueFragment(uint8_t index, const uint8_t *pData, uint8_t size)
+{
+  /* Sequence, index, format of the whole command, then data */
+  uint8_t fragment[BC_FRAGMENT_HEADER_SIZE + BC_FRAGMENT_DATA_SIZE];
+
+  fragment[0] = 0x42;
+  fragment[1] = index;
+  fragment[2] = BC_COMMAND_START_BINARY >> 8;
+  memcpy(&fragment[BC_FRAGMENT_HEADER_SIZE], pData, size);
+
+  return sim.queueCommand(0x05, fragment, BC_FRAGMENT_HEADER_SIZE + size, BC_COMMAND_START_FRAGMENT);
+}
+
+static bool testFragmentedCommand(void)
+{
+  /* Reassembled from three fragments into the caller's buffer */
+  uint8_t data[150];
+  uint8_t command[200];
+  uint16_t commandSize = 0;
+  uint8_t commandID = 0;
+  uint16_t i;
+
+  reset();
+
+  for (i = 0; i < sizeof(data); i++)
+  {
+    data[i] = (uint8_t)(i * 3);
+  }
+
+  CHECK(queueFragment(0, &data[0], BC_FRAGMENT_DATA_SIZE));
+  CHECK(queueFragment(1, &data[BC_FRAGMENT_DATA_SIZE], BC_FRAGMENT_DATA_SIZE));
+  CHECK(queueFragment(2 | BC_FRAGMENT_LAST, &data[2 * BC_FRAGMENT_DATA_SIZE],
+    sizeof(data) - (2 * BC_FRAGMENT_DATA_SIZE)));
+
+  CHECK(BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID));
+  CHECK(commandID == 0x05);
+  CHECK(commandSize == sizeof(data));
+  CHECK(memcmp(command, data, sizeof(data)) == 0);
+  return true;
+}
+
+/* Shield that has the last fragment of a command ready only after */
+/* a delay, counting the polls made while it waits */
+typedef struct {
+  uint8_t sent;
+  uint16_t polls;
+  double ready_s;
+} LATE_FRAGMENT;
+
+static uint8_t lateFragmentHandler(void *pContext, uint8_t command,
+  const uint8_t *pRequest, uint16_t requestSize,
+  uint8_t *pResponse, uint16_t *pResponseSize)
+{
+  LATE_FRAGMENT *pLate = (LATE_FRAGMENT *)pContext;
+
+  (void)command;
+  (void)pRequest;
+  (void)requestSize;
+
+  if ((pLate->sent == 1) && (now_s() < pLate->ready_s))
+  {
+    pLate->polls++;
+    return SPI_RSP_NO_DATA;
+  }
+
+  if (pLate->sent == 2)
+  {
+    return SPI_RSP_NO_DATA;
+  }
+
+  /* Format, command ID, sequence, index, format, then 4 bytes */
+  pResponse[0] = BC_COMMAND_START_FRAGMENT >> 8;
+  pResponse[1] = 0x06;
+  pResponse[2] = 0x01;
+  pResponse[3] = pLate->sent | ((pLate->sent == 1) ? BC_FRAGMENT_LAST : 0);
+  pResponse[4] = BC_COMMAND_START_BINARY >> 8;
+  memset(&pResponse[5], pLate->sent + 1, 4);
+  *pResponseSize = 9;
+  pLate->sent++;
+  return SPI_RSP_SUCCESS;
+}
+
+static bool testFragmentedCommandLate(void)
+{
+  /* While waiting for the next fragment, polls back off as set by */
+  /* setPollBackoff() instead of running back to back */
+  LATE_FRAGMENT late;
+  uint8_t command[16];
+  uint8_t expected[8] = {1, 1, 1, 1, 2, 2, 2, 2};
+  uint16_t commandSize = 0;
+  uint8_t commandID = 0;
+
+  reset();
+  memset(&late, 0, sizeof(late));
+  late.ready_s = now_s() + 0.05;
+  sim.setHandler(SPI_CMD_POLL_FOR_COMMAND, lateFragmentHandler, &late);
+  BERGCloud.setPollBackoff(4);
+
+  CHECK(BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID));
+  CHECK(commandID == 0x06);
+  CHECK(commandSize == sizeof(expected));
+  CHECK(memcmp(command, expected, sizeof(expected)) == 0);
+
+  /* 50mS at no less than 4mS apart once backed off */
+  CHECK(late.polls > 0);
+  CHECK(late.polls < 25);
+  return true;
+}
+
+static bool testFragmentedCommandTruncated(void)
+{
+  /* Reassembled until the buffer is full, the rest is discarded */
+  uint8_t data[2 * BC_FRAGMENT_DATA_SIZE];
+  uint8_t command[BC_FRAGMENT_DATA_SIZE + 10];
+  uint16_t commandSize = 0;
+  uint8_t commandID = 0;
+  uint16_t i;
+
+  reset();
+
+  for (i = 0; i < sizeof(data); i++)
+  {
+    data[i] = (uint8_t)(i * 5);
+  }
+
+  CHECK(queueFragment(0, &data[0], BC_FRAGMENT_DATA_SIZE));
+  CHECK(queueFragment(1 | BC_FRAGMENT_LAST, &data[BC_FRAGMENT_DATA_SIZE], BC_FRAGMENT_DATA_SIZE));
+
+  CHECK(!BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID));
+  CHECK(BERGCloud.getCommandTruncated());
+  CHECK(commandID == 0x05);
+  CHECK(commandSize == sizeof(data));
+  CHECK(memcmp(command, data, sizeof(command)) == 0);
+  return true;
+}
+
+static bool testFragmentedCommandLost(void)
+{
+  /* A missing fragment fails the command */
+  uint8_t data[BC_FRAGMENT_DATA_SIZE] = {0};
+  uint8_t command[200];
+  uint16_t commandSize;
+  uint8_t commandID;
+
+  reset();
+  CHECK(queueFragment(0, data, sizeof(data)));
+  CHECK(queueFragment(2 | BC_FRAGMENT_LAST, data, sizeof(data)));
+  CHECK(!BERGCloud.pollForCommand(command, sizeof(command), &commandSize, &commandID));
+  return true;
+}
+#endif
+
+#ifdef BERGCLOUD_BATCHING
+/*
+    Batching
+*/
+
+static bool testBatchFrame(void)
+{
+  /* Two events flushed as one batch frame */
+  uint8_t event[3] = {'a', 'b', 'c'};
+  CMessage message;
+  uint8_t expected[BC_SIM_MAX_FRAME_DATA];
+  uint16_t size = 0;
+
+  reset();
+  recordStart();
+  BERGCloud.setBatchMaxAge(60000);
+  message.pack((uint16_t)500);
+
+  expected[size++] = BC_EVENT_START_BATCH >> 8;
+  expected[size++] = 2;
+  expected[size++] = 0x01;
+  expected[size++] = sizeof(event);
+  memcpy(&expected[size], event, sizeof(event));
+  size += sizeof(event);
+  expected[size++] = 0x02;
+  expected[size++] = message.m_written | BC_BATCH_PACKED;
+  memcpy(&expected[size], message.m_data, message.m_written);
+  size += message.m_written;
+
+  CHECK(BERGCloud.queueEvent(0x01, event, sizeof(event)));
+  CHECK(BERGCloud.queueEvent(0x02, message));
+  CHECK(recordEvents == 0);
+  CHECK(BERGCloud.flushEvents());
+  CHECK(recordEvents == 1);
+  CHECK(recordEventSize[0] == size);
+  CHECK(memcmp(recordEvent[0], expected, size) == 0);
+  CHECK(BERGCloud.getBatchStats()->eventsSent == 2);
+  CHECK(BERGCloud.getBatchStats()->batchesSent == 1);
+  return true;
+}
+
+static bool testBatchSingle(void)
+{
+  /* A batch of one is sent as a plain event */
+  uint8_t event[3] = {'a', 'b', 'c'};
+
+  reset();
+  recordStart();
+  BERGCloud.setBatchMaxAge(60000);
+
+  CHECK(BERGCloud.queueEvent(0x07, event, sizeof(event)));
+  CHECK(BERGCloud.flushEvents());
+  CHECK(recordEvents == 1);
+  CHECK(recordEventSize[0] == (2 + sizeof(event)));
+  CHECK(recordEvent[0][0] == (BC_EVENT_START_BINARY >> 8));
+  CHECK(recordEvent[0][1] == 0x07);
+  CHECK(memcmp(&recordEvent[0][2], event, sizeof(event)) == 0);
+  return true;
+}
+
+static bool testBatchFullBusy(void)
+{
+  /* A full batch isn't flushed by running the caller's async request */
+  uint8_t event[(BC_SIM_MAX_FRAME_DATA / 3) - BC_BATCH_ENTRY_HEADER_SIZE] = {0};
+
+  reset();
+  recordStart();
+  BERGCloud.setBatchMaxAge(60000);
+
+  CHECK(BERGCloud.queueEvent(0x01, event, sizeof(event)));
+  CHECK(BERGCloud.queueEvent(0x02, event, sizeof(event)));
+  CHECK(BERGCloud.sendEventAsync(0x03, event, sizeof(event)));
+  CHECK(!BERGCloud.queueEvent(0x04, event, sizeof(event)));
+  CHECK(sim.getStats()->eventsReceived == 0);
+  CHECK(BERGCloud.getAsyncStatus() == BC_ASYNC_BUSY);
+  CHECK(completions == 0);
+
+  CHECK(waitAsync() == BC_ASYNC_SUCCESS);
+  CHECK(completions == 1);
+  CHECK(BERGCloud.queueEvent(0x04, event, sizeof(event)));
+  CHECK(recordEvents == 2);
+  CHECK(recordEvent[0][1] == 0x03);
+  CHECK(recordEvent[1][1] == 2);
+  CHECK(completions == 1);
+  return true;
+}
+#endif
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+/*
+    Event queue
+*/
+
+static bool testQueueOrder(void)
+{
+  /* Sent in the order posted, the first once the shield isn't busy */
+  uint8_t event;
+  uint8_t i;
+
+  reset();
+  recordStart();
+  sim.forceStatus(SPI_CMD_SEND_EVENT, SPI_RSP_BUSY, 1);
+
+  for (i = 1; i <= 3; i++)
+  {
+    event = i * 10;
+    CHECK(BERGCloud.postEvent(i, &event, sizeof(event)));
+  }
+
+  while (BERGCloud.getEventQueueStats()->depth > 0)
+  {
+    BERGCloud.service();
+  }
+
+  CHECK(recordEvents == 3);
+
+  for (i = 0; i < 3; i++)
+  {
+    CHECK(recordEventSize[i] == 3);
+    CHECK(recordEvent[i][0] == (BC_EVENT_START_BINARY >> 8));
+    CHECK(recordEvent[i][1] == (i + 1));
+    CHECK(recordEvent[i][2] == ((i + 1) * 10));
+  }
+
+  CHECK(BERGCloud.getEventQueueStats()->retries == 1);
+  CHECK(BERGCloud.getEventQueueStats()->sent == 3);
+  CHECK(BERGCloud.getEventQueueStats()->dropped == 0);
+  return true;
+}
+
+static bool testQueueRetryLimit(void)
+{
+  /* An event the shield keeps failing is dropped after the retries, */
+  /* and the events behind it are then sent */
+  uint8_t event = 1;
+
+  reset();
+  recordStart();
+  sim.forceStatus(SPI_CMD_SEND_EVENT, SPI_RSP_SEND_FAILED, QUEUE_RETRY_LIMIT + 1);
+  CHECK(BERGCloud.postEvent(0x01, &event, sizeof(event)));
+  CHECK(BERGCloud.postEvent(0x02, &event, sizeof(event)));
+
+  while (BERGCloud.getEventQueueStats()->depth > 0)
+  {
+    BERGCloud.service();
+  }
+
+  CHECK(BERGCloud.getEventQueueStats()->retries == QUEUE_RETRY_LIMIT);
+  CHECK(BERGCloud.getEventQueueStats()->dropped == 1);
+  CHECK(BERGCloud.getEventQueueStats()->sent == 1);
+  CHECK(recordEvents == 1);
+  CHECK(recordEvent[0][1] == 0x02);
+  CHECK(completions == 0);
+  return true;
+}
+#endif
+
+/*
+    Completion reporting
+*/
+
+#ifdef BERGCLOUD_BATCHING
+static bool testBatchNotReported(void)
+{
+  /* A batch flushed by service() isn't the caller's request */
+  uint8_t event[8] = {0};
+
+  reset();
+  BERGCloud.setBatchMaxAge(0);
+  CHECK(BERGCloud.queueEvent(0x01, event, sizeof(event)));
+
+  while ((BERGCloud.getBatchStats()->eventsSent == 0) && (BERGCloud.getBatchStats()->batchesFailed == 0))
+  {
+    BERGCloud.service();
+  }
+
+  CHECK(BERGCloud.getBatchStats()->eventsSent == 1);
+  CHECK(sim.getStats()->eventsReceived == 1);
+  CHECK(completions == 0);
+  CHECK(BERGCloud.getAsyncStatus() == BC_ASYNC_IDLE);
+  return true;
+}
+#endif
+
+#ifdef BERGCLOUD_EVENT_QUEUE
+static bool testQueueNotReported(void)
+{
+  /* A queued event that fails in the background leaves the status of */
+  /* the caller's last request */
+  uint8_t event[8] = {0};
+
+  reset();
+  CHECK(BERGCloud.sendEventAsync(0x01, event, sizeof(event)));
+  CHECK(waitAsync() == BC_ASYNC_SUCCESS);
+  CHECK(completions == 1);
+
+  sim.forceStatus(SPI_CMD_SEND_EVENT, SPI_RSP_INVALID_COMMAND, 1);
+  CHECK(BERGCloud.postEvent(0x02, event, sizeof(event)));
+
+  while (BERGCloud.getEventQueueStats()->depth > 0)
+  {
+    CHECK(BERGCloud.service() == BC_ASYNC_SUCCESS);
+  }
+
+  CHECK(completions == 1);
+  CHECK(BERGCloud.getAsyncStatus() == BC_ASYNC_SUCCESS);
+  return true;
+}
+#endif
+
+#ifdef BERGCLOUD_CACHE
+static bool testCacheHit(void)
+{
+  /* Answered from the cache before the Async call returns, and */
+  /* reported to the callback like any other request */
+  uint8_t state = 0;
+
+  reset();
+  sim.setNetworkState(BC_NETWORK_STATE_CONNECTED);
+  CHECK(BERGCloud.getNetworkState(&state));
+  CHECK(state == BC_NETWORK_STATE_CONNECTED);
+  CHECK(completions == 1);
+
+  state = 0;
+  completedCommand = 0;
+  CHECK(BERGCloud.getNetworkStateAsync(&state));
+  CHECK(state == BC_NETWORK_STATE_CONNECTED);
+  CHECK(BERGCloud.getAsyncStatus() == BC_ASYNC_SUCCESS);
+  CHECK(completions == 2);
+  CHECK(completedCommand == SPI_CMD_GET_NETWORK_STATE);
+  CHECK(sim.getStats()->framesReceived == 1);
+  return true;
+}
+
+static bool testCacheBusy(void)
+{
+  /* Not answered from the cache while a request is in progress */
+  uint8_t event = 0;
+  uint8_t state = 0;
+
+  reset();
+  sim.setNetworkState(BC_NETWORK_STATE_CONNECTED);
+  CHECK(BERGCloud.getNetworkState(&state));
+
+  state = 0;
+  CHECK(BERGCloud.sendEventAsync(0x01, &event, sizeof(event)));
+  CHECK(!BERGCloud.getNetworkStateAsync(&state));
+  CHECK(state == 0);
+  CHECK(BERGCloud.getAsyncStatus() == BC_ASYNC_BUSY);
+  CHECK(waitAsync() == BC_ASYNC_SUCCESS);
+  CHECK(completions == 2);
+  CHECK(completedCommand == SPI_CMD_SEND_EVENT);
+  return true;
+}
+
+static bool testCacheExpiry(void)
+{
+  /* Fetched again once the TTL has passed or the cache is invalidated */
+  uint8_t state = 0;
+
+  reset();
+  BERGCloud.setCacheTTL(50);
+  sim.setNetworkState(BC_NETWORK_STATE_CONNECTED);
+  CHECK(BERGCloud.getNetworkState(&state));
+  CHECK(state == BC_NETWORK_STATE_CONNECTED);
+
+  sim.setNetworkState(BC_NETWORK_STATE_CONNECTING);
+  CHECK(BERGCloud.getNetworkState(&state));
+  CHECK(state == BC_NETWORK_STATE_CONNECTED);
+  CHECK(sim.getStats()->framesReceived == 1);
+
+  usleep(60000);
+  CHECK(BERGCloud.getNetworkState(&state));
+  CHECK(state == BC_NETWORK_STATE_CONNECTING);
+  CHECK(sim.getStats()->framesReceived == 2);
+
+  sim.setNetworkState(BC_NETWORK_STATE_DISCONNECTED);
+  BERGCloud.invalidateCache();
+  CHECK(BERGCloud.getNetworkState(&state));
+  CHECK(state == BC_NETWORK_STATE_DISCONNECTED);
+  CHECK(sim.getStats()->framesReceived == 3);
+  return true;
+}
+#endif
+
+#ifdef BERGCLOUD_COMMAND_TABLE
+/*
+    Command table
+*/
+
+/* Last command passed to a handler, and the number of calls */
+typedef struct {
+  uint8_t calls;
+  uint8_t commandID;
+  uint8_t data[8];
+  uint16_t dataSize;
+} HANDLED;
+
+static void commandHandler(void *pContext, uint8_t commandID, uint8_t *pData, uint16_t dataSize)
+{
+  HANDLED *pHandled = (HANDLED *)pContext;
+
+  pHandled->calls++;
+  pHandled->commandID = commandID;
+  pHandled->dataSize = dataSize;
+  memcpy(pHandled->data, pData, (dataSize < sizeof(pHandled->data)) ? dataSize : sizeof(pHandled->data));
+}
+
+static bool testCommandTable(void)
+{
+  /* 0x10, 0x18 and 0x20 share a slot unless the table is full size, */
+  /* so removing 0x10 must leave the other two reachable */
+  HANDLED handled10;
+  HANDLED handled18;
+  HANDLED handled20;
+  uint8_t data18[2] = {1, 2};
+  uint8_t data20[3] = {3, 4, 5};
+  uint8_t buffer[32];
+
+  reset();
+  memset(&handled10, 0, sizeof(handled10));
+  memset(&handled18, 0, sizeof(handled18));
+  memset(&handled20, 0, sizeof(handled20));
+  CHECK(BERGCloud.registerCommand(0x10, commandHandler, &handled10));
+  CHECK(BERGCloud.registerCommand(0x18, commandHandler, &handled18));
+  CHECK(BERGCloud.registerCommand(0x20, commandHandler, &handled20));
+  CHECK(BERGCloud.registerCommand(0x10, NULL));
+
+  CHECK(sim.queueCommand(0x20, data20, sizeof(data20)));
+  CHECK(sim.queueCommand(0x10, data18, sizeof(data18)));
+  CHECK(sim.queueCommand(0x18, data18, sizeof(data18)));
+  CHECK(sim.queueCommand(0x30, data18, sizeof(data18)));
+
+  CHECK(BERGCloud.processCommands(buffer, sizeof(buffer)) == 4);
+  CHECK(handled10.calls == 0);
+  CHECK(handled18.calls == 1);
+  CHECK(handled18.commandID == 0x18);
+  CHECK(handled18.dataSize == sizeof(data18));
+  CHECK(memcmp(handled18.data, data18, sizeof(data18)) == 0);
+  CHECK(handled20.calls == 1);
+  CHECK(handled20.commandID == 0x20);
+  CHECK(handled20.dataSize == sizeof(data20));
+  CHECK(memcmp(handled20.data, data20, sizeof(data20)) == 0);
+  return true;
+}
+
+#ifndef BERGCLOUD_COMMAND_TABLE_FULL
+static bool testCommandTableFull(void)
+{
+  HANDLED handled;
+  uint16_t i;
+
+  reset();
+
+  for (i = 0; i < COMMAND_HANDLERS; i++)
+  {
+    CHECK(BERGCloud.registerCommand((uint8_t)(i * 3), commandHandler, &handled));
+  }
+
+  CHECK(!BERGCloud.registerCommand(0xFF, commandHandler, &handled));
+  CHECK(BERGCloud.registerCommand(0, commandHandler, &handled));
+  return true;
+}
+#endif
+#endif
+
+#ifdef BERGCLOUD_STATS
+/*
+    Statistics
+*/
+
+static bool testStats(void)
+{
+  /* Counts agree with what happened, and bytes with what the shield */
+  /* clocked */
+  const _BC_STATS *pStats;
+  const _BC_COMMAND_STATS *pCommand;
+  int8_t rssi;
+  uint8_t lqi;
+
+  reset();
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+  sim.forceStatus(SPI_CMD_GET_SIGNAL_QUALITY, SPI_RSP_BUSY, 1);
+  CHECK(!BERGCloud.getSignalQuality(&rssi, &lqi));
+
+  pStats = BERGCloud.getStats();
+  pCommand = BERGCloud.getCommandStats(SPI_CMD_GET_SIGNAL_QUALITY);
+  CHECK(pCommand != NULL);
+  CHECK(pCommand->count == 2);
+  CHECK(pCommand->failed == 0);
+  CHECK(pCommand->bytes == sim.getStats()->bytesClocked);
+  CHECK(pCommand->latencyMin_uS <= pCommand->latencyMax_uS);
+  CHECK(pStats->busy == 1);
+  CHECK(pStats->errorResponses == 0);
+  CHECK(pStats->resyncs == 1);
+  CHECK((pStats->resyncBytes > 0) && (pStats->resyncBytes < pCommand->bytes));
+  CHECK(pStats->syncTimeouts == 0);
+  CHECK(pStats->pollTimeouts == 0);
+
+  BERGCloud.clearStats();
+  CHECK(BERGCloud.getCommandStats(SPI_CMD_GET_SIGNAL_QUALITY)->count == 0);
+  CHECK(BERGCloud.getStats()->busy == 0);
+  return true;
+}
+#endif
+
+#ifdef BERGCLOUD_TRACE
+/*
+    Trace
+*/
+
+static bool testTrace(void)
+{
+  /* One request as the records TraceReplay reads: the request frame, */
+  /* synchronising, the response header and data, and how it ended */
+  const uint8_t expected[] = {BC_TRACE_REQUEST, BC_TRACE_SYNC,
+    BC_TRACE_RESPONSE, BC_TRACE_DATA, BC_TRACE_END};
+  uint8_t trace[TRACE_SIZE];
+  uint8_t *pRecord;
+  uint16_t size;
+  uint8_t records = 0;
+  int8_t rssi;
+  uint8_t lqi;
+
+  reset();
+  BERGCloud.traceClear();
+  CHECK(BERGCloud.getSignalQuality(&rssi, &lqi));
+  size = BERGCloud.traceRead(trace, sizeof(trace));
+
+  for (pRecord = trace; pRecord < &trace[size];
+    pRecord += BC_TRACE_RECORD_HEADER_SIZE + pRecord[BC_TRACE_RECORD_HEADER_SIZE - 1])
+  {
+    CHECK(records < sizeof(expected));
+    CHECK(pRecord[0] == expected[records]);
+
+    switch (pRecord[0])
+    {
+    case BC_TRACE_REQUEST:
+      CHECK(pRecord[BC_TRACE_RECORD_HEADER_SIZE - 1] == SPI_PROTOCOL_HEADER_SIZE);
+      CHECK(pRecord[BC_TRACE_RECORD_HEADER_SIZE + 4] == SPI_CMD_GET_SIGNAL_QUALITY);
+      break;
+
+    case BC_TRACE_DATA:
+      CHECK(pRecord[BC_TRACE_RECORD_HEADER_SIZE - 1] == 2);
+      CHECK(pRecord[BC_TRACE_RECORD_HEADER_SIZE] == (uint8_t)rssi);
+      CHECK(pRecord[BC_TRACE_RECORD_HEADER_SIZE + 1] == lqi);
+      break;
+
+    case BC_TRACE_END:
+      CHECK(pRecord[BC_TRACE_RECORD_HEADER_SIZE + 1] == 1);
+      break;
+    }
+
+    records++;
+  }
+
+  CHECK(pRecord == &trace[size]);
+  CHECK(records == sizeof(expected));
+  CHECK(BERGCloud.traceRead(trace, sizeof(trace)) == 0);
+  return true;
+}
+#endif
+
+/*
+    Messages
+*/
+
+static bool roundTrip(CMessage& message, CMessage& received)
+{
+  /* Send message as an event, check the shield received exactly its */
+  /* bytes, then have the shield return them as a command */
+  uint8_t expected[BUFFER_SIZE_BYTES];
+  uint16_t size = message.m_written;
+  uint8_t commandID = 0;
+
+  memcpy(expected, message.m_data, size);
+  recordStart();
+
+  CHECK(BERGCloud.sendEvent(0x01, message));
+  CHECK(recordEvents == 1);
+  CHECK(recordEventSize[0] == (2 + size));
+  CHECK(recordEvent[0][0] == (BC_EVENT_START_PACKED >> 8));
+  CHECK(memcmp(&recordEvent[0][2], expected, size) == 0);
+
+  CHECK(sim.queueCommand(0x09, expected, size, BC_COMMAND_START_PACKED));
+  CHECK(BERGCloud.pollForCommand(received, &commandID));
+  CHECK(commandID == 0x09);
+  CHECK(received.m_written == size);
+  CHECK(memcmp(received.m_data, expected, size) == 0);
+  return true;
+}
+
+static bool testMessageNavigation(void)
+{
+  /* {"a": 1, "list": [1, 2, [3]], "b": "xy"}, 500 */
+  CMessage message;
+  CMessage received;
+  char text[4];
+  uint16_t n16 = 0;
+  uint8_t n8 = 0;
+
+  reset();
+  CHECK(message.packMap(3));
+  CHECK(message.pack((char *)"a"));
+  CHECK(message.pack((uint8_t)1));
+  CHECK(message.pack((char *)"list"));
+  CHECK(message.packArray(3));
+  CHECK(message.pack((uint8_t)1));
+  CHECK(message.pack((uint8_t)2));
+  CHECK(message.packArray(1));
+  CHECK(message.pack((uint8_t)3));
+  CHECK(message.pack((char *)"b"));
+  CHECK(message.pack((char *)"xy"));
+  CHECK(message.pack((uint16_t)500));
+
+  CHECK(roundTrip(message, received));
+
+  /* Skipping the array skips everything in it */
+  CHECK(received.findKey("list"));
+  CHECK(received.unpack());
+  CHECK(received.unpack(text, sizeof(text)));
+  CHECK(strcmp(text, "b") == 0);
+  CHECK(received.unpack(text, sizeof(text)));
+  CHECK(strcmp(text, "xy") == 0);
+  CHECK(received.unpack(n16));
+  CHECK(n16 == 500);
+
+  /* Top level items; the position is kept when there are too few */
+  CHECK(received.seek(1));
+  CHECK(!received.seek(5));
+  CHECK(received.unpack(n16));
+  CHECK(n16 == 500);
+
+  CHECK(received.seek(0));
+  CHECK(received.findKey("b"));
+  CHECK(received.unpack(text, sizeof(text)));
+  CHECK(strcmp(text, "xy") == 0);
+
+  CHECK(received.seek(0));
+  CHECK(!received.findKey("zz"));
+  CHECK(received.findKey("a"));
+  CHECK(received.unpack(n8));
+  CHECK(n8 == 1);
+  return true;
+}
+
+static bool testMessageContainers(void)
+{
+  /* Begin()/End() give the same bytes as counts given up front, */
+  /* including when a header has to be widened */
+  CMessage counted;
+  CMessage begun;
+  CMessage received;
+  uint8_t i;
+
+  reset();
+  CHECK(counted.packMap(2));
+  CHECK(counted.pack((char *)"k"));
+  CHECK(counted.packArray(20));
+  for (i = 0; i < 20; i++)
+  {
+    CHECK(counted.pack(i));
+  }
+  CHECK(counted.pack((char *)"m"));
+  CHECK(counted.packArray(2));
+  CHECK(counted.packArray(0));
+  CHECK(counted.packMap(1));
+  CHECK(counted.pack((uint8_t)1));
+  CHECK(counted.pack(true));
+
+  CHECK(begun.packMapBegin());
+  CHECK(begun.pack((char *)"k"));
+  CHECK(begun.packArrayBegin());
+  for (i = 0; i < 20; i++)
+  {
+    CHECK(begun.pack(i));
+  }
+  CHECK(begun.packArrayEnd());
+  CHECK(begun.pack((char *)"m"));
+  CHECK(begun.packArrayBegin());
+  CHECK(begun.packArrayBegin());
+  CHECK(begun.packArrayEnd());
+  CHECK(begun.packMap(1));
+  CHECK(begun.pack((uint8_t)1));
+  CHECK(begun.pack(true));
+  CHECK(begun.packArrayEnd());
+  CHECK(begun.packMapEnd());
+
+  CHECK(begun.m_written == counted.m_written);
+  CHECK(memcmp(begun.m_data, counted.m_data, counted.m_written) == 0);
+  CHECK(roundTrip(begun, received));
+  CHECK(received.findKey("k"));
+  CHECK(received.unpack());
+  CHECK(received.unpack());
+  CHECK(received.unpack());
+  CHECK(received.getBufferDataRemaining() == 0);
+
+  /* Items still owed to packArray() */
+  begun.clearBuffer();
+  CHECK(begun.packArrayBegin());
+  CHECK(begun.packArray(2));
+  CHECK(begun.pack((uint8_t)1));
+  CHECK(!begun.packArrayEnd());
+  return true;
+}
+
+static bool testMessageCompact(void)
+{
+  /* Compact packing takes the shortest form, and unpacks to the same */
+  /* values and C types as packing by type */
+  CMessage message;
+  CMessage received;
+  uint32_t u32 = 0;
+  uint16_t u16 = 0;
+  int32_t s32 = 0;
+  int16_t s16 = 0;
+  char text[4];
+
+  reset();
+  message.setPackCompact(true);
+  CHECK(message.pack((uint32_t)5));
+  CHECK(message.m_written == 1);
+  CHECK(message.pack((uint16_t)200));
+  CHECK(message.m_written == 3);
+  CHECK(message.pack((int32_t)-3));
+  CHECK(message.m_written == 4);
+  CHECK(message.pack((int16_t)-200));
+  CHECK(message.m_written == 7);
+  CHECK(message.pack((uint32_t)70000));
+  CHECK(message.m_written == 12);
+  CHECK(message.pack((char *)"hi"));
+  CHECK(message.m_written == 15);
+
+  CHECK(roundTrip(message, received));
+  CHECK(received.unpack(u32));
+  CHECK(u32 == 5);
+  CHECK(received.unpack(u16));
+  CHECK(u16 == 200);
+  CHECK(received.unpack(s32));
+  CHECK(s32 == -3);
+  CHECK(received.unpack(s16));
+  CHECK(s16 == -200);
+  CHECK(received.unpack(u32));
+  CHECK(u32 == 70000);
+  CHECK(received.unpack(text, sizeof(text)));
+  CHECK(strcmp(text, "hi") == 0);
+  CHECK(received.getBufferDataRemaining() == 0);
+  return true;
+}
+
+typedef struct {
+  uint16_t temperature;
+  int8_t rssi;
+  char name[8];
+  uint8_t id[4];
+  float level;
+} READING;
+
+typedef CMessageSchema<READING,
+  BC_SCHEMA_FIELD(READING, temperature),
+  BC_SCHEMA_FIELD(READING, rssi),
+  BC_SCHEMA_FIELD(READING, name),
+  BC_SCHEMA_FIELD(READING, id),
+  BC_SCHEMA_FIELD(READING, level)> READING_SCHEMA;
+
+static bool testMessageSchema(void)
+{
+  /* Packs the same bytes as the fields packed by hand in fixed form, */
+  /* and unpacks what it packed */
+  READING reading = {60000, -100, "sensor", {1, 2, 3, 4}, 2.5f};
+  READING unpacked;
+  CMessage schema;
+  CMessage hand;
+  CMessage received;
+
+  reset();
+  CHECK(READING_SCHEMA::pack(schema, reading));
+
+  hand.setPackCompact(false);
+  CHECK(hand.pack(reading.temperature));
+  CHECK(hand.pack(reading.rssi));
+  CHECK(hand.pack(reading.name));
+  CHECK(hand.pack(reading.id, sizeof(reading.id)));
+  CHECK(hand.pack(reading.level));
+
+  CHECK(schema.m_written == hand.m_written);
+  CHECK(memcmp(schema.m_data, hand.m_data, hand.m_written) == 0);
+
+  CHECK(roundTrip(schema, received));
+  memset(&unpacked, 0, sizeof(unpacked));
+  CHECK(READING_SCHEMA::unpack(received, unpacked));
+  CHECK(unpacked.temperature == reading.temperature);
+  CHECK(unpacked.rssi == reading.rssi);
+  CHECK(strcmp(unpacked.name, reading.name) == 0);
+  CHECK(memcmp(unpacked.id, reading.id, sizeof(reading.id)) == 0);
+  CHECK(unpacked.level == reading.level);
+  return true;
+}
+
+static const TEST tests[] = {
+  {"resync, stale reset byte",    testResyncStaleReset},
+  {"resync, shield reset",        testResyncShieldReset},
+  {"service, max bytes",          testServiceMaxBytes},
+  {"deadline",                    testDeadline},
+  {"command too big",             testCommandTruncated},
+  {"command, no buffer",          testCommandNoBuffer},
+#ifdef BERGCLOUD_FRAGMENTATION
+  {"fragmented event",            testFragmentedEvent},
+  {"fragmented event, busy poll", testFragmentedEventBusyPoll},
+  {"fragmented command",          testFragmentedCommand},
+  {"fragmented command, lost",    testFragmentedCommandLost},
+  {"fragmented command, late",    testFragmentedCommandLate},
+  {"fragmented command, too big", testFragmentedCommandTruncated},
+#endif
+#ifdef BERGCLOUD_BATCHING
+  {"batch frame",                 testBatchFrame},
+  {"batch of one",                testBatchSingle},
+  {"batch full, caller busy",     testBatchFullBusy},
+  {"batch not reported",          testBatchNotReported},
+#endif
+#ifdef BERGCLOUD_EVENT_QUEUE
+  {"queue order",                 testQueueOrder},
+  {"queue retry limit",           testQueueRetryLimit},
+  {"queue not reported",          testQueueNotReported},
+#endif
+#ifdef BERGCLOUD_CACHE
+  {"cache hit",                   testCacheHit},
+  {"cache, busy",                 testCacheBusy},
+  {"cache expiry",                testCacheExpiry},
+#endif
+#ifdef BERGCLOUD_COMMAND_TABLE
+  {"command table",               testCommandTable},
+#ifndef BERGCLOUD_COMMAND_TABLE_FULL
+  {"command table full",          testCommandTableFull},
+#endif
+#endif
+#ifdef BERGCLOUD_STATS
+  {"stats",                       testStats},
+#endif
+#ifdef BERGCLOUD_TRACE
+  {"trace",                       testTrace},
+#endif
+  {"message navigation",          testMessageNavigation},
+  {"message containers",          testMessageContainers},
+  {"message compact",             testMessageCompact},
+  {"message schema",              testMessageSchema},
+  {NULL, NULL}
+};
+
+int main(void)
+{
+  const TEST *pTest;
+  int failed = 0;
+  int passed = 0;
+
+  for (pTest = tests; pTest->name != NULL; pTest++)
+  {
+    if (pTest->fn())
+    {
+      passed++;
+    }
+    else
+    {
+      printf("FAIL %s\n", pTest->name);
+      failed++;
+    }
+  }
+
+  printf("%d passed, %d failed\n", passed, failed);
+  return failed;
+}
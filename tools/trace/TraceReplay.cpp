@@ -0,0 +1,499 @@
+/*
+    TraceReplay - Replays a frame trace captured with BERGCLOUD_TRACE
+                  through the library's framing code on the host, against
+                  a shield that answers each request with the response
+                  that was recorded.
+
+    Build and run from this directory:
+
+      g++ -O2 -I../../BERGCloud TraceReplay.cpp ../../BERGCloud/BERGCloudBase.cpp \
+        ../../BERGCloud/BERGCloudLinux.cpp ../../BERGCloud/CRC16.cpp \
+        ../../BERGCloud/Message.cpp ../../BERGCloud/Buffer.cpp -o tracereplay
+      ./tracereplay capture.txt [passes]
+
+    The capture is any text containing the "BCT:" lines printed by
+    traceDump(); other lines are ignored. Each recorded request is made
+    again with the matching library call and the result compared with
+    the recorded one. Requests the public API can't make (fragmented or
+    batched events, unknown commands) are skipped. With passes, the
+    trace is then replayed that many times more to time the framing.
+
+    This example code is in the public domain.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "BERGCloud.h"
+
+#define MAX_TRANSACTIONS (4096)
+
+/* Poll and sync timeouts for transactions that failed without a response */
+#define REPLAY_TIMEOUT_MS (10)
+
+typedef struct {
+  uint32_t time_mS;
+  uint8_t request[MAX_DATA_SIZE];
+  uint16_t requestSize;
+  uint8_t response[MAX_DATA_SIZE];
+  uint16_t responseSize;  /* Header and data as recorded */
+  bool partial;           /* Response data wasn't all recorded */
+  bool ended;
+  bool transferred;
+  uint8_t endState;
+} TRANSACTION;
+
+static TRANSACTION transactions[MAX_TRANSACTIONS];
+static uint16_t transactionCount;
+static uint16_t syncCount;
+
+class CReplayShield : public CBERGCloudTransport
+{
+public:
+  CReplayShield(void) : m_pTr(NULL), m_state(IDLE), m_mismatches(0), m_bytes(0) {}
+  bool transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS);
+  void setTransaction(const TRANSACTION *pTr) { m_pTr = pTr; }
+  uint32_t getMismatches(void) { return m_mismatches; }
+  uint32_t getBytes(void) { return m_bytes; }
+private:
+  uint8_t clock(uint8_t dataOut, bool finalCS);
+  const TRANSACTION *m_pTr;
+  enum { IDLE, REQUEST, RESPONSE, NO_RESPONSE } m_state;
+  uint8_t m_request[MAX_DATA_SIZE];
+  uint16_t m_requestSize;
+  uint16_t m_requestExpected;
+  uint16_t m_responseSent;
+  uint32_t m_mismatches;
+  uint32_t m_bytes;
+};
+
+bool CReplayShield::transfer(uint8_t *pDataOut, uint8_t *pDataIn, uint16_t dataSize, bool finalCS)
+{
+  uint16_t i;
+
+  for (i = 0; i < dataSize; i++)
+  {
+    pDataIn[i] = clock(pDataOut[i], finalCS && (i == (dataSize - 1)));
+  }
+
+  return true;
+}
+
+uint8_t CReplayShield::clock(uint8_t dataOut, bool finalCS)
+{
+  uint8_t dataIn = SPI_PROTOCOL_PAD;
+
+  m_bytes++;
+
+  if (finalCS)
+  {
+    /* Only used when synchronising */
+    m_state = IDLE;
+    return SPI_PROTOCOL_RESET;
+  }
+
+  switch (m_state)
+  {
+  case IDLE:
+    if (dataOut == SPI_PROTOCOL_PAD)
+    {
+      break;
+    }
+
+    m_requestSize = 0;
+    m_requestExpected = SPI_PROTOCOL_HEADER_SIZE;
+    m_state = REQUEST;
+    /* Fall through */
+
+  case REQUEST:
+    m_request[m_requestSize++] = dataOut;
+
+    if (m_requestSize == 2)
+    {
+      m_requestExpected = ((uint16_t)m_request[0] << 8) | m_request[1];
+
+      if ((m_requestExpected < SPI_PROTOCOL_HEADER_SIZE) || (m_requestExpected > MAX_DATA_SIZE))
+      {
+        m_requestExpected = SPI_PROTOCOL_HEADER_SIZE;
+      }
+    }
+
+    if (m_requestSize == m_requestExpected)
+    {
+      if ((m_pTr == NULL) || (m_requestSize != m_pTr->requestSize) ||
+          (memcmp(m_request, m_pTr->request, m_requestSize) != 0))
+      {
+        m_mismatches++;
+      }
+
+      m_responseSent = 0;
+      m_state = ((m_pTr != NULL) && (m_pTr->responseSize > 0)) ? RESPONSE : NO_RESPONSE;
+    }
+    break;
+
+  case RESPONSE:
+    dataIn = m_pTr->response[m_responseSent++];
+
+    if (m_responseSent == m_pTr->responseSize)
+    {
+      m_state = IDLE;
+    }
+    break;
+
+  case NO_RESPONSE:
+    /* Pad until the library times out */
+    break;
+  }
+
+  return dataIn;
+}
+
+static bool parseTrace(FILE *pFile)
+{
+  /* Read the bytes from each "BCT:" line, then split them into records */
+  static uint8_t trace[MAX_TRANSACTIONS * 4 * MAX_DATA_SIZE];
+  char line[256];
+  char *pText;
+  char *pEnd;
+  uint32_t traceSize = 0;
+  uint32_t offset = 0;
+  uint32_t time_mS;
+  uint16_t size;
+  uint16_t claimed;
+  uint8_t type;
+  TRANSACTION *pTr = NULL;
+
+  while (fgets(line, sizeof(line), pFile) != NULL)
+  {
+    pText = strstr(line, "BCT:");
+
+    if (pText == NULL)
+    {
+      continue;
+    }
+
+    pText += 4;
+
+    while (traceSize < sizeof(trace))
+    {
+      unsigned long value = strtoul(pText, &pEnd, 16);
+
+      if (pEnd == pText)
+      {
+        break;
+      }
+
+      trace[traceSize++] = (uint8_t)value;
+      pText = pEnd;
+    }
+  }
+
+  while ((offset + BC_TRACE_RECORD_HEADER_SIZE) <= traceSize)
+  {
+    type = trace[offset];
+    time_mS = ((uint32_t)trace[offset + 1] << 24) | ((uint32_t)trace[offset + 2] << 16) |
+      ((uint32_t)trace[offset + 3] << 8) | trace[offset + 4];
+    size = trace[offset + 5];
+    offset += BC_TRACE_RECORD_HEADER_SIZE;
+
+    if ((offset + size) > traceSize)
+    {
+      fprintf(stderr, "Trace truncated\n");
+      break;
+    }
+
+    switch (type)
+    {
+    case BC_TRACE_REQUEST:
+      if ((transactionCount == MAX_TRANSACTIONS) || (size > MAX_DATA_SIZE))
+      {
+        pTr = NULL;
+        break;
+      }
+
+      pTr = &transactions[transactionCount++];
+      memset(pTr, 0, sizeof(TRANSACTION));
+      pTr->time_mS = time_mS;
+      memcpy(pTr->request, &trace[offset], size);
+      pTr->requestSize = size;
+      break;
+
+    case BC_TRACE_RESPONSE:
+      if ((pTr != NULL) && (size == SPI_PROTOCOL_HEADER_SIZE))
+      {
+        memcpy(pTr->response, &trace[offset], size);
+        pTr->responseSize = size;
+      }
+      break;
+
+    case BC_TRACE_DATA:
+      if ((pTr != NULL) && (pTr->responseSize == SPI_PROTOCOL_HEADER_SIZE) &&
+          ((SPI_PROTOCOL_HEADER_SIZE + size) <= MAX_DATA_SIZE))
+      {
+        memcpy(&pTr->response[SPI_PROTOCOL_HEADER_SIZE], &trace[offset], size);
+        pTr->responseSize += size;
+
+        /* Data beyond the device's receive buffers wasn't recorded, */
+        /* send zeros in its place */
+        claimed = ((uint16_t)pTr->response[0] << 8) | pTr->response[1];
+
+        if ((claimed > pTr->responseSize) && (claimed <= MAX_DATA_SIZE))
+        {
+          pTr->partial = true;
+          pTr->responseSize = claimed;
+        }
+      }
+      break;
+
+    case BC_TRACE_SYNC:
+      syncCount++;
+      break;
+
+    case BC_TRACE_END:
+      if ((pTr != NULL) && (size == 2))
+      {
+        pTr->ended = true;
+        pTr->endState = trace[offset];
+        pTr->transferred = (trace[offset + 1] != 0);
+      }
+      break;
+
+    default:
+      fprintf(stderr, "Unknown record type %u\n", type);
+      return false;
+    }
+
+    offset += size;
+  }
+
+  return true;
+}
+
+static int replay(const TRANSACTION *pTr)
+{
+  /* Make the library call that sent this request. Returns 1 if it */
+  /* succeeded, 0 if it failed and -1 if it can't be replayed. */
+  static uint8_t buffer[MAX_DATA_SIZE];
+  static char text[MAX_DATA_SIZE + 1];
+  static CMessage message;
+  const uint8_t *pData = &pTr->request[SPI_PROTOCOL_HEADER_SIZE];
+  uint16_t size = pTr->requestSize - SPI_PROTOCOL_HEADER_SIZE;
+  uint16_t commandSize;
+  uint8_t commandID;
+  uint8_t state;
+  int8_t rssi;
+  bool ok;
+
+  switch (pTr->request[4])
+  {
+  case SPI_CMD_GET_NETWORK_STATE:
+    ok = BERGCloud.getNetworkState(&state);
+    break;
+
+  case SPI_CMD_GET_CLAIMCODE:
+    ok = BERGCloud.getClaimcode(text, sizeof(text));
+    break;
+
+  case SPI_CMD_GET_CLAIM_STATE:
+    ok = BERGCloud.getClaimingState(&state);
+    break;
+
+  case SPI_CMD_GET_SIGNAL_QUALITY:
+    ok = BERGCloud.getSignalQuality(&rssi, &state);
+    break;
+
+  case SPI_CMD_GET_EUI64:
+    if (size != 1)
+    {
+      return -1;
+    }
+
+    ok = BERGCloud.getEUI64(pData[0], buffer, sizeof(buffer));
+    break;
+
+  case SPI_CMD_SEND_PRODUCT_ANNOUNCE:
+    if (size != 20)
+    {
+      return -1;
+    }
+
+    ok = BERGCloud.joinNetwork(pData, ((uint32_t)pData[16] << 24) | ((uint32_t)pData[17] << 16) |
+      ((uint32_t)pData[18] << 8) | pData[19]);
+    break;
+
+  case SPI_CMD_POLL_FOR_COMMAND:
+    ok = BERGCloud.pollForCommand(buffer, sizeof(buffer), &commandSize, &commandID);
+    break;
+
+  case SPI_CMD_SET_DISPLAY_STYLE:
+    if (size != 1)
+    {
+      return -1;
+    }
+
+    ok = BERGCloud.setDisplayStyle(pData[0]);
+    break;
+
+  case SPI_CMD_DISPLAY_PRINT:
+    memcpy(text, pData, size);
+    text[size] = '\0';
+    ok = BERGCloud.print(text);
+    break;
+
+  case SPI_CMD_SEND_EVENT:
+    if ((size >= 2) && (pData[0] == (BC_EVENT_START_BINARY >> 8)))
+    {
+      memcpy(buffer, &pData[2], size - 2);
+      ok = BERGCloud.sendEvent(pData[1], buffer, size - 2);
+    }
+    else if ((size >= 2) && (pData[0] == (BC_EVENT_START_PACKED >> 8)))
+    {
+      message.clearBuffer();
+      memcpy(message.m_data, &pData[2], size - 2);
+      message.m_written = size - 2;
+      ok = BERGCloud.sendEvent(pData[1], message);
+    }
+    else
+    {
+      return -1;
+    }
+    break;
+
+  default:
+    return -1;
+  }
+
+  return ok ? 1 : 0;
+}
+
+static bool recordedResult(const TRANSACTION *pTr)
+{
+  /* What the library call returned on the device */
+  if (!pTr->transferred || (pTr->responseSize < SPI_PROTOCOL_HEADER_SIZE))
+  {
+    return false;
+  }
+
+  if (pTr->request[4] == SPI_CMD_POLL_FOR_COMMAND)
+  {
+    return (pTr->response[4] == SPI_RSP_SUCCESS) && (pTr->responseSize >= (SPI_PROTOCOL_HEADER_SIZE + 2));
+  }
+
+  return pTr->response[4] == SPI_RSP_SUCCESS;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+  static CReplayShield shield;
+  FILE *pFile;
+  uint32_t passes = 0;
+  uint32_t replayed = 0;
+  uint32_t skipped = 0;
+  uint32_t partial = 0;
+  uint32_t different = 0;
+  uint32_t pass;
+  uint32_t bytes;
+  uint16_t i;
+  double start;
+  int result;
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s capture.txt [passes]\n", argv[0]);
+    return 1;
+  }
+
+  pFile = fopen(argv[1], "r");
+
+  if (pFile == NULL)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+
+  if (!parseTrace(pFile))
+  {
+    fclose(pFile);
+    return 1;
+  }
+
+  fclose(pFile);
+
+  if (argc > 2)
+  {
+    passes = strtoul(argv[2], NULL, 0);
+  }
+
+  BERGCloud.begin(&shield);
+  BERGCloud.setTimeouts(REPLAY_TIMEOUT_MS, REPLAY_TIMEOUT_MS);
+  BERGCloud.setPollBackoff(0);
+
+  /* Replay once, comparing each result with the recorded one */
+  for (i = 0; i < transactionCount; i++)
+  {
+    shield.setTransaction(&transactions[i]);
+    result = replay(&transactions[i]);
+
+    if (result < 0)
+    {
+      skipped++;
+      continue;
+    }
+
+    replayed++;
+
+    if (transactions[i].partial)
+    {
+      /* The device's result can't be reproduced */
+      partial++;
+    }
+    else if (transactions[i].ended && ((result == 1) != recordedResult(&transactions[i])))
+    {
+      different++;
+      printf("%10lu ms  command %02x: recorded %s, replayed %s\n",
+        (unsigned long)transactions[i].time_mS, transactions[i].request[4],
+        recordedResult(&transactions[i]) ? "ok" : "failed", (result == 1) ? "ok" : "failed");
+    }
+  }
+
+  printf("%u transactions: %lu replayed, %lu skipped, %lu partial, %u resyncs recorded\n",
+    transactionCount, (unsigned long)replayed, (unsigned long)skipped,
+    (unsigned long)partial, syncCount);
+  printf("%lu request mismatches, %lu result mismatches\n",
+    (unsigned long)shield.getMismatches(), (unsigned long)different);
+
+  if ((passes == 0) || (replayed == 0))
+  {
+    return (different > 0) ? 2 : 0;
+  }
+
+  /* Time further passes */
+  BERGCloud.setLogOutput(false, false);
+  bytes = shield.getBytes();
+  start = now_s();
+
+  for (pass = 0; pass < passes; pass++)
+  {
+    for (i = 0; i < transactionCount; i++)
+    {
+      shield.setTransaction(&transactions[i]);
+      replay(&transactions[i]);
+    }
+  }
+
+  printf("%lu passes: %.2f us/transaction, %.1f bytes/transaction\n", (unsigned long)passes,
+    ((now_s() - start) * 1e6) / ((double)passes * replayed),
+    (double)(shield.getBytes() - bytes) / ((double)passes * replayed));
+
+  return (different > 0) ? 2 : 0;
+}